@@ -1,19 +1,48 @@
 /*** includes ***/
+#define _GNU_SOURCE
+
 #include <ctype.h>
+#include <dirent.h>
+#include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
+#include <linux/io_uring.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*** defines ***/
 
 #define PICO_VERSION "0.0.5"
 
+#define PICO_MESSAGE_TIMEOUT 5
+
 #define CTRL_KEY(k) ((k) & 0x1f)
+#define ALT_KEY(k) (0x10000 | (k))
 
 enum editor_key {
   ARROW_LEFT = 1000,
@@ -24,11 +53,210 @@ enum editor_key {
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  CTRL_LEFT,                    /* modified arrows, in the order above */
+  CTRL_RIGHT,
+  CTRL_UP,
+  CTRL_DOWN,
+  ALT_LEFT,
+  ALT_RIGHT,
+  ALT_UP,
+  ALT_DOWN,
+  SHIFT_UP,
+  SHIFT_DOWN,
+  MOUSE_EVENT,                  /* details in config.mouse */
+  PASTE_EVENT,                  /* pasted text in config.paste */
+  TERMINAL_REPLY,               /* answer to a query, already handled */
+  WAKEUP_EVENT                  /* a background job finished */
+};
+
+/* What a cursor position report we asked for is the answer to */
+enum cpr_probe {
+  CPR_SIZE,                     /* cursor moved to the bottom right corner */
+  CPR_REP                       /* cursor after a character repeated by REP */
+};
+
+#define MOUSE_BUTTON_MASK 0x43  /* button number, including wheel bit */
+#define MOUSE_MOTION 0x20
+#define MOUSE_LEFT 0
+#define MOUSE_WHEEL_UP 0x40
+#define MOUSE_WHEEL_DOWN 0x41
+#define MOUSE_WHEEL_LINES 3
+
+#define CAP_REP (1 << 0)        /* repeat preceding character (REP) */
+#define CAP_SYNC (1 << 1)       /* synchronized output, mode 2026 */
+#define CAP_PASTE (1 << 2)      /* bracketed paste, mode 2004 */
+#define CAP_TRUECOLOR (1 << 3)  /* 24 bit SGR colors */
+
+#define PROBE_MAX_CPR 4
+
+#define HIST_SUB_BITS 5         /* 32 sub-buckets per power of two, ~3% */
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+#define LATENCY_MAX_PENDING 64
+
+/* Who an allocation is for */
+enum alloc_subsystem {
+  ALLOC_ROWS,                   /* file contents */
+  ALLOC_SCREEN,                 /* cell grids, sized with the terminal */
+  ALLOC_OUTPUT,                 /* escape sequences of a frame */
+  ALLOC_INPUT,                  /* paste and macro buffers */
+  ALLOC_PROMPT,
+  ALLOC_SEARCH,
+  ALLOC_TRACE,
+  ALLOC_VCS,
+  ALLOC_INDEX,
+  ALLOC_IO,                     /* chunks in flight */
+  ALLOC_COUNT
+};
+
+/* Subsystems that --alloc-check allows no allocations in after the first
+ * frame */
+#define ALLOC_HOT ((1 << ALLOC_OUTPUT) | (1 << ALLOC_INPUT))
+#define STYLE_SGR_MAX 32        /* longest SGR of a style, with its NUL */
+/* The most a frame sends per cell: a cursor movement, a style switch and a
+ * four byte glyph, when every other cell changes style. A frame adds a few
+ * sequences of its own. */
+#define OUTPUT_RESERVE_PER_CELL (16 + STYLE_SGR_MAX + 4)
+#define OUTPUT_RESERVE_FRAME 256
+#define PASTE_RESERVE 4096
+#define MACRO_RESERVE 1024
+
+/* How a line differs from the file in git HEAD */
+enum vcs_mark {
+  VCS_NONE = 0,
+  VCS_ADDED,
+  VCS_CHANGED,
+  VCS_DELETED                   /* lines were deleted above this one */
+};
+
+#define VCS_DIFF_MAX_CELLS (4 << 20)    /* largest LCS table */
+
+/* What the scrollbar shows, by priority */
+enum density_kind {
+  DENSITY_MATCHES,
+  DENSITY_ERRORS,
+  DENSITY_CHANGES,              /* vcs marks */
+  DENSITY_COUNT
+};
+
+#define IO_DEPTH 16             /* chunks in flight */
+#define IO_CHUNK (1 << 20)
+
+enum compression {
+  COMPRESS_NONE,
+  COMPRESS_GZIP,
+  COMPRESS_ZSTD
+};
+
+#define COMPRESS_BLOCK (1 << 20)        /* text compressed on its own */
+#define COMPRESS_MAX_THREADS 32
+#define COMPRESS_GZIP_LEVEL 6
+#define COMPRESS_ZSTD_LEVEL 3
+
+#define DENSITY_BUCKETS 1024
+#define SCROLLBAR_WIDTH 1
+#define TAB_STOP 8
+
+#define JSON_SCAN_CHUNK (1 << 20)
+#define JSON_MAX_DEPTH 32       /* levels shown in the path */
+#define JSON_MAX_KEY 40
+#define JSON_FOLD_TEXT "..."    /* shown for the inside of a fold */
+#define MAX_SEGMENTS 256
+#define PRETTY_INDENT 2         /* columns per level in the pretty view */
+
+#define HL_MAX_RULES 64         /* highlight rules */
+#define HL_MAX_SPANS 32         /* highlighted spans kept per row */
+#define HL_CACHE_ROWS 1024      /* rows with cached spans, by row number */
+#define HL_SCAN_BYTES 4096      /* bytes of a row the rules look at */
+
+#define TRACE_RING_SPANS 4096   /* most recent spans kept per thread */
+#define TRACE_MAX_RINGS 256
+
+/* Startup phases timed by --startup-profile */
+enum startup_phase {
+  PHASE_RAW_MODE,
+  PHASE_INIT,
+  PHASE_WINDOW_SIZE,            /* part of PHASE_INIT */
+  PHASE_OPEN,
+  PHASE_INDEX,                  /* part of PHASE_OPEN */
+  PHASE_FIRST_FRAME,
+  PHASE_COUNT
+};
+
+enum screen_style {
+  STYLE_NORMAL = 0,
+  STYLE_REVERSE,
+  STYLE_HIGHLIGHT,              /* rule i draws in STYLE_HIGHLIGHT + i */
+  STYLE_COUNT = STYLE_HIGHLIGHT + HL_MAX_RULES
 };
 
 /*** data ***/
 
+/* A decoded SGR mouse report; x and y are one based screen coordinates */
+typedef struct mouse_event {
+  int button;
+  int x, y;
+  int pressed;
+} mouse_event;
+
+/* Log-linear histogram in the style of HdrHistogram: values are grouped by
+ * power of two and each group is split into HIST_SUB linear buckets, which
+ * keeps the relative error constant from nanoseconds up. */
+typedef struct histogram {
+  unsigned long long counts[HIST_BUCKETS];
+  unsigned long long total;
+  unsigned long long max;
+} histogram;
+
+/* The character in a screen cell: up to four bytes of UTF-8, the first in
+ * the low byte */
+typedef unsigned int glyph;
+
+/* Cells of the screen, row by row */
+typedef struct screen_grid {
+  glyph *chars;
+  unsigned char *styles;        /* enum screen_style */
+} screen_grid;
+
+typedef struct _append_buffer {
+  char *buf;
+  int len;
+  int cap;                      /* bytes allocated */
+} append_buffer;
+
+#define ABUF_INIT {NULL, 0, 0}
+
+/* Marked rows counted in buckets of bucket_rows rows each */
+typedef struct density {
+  unsigned int counts[DENSITY_BUCKETS];
+  int bucket_rows;
+} density;
+
+/* A run of a row as shown on screen */
+typedef struct text_seg {
+  int from, to;                 /* bytes of the row */
+  int x;                        /* column in the text area */
+  int folded;                   /* hidden, JSON_FOLD_TEXT shown instead */
+} text_seg;
+
+/* A line of the pretty view: bytes [start, end) of the document, where
+ * start is just after a line break the view inserts */
+typedef struct pretty_line {
+  long long start, end;
+  int depth;
+} pretty_line;
+
+/* Where the pretty view is */
+typedef struct pretty_state {
+  pretty_line top;              /* first line on screen */
+  pretty_line line;             /* line of the cursor */
+  long long at;                 /* offset of the cursor */
+  int y;                        /* screen line of the cursor */
+  int col_offset;
+  int want_x;                   /* column moving up and down keeps to */
+} pretty_state;
+
 /* Stores a line of text */
 typedef struct erow {
   int size;
@@ -42,12 +270,505 @@ struct editor_config {
   int terminal_rows;            /* terminal height */
   int terminal_cols;            /* terminal width */
   int num_rows;                 /* number of editor rows */
+  int row_cap;                  /* rows allocated */
   erow *row;                    /* editor rows */
+  char *filename;               /* currently open file */
+  int compression;              /* how the file was compressed */
+  int gutter_width;             /* line numbers and marks, 0 without rows */
+  unsigned char *vcs_marks;     /* enum vcs_mark of every row, or NULL */
+  int vcs_generation;           /* bumped whenever the marks go stale */
+  density density[DENSITY_COUNT];       /* for the scrollbar */
+  struct json_index *json;      /* structural index, or NULL */
+  struct highlight *highlight;  /* highlight rules, or NULL without any */
+  struct file_index *files;     /* quick open index, or NULL until used */
+  struct symbol_index *symbols; /* outline of the file, or NULL */
+  int *json_folds;              /* folded opening brackets, in order */
+  int num_json_folds;
+  char json_path[160];          /* path of the element under the cursor */
+  long long json_path_at;       /* cursor offset json_path is for */
+  int wake_fds[2];              /* pipe that wakes read_key */
+  int *macro_keys;              /* recorded keyboard macro */
+  int macro_len;
+  int macro_cap;
+  int macro_recording;          /* keys read are appended to the macro */
+  int macro_pos;                /* next key to replay, -1 when not replaying */
+  int rendering_suspended;      /* skip drawing while a macro replays */
+  mouse_event mouse;            /* last mouse report */
+  int sel_active;               /* text between sel_x/y and cursor selected */
+  int sel_x, sel_y;             /* selection anchor */
+  int dragging;                 /* left button held down */
+  int scroll_pending;           /* wheel scrolling not yet applied */
+  int drawn_row_offset;         /* row_offset of the frame on screen */
+  int drawn_col_offset;         /* col_offset of the frame on screen */
+  screen_grid front;            /* cells the terminal shows */
+  screen_grid back;             /* cells of the frame being drawn */
+  append_buffer out;            /* output of a frame, kept between frames */
+  int screen_rows, screen_cols; /* size of both grids */
+  int front_valid;              /* front matches the terminal */
+  int term_x, term_y;           /* terminal cursor, -1 if unknown */
+  int term_style;               /* terminal SGR state, -1 if unknown */
+  int term_cursor_hidden;
+  int term_caps;                /* CAP_* features the terminal supports */
+  int probe_caps;               /* CAP_* confirmed by the running probe */
+  int probing;                  /* waiting for the probe's DA1 answer */
+  int cpr_queue[PROBE_MAX_CPR]; /* cursor reports asked for, oldest first */
+  int cpr_len;
+  char *paste;                  /* text of the last bracketed paste */
+  int paste_len;
+  int paste_cap;
+  int output_stats;             /* --output-stats: report bytes on exit */
+  long long bytes_sent;         /* output written by screen_flush */
+  long long bytes_full;         /* output full redraws would have needed */
+  histogram latency;            /* input to display latency, ns */
+  unsigned long long pending_input[LATENCY_MAX_PENDING];  /* decode times */
+  int num_pending_input;        /* inputs no frame has shown yet */
+  int show_overlay;             /* draw the latency overlay */
+  int latency_report;           /* --latency-report: report on exit */
+  int startup_profile;          /* --startup-profile: report on exit */
+  unsigned long long startup_ns;        /* when main started */
+  unsigned long long first_frame_ns;    /* time to first frame */
+  unsigned long long phase_ns[PHASE_COUNT];
+  int alloc_stats;              /* --alloc-stats: report on exit */
+  int alloc_check;              /* --alloc-check: exit on hot allocations */
+  int alloc_failed;             /* the check caught an allocation */
+  unsigned long long alloc_last[ALLOC_COUNT];   /* by the last frame */
+  unsigned long long alloc_frames;
+  unsigned long long alloc_frames_allocating;
+  unsigned long long alloc_frame_max;
+  char status_msg[80];          /* message bar text */
+  time_t status_msg_time;       /* when status_msg was set */
   struct termios orig_termios;  /* original terminal settings */
 };
 
 struct editor_config config;
 
+/*** prototypes ***/
+
+void set_status_message (const char *fmt, ...);
+void refresh_screen ();
+char *editor_prompt (char *prompt);
+void grep_project ();
+void group_rows ();
+void stats_rows ();
+void multi_search ();
+void approx_search ();
+void multiline_search ();
+void line_finder ();
+void quick_open ();
+void symbols_start ();
+void symbols_stop ();
+void symbols_collect ();
+void symbol_outline ();
+void goto_definition ();
+void process_key_press ();
+int probe_reply_csi (const char *params, char final);
+void probe_reply_dcs (const char *data);
+void vcs_refresh ();
+void vcs_collect ();
+void json_start ();
+void json_stop ();
+void json_collect ();
+int num_len (int n);
+void pretty_view ();
+void highlight_styles ();
+void highlight_forget ();
+void highlight_command ();
+void ab_reserve (append_buffer *ab, int size, int sub);
+void load_bytes (append_buffer *partial, char *s, size_t len);
+void ab_append (append_buffer *ab, const char *s, int len);
+
+/*** timing ***/
+
+unsigned long long now_ns ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int hist_index (unsigned long long value)
+{
+  int shift;
+
+  if (value < HIST_SUB) return value;
+  shift = 63 - __builtin_clzll (value) - HIST_SUB_BITS;
+  return (shift + 1) * HIST_SUB + (int) ((value >> shift) - HIST_SUB);
+}
+
+/* Returns the middle of the values that fall into bucket index. */
+unsigned long long hist_value (int index)
+{
+  int shift;
+
+  if (index < HIST_SUB) return index;
+  shift = index / HIST_SUB - 1;
+  return ((unsigned long long) (index % HIST_SUB + HIST_SUB) << shift) +
+    ((1ULL << shift) >> 1);
+}
+
+void hist_record (histogram *h, unsigned long long value)
+{
+  h->counts[hist_index (value)]++;
+  h->total++;
+  if (value > h->max) h->max = value;
+}
+
+/* Returns the value below which p percent of the recorded values fall. */
+unsigned long long hist_percentile (histogram *h, double p)
+{
+  unsigned long long rank = (unsigned long long) (p / 100.0 * h->total);
+  unsigned long long seen = 0;
+  int i;
+
+  if (h->total == 0) return 0;
+  if (rank >= h->total) rank = h->total - 1;
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen > rank) {
+      unsigned long long value = hist_value (i);
+      return value < h->max ? value : h->max;
+    }
+  }
+  return h->max;
+}
+
+/* Adds the time since start to a startup phase. */
+void profile_phase (int phase, unsigned long long start)
+{
+  config.phase_ns[phase] += now_ns () - start;
+}
+
+void print_startup_profile ()
+{
+  static const char *names[PHASE_COUNT] = {
+    "enable_raw_mode",
+    "init_editor",
+    "  get_window_size",
+    "open file",
+    "  indexing",
+    "first refresh_screen"
+  };
+  int i;
+
+  fprintf (stderr, "pico: startup profile\n");
+  for (i = 0; i < PHASE_COUNT; i++) {
+    fprintf (stderr, "  %-22s %8.3f ms\n", names[i], config.phase_ns[i] / 1e6);
+  }
+  fprintf (stderr, "  %-22s %8.3f ms\n", "time to first frame",
+      config.first_frame_ns / 1e6);
+}
+
+/* Notes when an input was decoded; the frame that shows it completes the
+ * measurement in screen_flush. */
+void latency_input ()
+{
+  if (config.num_pending_input < LATENCY_MAX_PENDING) {
+    config.pending_input[config.num_pending_input++] = now_ns ();
+  }
+}
+
+void latency_frame_written ()
+{
+  unsigned long long now = now_ns ();
+  int i;
+
+  for (i = 0; i < config.num_pending_input; i++) {
+    hist_record (&config.latency, now - config.pending_input[i]);
+  }
+  config.num_pending_input = 0;
+}
+
+/* Formats p50, p99 and max of the latency histogram into buf. */
+int latency_summary (char *buf, size_t size)
+{
+  histogram *h = &config.latency;
+  return snprintf (buf, size, "latency p50 %.2fms p99 %.2fms max %.2fms "
+      "(%llu inputs)", hist_percentile (h, 50) / 1e6,
+      hist_percentile (h, 99) / 1e6, h->max / 1e6, h->total);
+}
+
+/*** memory ***/
+
+/* Every allocation names the subsystem it is for, so --alloc-stats can
+ * show who allocates and --alloc-check can prove that key presses and
+ * frames don't. The counters are atomic because the grep workers allocate
+ * as well. Memory that getline allocates itself is counted with mem_note. */
+
+typedef struct alloc_counter {
+  atomic_ullong allocs;         /* malloc, calloc and realloc calls */
+  atomic_ullong frees;
+  atomic_ullong bytes;          /* bytes asked for */
+} alloc_counter;
+
+const char *alloc_names[ALLOC_COUNT] = {
+  "rows", "screen", "output", "input", "prompt", "search", "trace", "vcs",
+  "index", "io"
+};
+
+alloc_counter alloc_counters[ALLOC_COUNT];
+
+void mem_note (int sub, size_t size)
+{
+  atomic_fetch_add_explicit (&alloc_counters[sub].allocs, 1,
+      memory_order_relaxed);
+  atomic_fetch_add_explicit (&alloc_counters[sub].bytes, size,
+      memory_order_relaxed);
+}
+
+void *mem_alloc (int sub, size_t size)
+{
+  mem_note (sub, size);
+  return malloc (size);
+}
+
+void *mem_calloc (int sub, size_t count, size_t size)
+{
+  mem_note (sub, count * size);
+  return calloc (count, size);
+}
+
+void *mem_realloc (int sub, void *ptr, size_t size)
+{
+  mem_note (sub, size);
+  return realloc (ptr, size);
+}
+
+char *mem_strdup (int sub, const char *s)
+{
+  mem_note (sub, strlen (s) + 1);
+  return strdup (s);
+}
+
+/* asprintf into *out; returns -1 on failure like asprintf. */
+int mem_asprintf (int sub, char **out, const char *fmt, ...)
+{
+  va_list ap;
+  int len;
+
+  va_start (ap, fmt);
+  len = vasprintf (out, fmt, ap);
+  va_end (ap);
+  if (len != -1) mem_note (sub, len + 1);
+  return len;
+}
+
+void mem_free (int sub, void *ptr)
+{
+  if (ptr) {
+    atomic_fetch_add_explicit (&alloc_counters[sub].frees, 1,
+        memory_order_relaxed);
+  }
+  free (ptr);
+}
+
+/* Stores the allocation count of every subsystem in counts. */
+void alloc_snapshot (unsigned long long *counts)
+{
+  int i;
+  for (i = 0; i < ALLOC_COUNT; i++) {
+    counts[i] = atomic_load_explicit (&alloc_counters[i].allocs,
+        memory_order_relaxed);
+  }
+}
+
+/* Accounts for one pass of the main loop, the keys it handled and the
+ * frame it drew, given the counts from before it. */
+void alloc_frame_done (unsigned long long *before)
+{
+  unsigned long long after[ALLOC_COUNT], total = 0;
+  int i, hot = 0;
+
+  alloc_snapshot (after);
+  for (i = 0; i < ALLOC_COUNT; i++) {
+    config.alloc_last[i] = after[i] - before[i];
+    total += config.alloc_last[i];
+    if ((ALLOC_HOT & (1 << i)) && config.alloc_last[i]) hot = 1;
+  }
+  config.alloc_frames++;
+  if (total) config.alloc_frames_allocating++;
+  if (total > config.alloc_frame_max) config.alloc_frame_max = total;
+
+  if (config.alloc_check && hot) {
+    config.alloc_failed = 1;
+    write (STDOUT_FILENO, "\x1b[2J", 4);
+    write (STDOUT_FILENO, "\x1b[H", 3);
+    exit (1);
+  }
+}
+
+void print_alloc_stats ()
+{
+  int i;
+
+  fprintf (stderr, "pico: allocations     calls     frees         bytes\n");
+  for (i = 0; i < ALLOC_COUNT; i++) {
+    alloc_counter *c = &alloc_counters[i];
+    fprintf (stderr, "  %-16s %10llu %9llu %13llu\n", alloc_names[i],
+        (unsigned long long) atomic_load (&c->allocs),
+        (unsigned long long) atomic_load (&c->frees),
+        (unsigned long long) atomic_load (&c->bytes));
+  }
+  fprintf (stderr, "  %llu of %llu frames allocated, at most %llu times\n",
+      config.alloc_frames_allocating, config.alloc_frames,
+      config.alloc_frame_max);
+}
+
+/*** tracing ***/
+
+/* Spans time sections of work on any thread. Every thread records into a
+ * ring of its own, so recording takes no locks: the owner fills a slot and
+ * then publishes it by advancing head. Exporting copies the rings while
+ * they are being written and drops whatever the owner may have overwritten
+ * during the copy. The output is Chrome trace-event JSON, which
+ * chrome://tracing and Perfetto show as one timeline. */
+
+typedef struct trace_entry {
+  const char *name;             /* string constant */
+  const char *thread;           /* string constant */
+  unsigned long long start, end;        /* now_ns */
+  int tid;
+} trace_entry;
+
+typedef struct trace_ring {
+  trace_entry spans[TRACE_RING_SPANS];
+  atomic_ullong head;           /* spans ever recorded */
+  atomic_int in_use;            /* owned by a running thread */
+  const char *thread;           /* name of the owner */
+  int tid;
+} trace_ring;
+
+_Atomic (trace_ring *) trace_rings[TRACE_MAX_RINGS];
+atomic_int trace_num_rings;
+pthread_key_t trace_key;
+pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+_Thread_local trace_ring *trace_own_ring;
+
+/* Hands the ring of an exiting thread to the next thread started. */
+void trace_release (void *ring)
+{
+  atomic_store (&((trace_ring *) ring)->in_use, 0);
+}
+
+void trace_key_create ()
+{
+  pthread_key_create (&trace_key, trace_release);
+}
+
+/* Names the calling thread on the timeline, taking a ring for it. Returns
+ * NULL if every ring is taken or one can't be allocated. */
+trace_ring *trace_thread (const char *name)
+{
+  trace_ring *ring = trace_own_ring;
+  int i, n;
+
+  if (!ring) {
+    n = atomic_load (&trace_num_rings);
+    for (i = 0; i < n && !ring; i++) {
+      int free_ring = 0;
+      trace_ring *r = atomic_load (&trace_rings[i]);
+      if (r && atomic_compare_exchange_strong (&r->in_use, &free_ring, 1)) {
+        ring = r;
+      }
+    }
+    if (!ring) {
+      if ((i = atomic_fetch_add (&trace_num_rings, 1)) >= TRACE_MAX_RINGS) {
+        atomic_fetch_sub (&trace_num_rings, 1);
+        return NULL;
+      }
+      /* the slot stays empty and this thread goes untraced */
+      if ((ring = mem_calloc (ALLOC_TRACE, 1, sizeof (trace_ring))) == NULL) {
+        return NULL;
+      }
+      atomic_store (&ring->in_use, 1);
+      atomic_store (&trace_rings[i], ring);
+    }
+    pthread_once (&trace_key_once, trace_key_create);
+    pthread_setspecific (trace_key, ring);
+    ring->tid = gettid ();
+    trace_own_ring = ring;
+  }
+  ring->thread = name;
+  return ring;
+}
+
+/* Records a span named name from start until now. */
+void trace_span (const char *name, unsigned long long start)
+{
+  trace_ring *ring = trace_own_ring;
+  unsigned long long head;
+  trace_entry *span;
+
+  if (!ring && (ring = trace_thread ("thread")) == NULL) return;
+  head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+  span = &ring->spans[head % TRACE_RING_SPANS];
+  span->name = name;
+  span->thread = ring->thread;
+  span->tid = ring->tid;
+  span->start = start;
+  span->end = now_ns ();
+  atomic_store_explicit (&ring->head, head + 1, memory_order_release);
+}
+
+/* Writes every span still held in a ring to path as Chrome trace events,
+ * with times in microseconds since startup. Returns the number of spans
+ * written, or -1 if the file can't be written. */
+int trace_export (const char *path)
+{
+  trace_entry *copy = mem_alloc (ALLOC_TRACE,
+      sizeof (trace_entry) * TRACE_RING_SPANS);
+  int pid = getpid ();
+  int events = 0, spans = 0;
+  int i, n;
+  FILE *fp;
+
+  if ((fp = fopen (path, "w")) == NULL) {
+    mem_free (ALLOC_TRACE, copy);
+    return -1;
+  }
+  fprintf (fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+  n = atomic_load (&trace_num_rings);
+  for (i = 0; i < n; i++) {
+    trace_ring *ring = atomic_load (&trace_rings[i]);
+    unsigned long long head, base, first, again, j;
+    int last_tid = 0;
+
+    if (!ring) continue;
+    head = atomic_load_explicit (&ring->head, memory_order_acquire);
+    base = head > TRACE_RING_SPANS ? head - TRACE_RING_SPANS : 0;
+    for (j = base; j < head; j++) {
+      copy[j - base] = ring->spans[j % TRACE_RING_SPANS];
+    }
+    /* slots the owner reached while we copied may hold newer spans */
+    again = atomic_load_explicit (&ring->head, memory_order_acquire);
+    first = again > TRACE_RING_SPANS ? again - TRACE_RING_SPANS : 0;
+    if (first < base) first = base;
+
+    for (j = first; j < head; j++) {
+      trace_entry *span = &copy[j - base];
+      unsigned long long start = span->start > config.startup_ns ?
+        span->start - config.startup_ns : 0;
+
+      if (span->tid != last_tid) {
+        fprintf (fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"tid\":%d,\"args\":{\"name\":\"%s\"}}", events++ ? "," : "",
+            pid, span->tid, span->thread);
+        last_tid = span->tid;
+      }
+      fprintf (fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+          "\"ts\":%.3f,\"dur\":%.3f}", span->name, pid, span->tid,
+          start / 1e3, (span->end - span->start) / 1e3);
+      events++;
+      spans++;
+    }
+  }
+
+  fprintf (fp, "\n]}\n");
+  mem_free (ALLOC_TRACE, copy);
+  if (fclose (fp) != 0) return -1;
+  return spans;
+}
+
 /*** terminal ***/
 
 void die (const char *msg)
@@ -60,6 +781,10 @@ void die (const char *msg)
 
 void disable_raw_mode ()
 {
+  write (STDOUT_FILENO, "\x1b[?1002l\x1b[?1006l", 16);
+  if (config.term_caps & CAP_PASTE) {
+    write (STDOUT_FILENO, "\x1b[?2004l", 8);
+  }
   if (tcsetattr (STDIN_FILENO, TCSAFLUSH, &config.orig_termios) == -1) {
     die ("tcsetattr");
   }
@@ -83,54 +808,143 @@ void enable_raw_mode ()
   if (tcsetattr (STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
     die ("tcsetattr");
   }
+
+  /* report button presses, drags and the wheel in SGR encoding */
+  write (STDOUT_FILENO, "\x1b[?1002h\x1b[?1006h", 16);
 }
 
-int read_key ()
+void record_key (int key)
+{
+  if (config.macro_len == config.macro_cap) {
+    config.macro_cap = config.macro_cap ? config.macro_cap * 2 : 64;
+    config.macro_keys = mem_realloc (ALLOC_INPUT, config.macro_keys,
+        sizeof (int) * config.macro_cap);
+  }
+  config.macro_keys[config.macro_len++] = key;
+}
+
+/* Reads a bracketed paste up to its end marker into config.paste. */
+int read_paste ()
 {
-  int nread;
+  const char *end_marker = "\x1b[201~";
+  int timeouts = 0;
   char c;
 
-  while ((nread = read (STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN) {
-      die ("read");
+  config.paste_len = 0;
+  while (1) {
+    int nread = read (STDIN_FILENO, &c, 1);
+    if (nread != 1) {
+      /* don't hang on a paste that never ends */
+      if ((nread == -1 && errno != EAGAIN) || ++timeouts == 10) break;
+      continue;
+    }
+    timeouts = 0;
+    if (config.paste_len == config.paste_cap) {
+      config.paste_cap = config.paste_cap ? config.paste_cap * 2 : 256;
+      config.paste = mem_realloc (ALLOC_INPUT, config.paste,
+          config.paste_cap);
+    }
+    config.paste[config.paste_len++] = c;
+    if (config.paste_len >= 6 &&
+        memcmp (&config.paste[config.paste_len - 6], end_marker, 6) == 0) {
+      config.paste_len -= 6;
+      break;
+    }
+  }
+  return PASTE_EVENT;
+}
+
+/* Decodes the parameters and final byte of a CSI sequence. */
+int decode_csi (const char *params, char final)
+{
+  int key, mod;
+
+  if (probe_reply_csi (params, final)) {
+    return TERMINAL_REPLY;
+  }
+
+  if (final == '~') {
+    switch (atoi (params)) {
+      case 1: return HOME_KEY;
+      case 2: return END_KEY;
+      case 3: return DEL_KEY;
+      case 5: return PAGE_UP;
+      case 6: return PAGE_DOWN;
+      case 7: return HOME_KEY;
+      case 8: return END_KEY;
+      case 200: return read_paste ();
     }
+    return '\x1b';
+  }
+
+  if ((final == 'M' || final == 'm') && params[0] == '<') {
+    /* SGR mouse report: ESC [ < button ; column ; row M (m on release) */
+    mouse_event *m = &config.mouse;
+    if (sscanf (&params[1], "%d;%d;%d", &m->button, &m->x, &m->y) != 3) {
+      return '\x1b';
+    }
+    m->pressed = final == 'M';
+    return MOUSE_EVENT;
   }
 
+  switch (final) {
+    case 'A': key = ARROW_UP; break;
+    case 'B': key = ARROW_DOWN; break;
+    case 'C': key = ARROW_RIGHT; break;
+    case 'D': key = ARROW_LEFT; break;
+    case 'H': return HOME_KEY;
+    case 'F': return END_KEY;
+    default: return '\x1b';
+  }
+
+  /* ESC [ 1 ; m A, where the modifier m is 2 for Shift, 3 for Alt and 5
+   * for Ctrl */
+  if (sscanf (params, "1;%d", &mod) != 1) return key;
+  if (mod == 5) return CTRL_LEFT + key - ARROW_LEFT;
+  if (mod == 3) return ALT_LEFT + key - ARROW_LEFT;
+  if (mod == 2 && key == ARROW_UP) return SHIFT_UP;
+  if (mod == 2 && key == ARROW_DOWN) return SHIFT_DOWN;
+  return key;
+}
+
+/* Decodes the input that starts with byte c. */
+int decode_input (char c)
+{
   if (c == '\x1b') {
-    char seq[3];
+    char seq[32];
+    unsigned int len = 0;
 
     if (read (STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-    if (read (STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
 
     if (seq[0] == '[') {
-      if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read (STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-        if (seq[2] == '~') {
-          switch (seq[1]) {
-            case '1': return HOME_KEY;
-            case '2': return END_KEY;
-            case '3': return DEL_KEY;
-            case '5': return PAGE_UP;
-            case '6': return PAGE_DOWN;
-            case '7': return HOME_KEY;
-            case '8': return END_KEY;
-          }
-        }
-      } else {
-        switch (seq[1]) {
-          case 'A': return ARROW_UP;
-          case 'B': return ARROW_DOWN;
-          case 'C': return ARROW_RIGHT;
-          case 'D': return ARROW_LEFT;
-          case 'H': return HOME_KEY;
-          case 'F': return END_KEY;
-        }
+      /* parameter and intermediate bytes run up to a final byte */
+      while (1) {
+        if (read (STDIN_FILENO, &c, 1) != 1) return '\x1b';
+        if (c >= 0x40 && c <= 0x7e) break;
+        if (len < sizeof (seq) - 1) seq[len++] = c;
+      }
+      seq[len] = '\0';
+      return decode_csi (seq, c);
+    } else if (seq[0] == 'P') {
+      /* device control string, terminated by ESC \ */
+      char prev = 0;
+      while (1) {
+        if (read (STDIN_FILENO, &c, 1) != 1) return '\x1b';
+        if (prev == '\x1b' && c == '\\') break;
+        if (c != '\x1b' && len < sizeof (seq) - 1) seq[len++] = c;
+        prev = c;
       }
+      seq[len] = '\0';
+      probe_reply_dcs (seq);
+      return TERMINAL_REPLY;
     } else if (seq[0] == 'O') {
+      if (read (STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
       switch (seq[1]) {
         case 'H': return HOME_KEY;
         case 'F': return END_KEY;
       }
+    } else if (seq[0] >= 'a' && seq[0] <= 'z') {
+      return ALT_KEY(seq[0]);
     }
 
     return '\x1b';
@@ -139,34 +953,82 @@ int read_key ()
   }
 }
 
-int get_cursor_position (int *rows, int *cols)
+/* Makes read_key return WAKEUP_EVENT; safe to call from any thread. */
+void wake_main ()
 {
-  char buf[32];
-  unsigned int i = 0;
+  char c = 0;
+  write (config.wake_fds[1], &c, 1);
+}
 
-  if (write (STDOUT_FILENO, "\x1b[6n", 4) != 4) {
-    return -1;
-  }
+/* Waits for a key or a wake up. */
+int decode_key ()
+{
+  struct pollfd fds[2] = {
+    {STDIN_FILENO, POLLIN, 0}, {config.wake_fds[0], POLLIN, 0}
+  };
+  unsigned long long start;
+  int nread, key;
+  char c;
 
-  while (i < sizeof (buf) - 1) {
-    if (read (STDIN_FILENO, &buf[i], 1) != 1) {
-      break;
+  while (1) {
+    if (poll (fds, 2, -1) == -1 && errno != EINTR) {
+      die ("poll");
     }
-    if (buf[i] == 'R') {
-      break;
+    if (fds[1].revents & POLLIN) {
+      char drain[64];
+      while (read (config.wake_fds[0], drain, sizeof (drain)) > 0);
+      return WAKEUP_EVENT;
+    }
+    if ((nread = read (STDIN_FILENO, &c, 1)) == 1) break;
+    if (nread == -1 && errno != EAGAIN) {
+      die ("read");
     }
-    i++;
   }
-  buf[i] = '\0';
 
-  if (buf[0] != '\x1b' || buf[1] != '[') {
-    return -1;
-  }
-  if (sscanf(&buf[2], "%d;%d", rows, cols) != 2) {
-    return -1;
+  start = now_ns ();
+  key = decode_input (c);
+  trace_span ("input decode", start);
+  return key;
+}
+
+/* Returns true if input is waiting to be read. */
+int input_pending ()
+{
+  struct pollfd fds = {STDIN_FILENO, POLLIN, 0};
+  return poll (&fds, 1, 0) > 0;
+}
+
+/* Returns the next key press. While a macro replays, keys come from the
+ * macro instead of the terminal; a replay that runs dry inside a prompt gets
+ * escape so the prompt is cancelled rather than waiting for input. */
+int read_key ()
+{
+  int c;
+
+  if (config.macro_pos >= 0) {
+    if (config.macro_pos < config.macro_len) {
+      return config.macro_keys[config.macro_pos++];
+    }
+    return '\x1b';
   }
 
-  return 0;
+  c = decode_key ();
+  if (c == WAKEUP_EVENT) {
+    vcs_collect ();
+    json_collect ();
+    symbols_collect ();
+    return c;
+  }
+  if (c != TERMINAL_REPLY) {
+    latency_input ();
+  }
+  /* mouse events and pastes carry state outside the key code, so they
+   * can't replay */
+  if (config.macro_recording && c != MOUSE_EVENT && c != PASTE_EVENT &&
+      c != TERMINAL_REPLY) {
+    record_key (c);
+  }
+  return c;
 }
 
 int get_window_size (int *rows, int *cols)
@@ -174,10 +1036,7 @@ int get_window_size (int *rows, int *cols)
   struct winsize size;
 
   if (ioctl (STDOUT_FILENO, TIOCGWINSZ, &size) == -1 || size.ws_col == 0) {
-    if (write (STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) {
-      return -1;
-    }
-    return get_cursor_position (rows, cols);
+    return -1;
   } else {
     *cols = size.ws_col;
     *rows = size.ws_row;
@@ -189,223 +1048,7374 @@ int get_window_size (int *rows, int *cols)
 
 void append_row (char *s, size_t len)
 {
-  config.row = realloc (config.row, sizeof (erow) * (config.num_rows + 1));
+  if (config.num_rows == config.row_cap) {
+    config.row_cap = config.row_cap ? config.row_cap * 2 : 64;
+    config.row = mem_realloc (ALLOC_ROWS, config.row,
+        sizeof (erow) * config.row_cap);
+  }
 
   int at = config.num_rows;
   config.row[at].size = len;
-  config.row[at].chars = malloc (len + 1);
+  config.row[at].chars = mem_alloc (ALLOC_ROWS, len + 1);
   memcpy (config.row[at].chars, s, len);
   config.row[at].chars[len] = '\0';
   config.num_rows++;
 }
 
-/*** file i/o ***/
-
-void editor_open (char *filename)
+/* Returns the column after len bytes of row text drawn from column x of
+ * the text area. Tabs go to the next tab stop and UTF-8 continuation bytes
+ * take no room. Past a screenful of bytes only being off screen matters,
+ * so the width is not worked out there. */
+int text_advance (const char *s, int len, int x)
 {
-  FILE *fp = fopen (filename, "r");
-  char *line = NULL;
-  size_t line_cap = 0;
-  ssize_t line_len;
-
-  if (!fp) { /* Unable to open file */
-    die ("fopen");
-  }
+  int i;
 
-  /* iterate over lines */
-  while ((line_len = getline (&line, &line_cap, fp)) != -1) {
-    /* Consume until end of line */
-    while (line_len > 0 && (line[line_len - 1] == '\n' ||
-          line[line_len - 1] == '\r')) {
-      line_len--;
+  if (len > 4 * config.screen_cols) return x + len;
+  for (i = 0; i < len; i++) {
+    if (s[i] == '\t') {
+      x += TAB_STOP - x % TAB_STOP;
+    } else if ((s[i] & 0xc0) != 0x80) {
+      x++;
     }
-    append_row (line, line_len);
   }
-
-  free (line);
-  fclose (fp);
+  return x;
 }
 
-/*** append buffer ***/
-
-typedef struct _append_buffer {
-  char *buf;
-  int len;
-} append_buffer;
-
-#define ABUF_INIT {NULL, 0}
-
-void ab_append (append_buffer * ab, const char *s, int len)
+/* Returns how many of the len bytes at s, drawn from column x, come before
+ * the character that covers column to. */
+int text_bytes_before (const char *s, int len, int x, int to)
 {
-  char *new = realloc (ab->buf, ab->len + len);
+  int i;
 
-  if (new == NULL) {
-    return;
+  for (i = 0; i < len; i++) {
+    int next = text_advance (s + i, 1, x);
+    if ((s[i] & 0xc0) != 0x80 && next > to) return i;
+    x = next;
   }
-  memcpy (&new[ab->len], s, len);
+  return len;
+}
+
+void free_rows ()
+{
+  int i;
+  for (i = 0; i < config.num_rows; i++) {
+    mem_free (ALLOC_ROWS, config.row[i].chars);
+  }
+  mem_free (ALLOC_ROWS, config.row);
+  config.row = NULL;
+  config.num_rows = 0;
+  config.row_cap = 0;
+}
+
+/*** density ***/
+
+/* The scrollbar shows where marked rows (errors, changes, matches) are
+ * across the whole file from per-bucket counts. Counts can be added while
+ * the number of rows is still growing: once a row lands past the last
+ * bucket, neighbouring buckets are merged and every bucket covers twice as
+ * many rows. Whoever passes over the rows anyway adds to the counts, so
+ * the scrollbar never needs a pass of its own. */
+
+void density_reset (density *d)
+{
+  memset (d->counts, 0, sizeof (d->counts));
+  d->bucket_rows = 1;
+}
+
+void density_add (density *d, int row, unsigned int n)
+{
+  while (row / d->bucket_rows >= DENSITY_BUCKETS) {
+    int i;
+    for (i = 0; i < DENSITY_BUCKETS / 2; i++) {
+      d->counts[i] = d->counts[2 * i] + d->counts[2 * i + 1];
+    }
+    memset (&d->counts[DENSITY_BUCKETS / 2], 0,
+        sizeof (d->counts) / 2);
+    d->bucket_rows *= 2;
+  }
+  d->counts[row / d->bucket_rows] += n;
+}
+
+/* Returns the count of the buckets that hold rows [from, to). */
+unsigned int density_count (const density *d, int from, int to)
+{
+  unsigned int sum = 0;
+  int i, last;
+
+  if (to <= from) return 0;
+  last = (to - 1) / d->bucket_rows;
+  if (last >= DENSITY_BUCKETS) last = DENSITY_BUCKETS - 1;
+  for (i = from / d->bucket_rows; i <= last; i++) {
+    sum += d->counts[i];
+  }
+  return sum;
+}
+
+/* Returns whether a line reports an error: it has "error", "Error" or
+ * "ERROR" in it. */
+int line_is_error (const char *s, int len)
+{
+  const char *p = s, *end = s + len;
+
+  while (end - p >= 4 && (p = memmem (p, end - p, "rror", 4)) != NULL) {
+    if (p > s && (p[-1] == 'e' || p[-1] == 'E')) return 1;
+    p += 4;
+  }
+  p = s;
+  while (end - p >= 4 && (p = memmem (p, end - p, "RROR", 4)) != NULL) {
+    if (p > s && p[-1] == 'E') return 1;
+    p += 4;
+  }
+  return 0;
+}
+
+/*** io ***/
+
+/* File contents move through an io_uring set up with raw system calls. Up
+ * to IO_DEPTH chunk reads or writes are in flight at once and go to the
+ * kernel in one batch, so a fast disk or a network filesystem stays busy
+ * while the rows are split or filled in, and no thread sits in read.
+ * Without io_uring (old kernels, seccomp) every request is served with
+ * pread or pwrite when it is started, and the callers can't tell. */
+
+typedef struct io_ring {
+  int fd;                       /* -1 until set up */
+  int failed;                   /* no io_uring here */
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned sq_entries;
+  unsigned to_submit;           /* queued since the last io_uring_enter */
+  unsigned in_flight;           /* queued or submitted, not yet reaped */
+} io_ring;
+
+/* A read or write of want bytes at off, or at the file position if off is
+ * negative */
+typedef struct io_req {
+  int fd;
+  int write;
+  char *buf;
+  unsigned want;
+  long long off;
+  unsigned got;                 /* bytes done so far */
+  int res;                      /* result of the last part, -errno */
+  int done;
+} io_req;
+
+io_ring ring = { .fd = -1 };
+
+int io_setup ()
+{
+  struct io_uring_params p;
+  size_t sq_size, cq_size, sqes_size;
+  char *sq, *cq;
+  void *sqes;
+  int fd;
+
+  if (ring.fd >= 0) return 0;
+  if (ring.failed) return -1;
+  ring.failed = 1;
+
+  memset (&p, 0, sizeof (p));
+  if ((fd = syscall (__NR_io_uring_setup, IO_DEPTH, &p)) == -1) return -1;
+  /* reads at the file position came with the plain read opcodes */
+  if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+    close (fd);
+    return -1;
+  }
+  sq_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+  sq = mmap (NULL, sq_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  cq = mmap (NULL, cq_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  sqes = mmap (NULL, sqes_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+    /* falling back to pread and pwrite leaves nothing of the ring */
+    if (sq != MAP_FAILED) munmap (sq, sq_size);
+    if (cq != MAP_FAILED) munmap (cq, cq_size);
+    if (sqes != MAP_FAILED) munmap (sqes, sqes_size);
+    close (fd);
+    return -1;
+  }
+
+  ring.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  ring.sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  ring.sq_array = (unsigned *) (sq + p.sq_off.array);
+  ring.cq_head = (unsigned *) (cq + p.cq_off.head);
+  ring.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  ring.cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  ring.sqes = sqes;
+  ring.sq_entries = p.sq_entries;
+  ring.fd = fd;
+  ring.failed = 0;
+  return 0;
+}
+
+/* Submits what is queued and waits until at least one request is done. */
+void io_wait ()
+{
+  unsigned head, tail;
+  int n;
+
+  if (ring.fd < 0) return;
+  n = syscall (__NR_io_uring_enter, ring.fd, ring.to_submit, 1,
+      IORING_ENTER_GETEVENTS, NULL, 0);
+  if (n == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+    die ("io_uring_enter");
+  }
+  if (n > 0) ring.to_submit -= n;
+
+  head = *ring.cq_head;
+  tail = atomic_load_explicit ((_Atomic unsigned *) ring.cq_tail,
+      memory_order_acquire);
+  while (head != tail) {
+    struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+    io_req *r = (io_req *) (unsigned long) cqe->user_data;
+
+    r->res = cqe->res;
+    r->done = 1;
+    ring.in_flight--;
+    head++;
+  }
+  atomic_store_explicit ((_Atomic unsigned *) ring.cq_head, head,
+      memory_order_release);
+}
+
+/* Starts the rest of r. With io_uring it is only queued; io_wait sends it
+ * along with the others. Callers may start more requests than the ring
+ * holds, so when it is full this first waits for one to finish. */
+void io_start (io_req *r)
+{
+  char *buf = r->buf + r->got;
+  unsigned len = r->want - r->got;
+  long long off = r->off < 0 ? -1 : r->off + r->got;
+
+  r->done = 0;
+  if (io_setup () == 0) {
+    unsigned tail, slot;
+    struct io_uring_sqe *sqe;
+
+    while (ring.in_flight >= ring.sq_entries) io_wait ();
+    tail = *ring.sq_tail;
+    slot = tail & *ring.sq_mask;
+    sqe = &ring.sqes[slot];
+    memset (sqe, 0, sizeof (*sqe));
+    sqe->opcode = r->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = r->fd;
+    sqe->addr = (unsigned long) buf;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = (unsigned long) r;
+    ring.sq_array[slot] = slot;
+    atomic_store_explicit ((_Atomic unsigned *) ring.sq_tail, tail + 1,
+        memory_order_release);
+    ring.to_submit++;
+    ring.in_flight++;
+    return;
+  }
+
+  do {
+    if (r->write) {
+      r->res = off < 0 ? write (r->fd, buf, len) :
+        pwrite (r->fd, buf, len, off);
+    } else {
+      r->res = off < 0 ? read (r->fd, buf, len) : pread (r->fd, buf, len, off);
+    }
+  } while (r->res == -1 && errno == EINTR);
+  if (r->res == -1) r->res = -errno;
+  r->done = 1;
+}
+
+/* Waits for r and goes on after a short read or write until all of it is
+ * done or the end of the file. Returns -1 with errno set on an error. */
+int io_finish (io_req *r)
+{
+  while (1) {
+    while (!r->done) io_wait ();
+    if (r->res < 0) {
+      errno = -r->res;
+      return -1;
+    }
+    r->got += r->res;
+    /* the file position moves on its own, and a short read of a pipe is
+     * all there is for now */
+    if (r->res == 0 || r->got == r->want || r->off < 0) return 0;
+    io_start (r);
+  }
+}
+
+/* Waits for every request of reqs that is still in flight. */
+void io_drain (io_req *reqs, int n)
+{
+  int i;
+  for (i = 0; i < n; i++) {
+    while (!reqs[i].done) io_wait ();
+  }
+}
+
+/*** compression ***/
+
+/* Gzip and zstd files are decompressed as they load and compressed again
+ * when saved. Saving cuts the text into COMPRESS_BLOCK sized blocks and
+ * compresses each one on its own, one block per core, like pigz and
+ * zstd -T do; a gzip file made of several members and a zstd file made of
+ * several frames read back as one. zstd comes from libzstd if it can be
+ * loaded at run time. */
+
+/* ZSTD_inBuffer and ZSTD_outBuffer */
+typedef struct zstd_buffer {
+  void *ptr;
+  size_t size;
+  size_t pos;
+} zstd_buffer;
+
+struct zstd_lib {
+  int tried;
+  void *handle;
+  size_t (*compress_bound) (size_t len);
+  size_t (*compress) (void *dst, size_t cap, const void *src, size_t len,
+      int level);
+  unsigned (*is_error) (size_t code);
+  void *(*create_dctx) (void);
+  size_t (*free_dctx) (void *dctx);
+  size_t (*decompress_stream) (void *dctx, zstd_buffer *out,
+      zstd_buffer *in);
+} zstd;
+
+/* Loads libzstd the first time it is needed. Returns -1 without it. */
+int zstd_load ()
+{
+  void *h;
+
+  if (zstd.tried) return zstd.handle ? 0 : -1;
+  zstd.tried = 1;
+  if ((h = dlopen ("libzstd.so.1", RTLD_NOW | RTLD_LOCAL)) == NULL) return -1;
+  *(void **) &zstd.compress_bound = dlsym (h, "ZSTD_compressBound");
+  *(void **) &zstd.compress = dlsym (h, "ZSTD_compress");
+  *(void **) &zstd.is_error = dlsym (h, "ZSTD_isError");
+  *(void **) &zstd.create_dctx = dlsym (h, "ZSTD_createDCtx");
+  *(void **) &zstd.free_dctx = dlsym (h, "ZSTD_freeDCtx");
+  *(void **) &zstd.decompress_stream = dlsym (h, "ZSTD_decompressStream");
+  if (!zstd.compress_bound || !zstd.compress || !zstd.is_error ||
+      !zstd.create_dctx || !zstd.free_dctx || !zstd.decompress_stream) {
+    dlclose (h);
+    return -1;
+  }
+  zstd.handle = h;
+  return 0;
+}
+
+/* Returns the compression of a file that starts with the len bytes of
+ * s. */
+int compression_of (const char *s, size_t len)
+{
+  if (len >= 2 && memcmp (s, "\x1f\x8b", 2) == 0) return COMPRESS_GZIP;
+  if (len >= 4 && memcmp (s, "\x28\xb5\x2f\xfd", 4) == 0) {
+    return COMPRESS_ZSTD;
+  }
+  return COMPRESS_NONE;
+}
+
+/* Returns how path asks to be compressed: by its suffix, or the way the
+ * file was when it was opened. */
+int compression_for (const char *path)
+{
+  size_t len = strlen (path);
+
+  if (len > 3 && strcmp (path + len - 3, ".gz") == 0) return COMPRESS_GZIP;
+  if (len > 4 && strcmp (path + len - 4, ".zst") == 0) return COMPRESS_ZSTD;
+  if (config.filename && strcmp (path, config.filename) == 0) {
+    return config.compression;
+  }
+  return COMPRESS_NONE;
+}
+
+/* Returns the most a block of len bytes can take compressed. */
+size_t compress_bound (int codec, size_t len)
+{
+  if (codec == COMPRESS_ZSTD) return zstd.compress_bound (len);
+  return compressBound (len) + 32;      /* gzip header and trailer */
+}
+
+/* A block of text and what it compresses to */
+typedef struct compress_block {
+  char *in;
+  size_t in_len;
+  char *out;
+  size_t out_cap;
+  size_t out_len;
+  int failed;
+} compress_block;
+
+/* Blocks compressed together; the threads take the next one from next */
+typedef struct compress_batch {
+  compress_block *blocks;
+  int count;
+  int codec;
+  atomic_int next;
+} compress_batch;
+
+void *compress_worker (void *arg)
+{
+  compress_batch *b = arg;
+  int i;
+
+  while ((i = atomic_fetch_add (&b->next, 1)) < b->count) {
+    compress_block *k = &b->blocks[i];
+
+    if (b->codec == COMPRESS_ZSTD) {
+      size_t n = zstd.compress (k->out, k->out_cap, k->in, k->in_len,
+          COMPRESS_ZSTD_LEVEL);
+      k->out_len = zstd.is_error (n) ? 0 : n;
+      k->failed = zstd.is_error (n);
+    } else {
+      z_stream z;
+
+      memset (&z, 0, sizeof (z));
+      k->failed = 1;
+      if (deflateInit2 (&z, COMPRESS_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+            Z_DEFAULT_STRATEGY) != Z_OK) {
+        continue;
+      }
+      z.next_in = (Bytef *) k->in;
+      z.avail_in = k->in_len;
+      z.next_out = (Bytef *) k->out;
+      z.avail_out = k->out_cap;
+      k->failed = deflate (&z, Z_FINISH) != Z_STREAM_END;
+      k->out_len = z.total_out;
+      deflateEnd (&z);
+    }
+  }
+  return NULL;
+}
+
+/* Compresses the blocks of b on up to num_threads threads. Returns -1 if
+ * any block failed. */
+int compress_blocks (compress_batch *b, int num_threads)
+{
+  pthread_t threads[COMPRESS_MAX_THREADS];
+  int i, started;
+
+  atomic_store (&b->next, 0);
+  if (num_threads > b->count) num_threads = b->count;
+  for (started = 0; started < num_threads - 1; started++) {
+    if (pthread_create (&threads[started], NULL, compress_worker, b) != 0) {
+      break;
+    }
+  }
+  compress_worker (b);          /* this thread helps too */
+  for (i = 0; i < started; i++) pthread_join (threads[i], NULL);
+
+  for (i = 0; i < b->count; i++) {
+    if (b->blocks[i].failed) return -1;
+  }
+  return 0;
+}
+
+/* Decompression state of a file being loaded */
+typedef struct inflater {
+  int codec;
+  z_stream z;
+  void *dctx;
+  size_t zstd_left;             /* nonzero inside a zstd frame */
+  char *out;
+} inflater;
+
+/* Starts decompressing a file that starts with the len bytes of s. Files
+ * that aren't compressed, or need the missing libzstd, load as they are. */
+void inflater_start (inflater *d, const char *s, size_t len)
+{
+  memset (d, 0, sizeof (*d));
+  d->codec = compression_of (s, len);
+  if (d->codec == COMPRESS_ZSTD && (zstd_load () == -1 ||
+        (d->dctx = zstd.create_dctx ()) == NULL)) {
+    set_status_message ("Showing zstd data as it is: no libzstd");
+    d->codec = COMPRESS_NONE;
+  }
+  if (d->codec == COMPRESS_GZIP && inflateInit2 (&d->z, 15 + 32) != Z_OK) {
+    d->codec = COMPRESS_NONE;
+  }
+  if (d->codec != COMPRESS_NONE) d->out = mem_alloc (ALLOC_IO, IO_CHUNK);
+}
+
+/* Splits the len bytes of s into rows, decompressed. Returns -1 with errno
+ * set if they aren't valid compressed data. */
+int inflater_input (inflater *d, append_buffer *partial, char *s,
+    size_t len)
+{
+  if (d->codec == COMPRESS_NONE) {
+    load_bytes (partial, s, len);
+    return 0;
+  }
+
+  if (d->codec == COMPRESS_ZSTD) {
+    zstd_buffer in = {s, len, 0};
+    while (1) {
+      zstd_buffer out = {d->out, IO_CHUNK, 0};
+      size_t n = zstd.decompress_stream (d->dctx, &out, &in);
+
+      if (zstd.is_error (n)) {
+        errno = EBADMSG;
+        return -1;
+      }
+      load_bytes (partial, d->out, out.pos);
+      d->zstd_left = n;
+      if (in.pos == in.size && out.pos < out.size) return 0;
+    }
+  }
+
+  d->z.next_in = (Bytef *) s;
+  d->z.avail_in = len;
+  while (1) {
+    int ret;
+
+    d->z.next_out = (Bytef *) d->out;
+    d->z.avail_out = IO_CHUNK;
+    ret = inflate (&d->z, Z_NO_FLUSH);
+    load_bytes (partial, d->out, IO_CHUNK - d->z.avail_out);
+    if (ret == Z_STREAM_END) {
+      inflateReset (&d->z);     /* another member may follow */
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      errno = EBADMSG;
+      return -1;
+    }
+    if (d->z.avail_in == 0 && d->z.avail_out != 0) return 0;
+  }
+}
+
+/* Frees d. Returns -1 with errno set if the data ended in the middle of a
+ * member or frame. */
+int inflater_end (inflater *d)
+{
+  int truncated = 0;
+
+  if (d->codec == COMPRESS_GZIP) {
+    truncated = d->z.total_in != 0;
+    inflateEnd (&d->z);
+  } else if (d->codec == COMPRESS_ZSTD) {
+    truncated = d->zstd_left != 0;
+    zstd.free_dctx (d->dctx);
+  }
+  mem_free (ALLOC_IO, d->out);
+  if (truncated) {
+    errno = EBADMSG;
+    return -1;
+  }
+  return 0;
+}
+
+/*** file i/o ***/
+
+/* Adds a line read from a file as a row, without its line ending. */
+void load_line (char *line, size_t len)
+{
+  while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+    len--;
+  }
+  if (line_is_error (line, len)) {
+    density_add (&config.density[DENSITY_ERRORS], config.num_rows, 1);
+  }
+  append_row (line, len);
+}
+
+/* Splits len bytes of s into rows. A line that goes on past the end waits
+ * in *partial for the next bytes. */
+void load_bytes (append_buffer *partial, char *s, size_t len)
+{
+  while (len > 0) {
+    char *nl = memchr (s, '\n', len);
+    size_t n = nl ? (size_t) (nl - s) : len;
+
+    if (partial->len + n > (size_t) partial->cap) {
+      size_t cap = partial->cap ? partial->cap * 2 : IO_CHUNK;
+      while (cap < partial->len + n) cap *= 2;
+      ab_reserve (partial, cap, ALLOC_ROWS);
+    }
+    if (!nl) {
+      ab_append (partial, s, n);
+      return;
+    }
+    if (partial->len) {
+      ab_append (partial, s, n);
+      load_line (partial->buf, partial->len);
+      partial->len = 0;
+    } else {
+      load_line (s, n);
+    }
+    s += n + 1;
+    len -= n + 1;
+  }
+}
+
+/* Reads fd into rows, IO_CHUNK bytes at a time with up to IO_DEPTH chunks
+ * in flight, and decompresses and splits them in order as they arrive. A
+ * file of unknown size (a pipe, or a /proc file that says it is empty) is
+ * read one chunk after the other. Returns -1 with errno set on a read
+ * error or bad compressed data, keeping the rows read so far. */
+int load_file (int fd, long long size)
+{
+  io_req reqs[IO_DEPTH];
+  append_buffer partial = ABUF_INIT;
+  long long chunks = size > 0 ? (size + IO_CHUNK - 1) / IO_CHUNK : LLONG_MAX;
+  long long next = 0, parsed = 0;
+  int depth = size > 0 ? IO_DEPTH : 1, i, ret = 0;
+  inflater d;
+  char *bufs;
+
+  memset (&d, 0, sizeof (d));
+  if (chunks < depth) depth = chunks;
+  bufs = mem_alloc (ALLOC_IO, (size_t) depth * IO_CHUNK);
+  for (i = 0; i < depth; i++) reqs[i].done = 1;
+
+  while (parsed < chunks) {
+    io_req *r;
+
+    for (; next < chunks && next < parsed + depth; next++) {
+      r = &reqs[next % depth];
+      r->fd = fd;
+      r->write = 0;
+      r->buf = bufs + (next % depth) * IO_CHUNK;
+      r->off = size > 0 ? next * IO_CHUNK : -1;
+      r->want = size > 0 && size - next * IO_CHUNK < IO_CHUNK ?
+        size - next * IO_CHUNK : IO_CHUNK;
+      r->got = 0;
+      io_start (r);
+    }
+
+    r = &reqs[parsed % depth];
+    if (io_finish (r) == -1) {
+      ret = -1;
+      break;
+    }
+    if (parsed == 0) inflater_start (&d, r->buf, r->got);
+    if (inflater_input (&d, &partial, r->buf, r->got) == -1) {
+      ret = -1;
+      break;
+    }
+    parsed++;
+    /* the end came early: the file shrank, or it had no size */
+    if (r->got < r->want && (size > 0 || r->got == 0)) chunks = next;
+  }
+
+  i = errno;
+  io_drain (reqs, depth);
+  config.compression = d.codec;
+  if (inflater_end (&d) == -1 && ret == 0) {
+    i = errno;
+    ret = -1;
+  }
+  if (partial.len) load_line (partial.buf, partial.len);
+  mem_free (ALLOC_ROWS, partial.buf);
+  mem_free (ALLOC_IO, bufs);
+  errno = i;
+  return ret;
+}
+
+int editor_open (char *filename)
+{
+  unsigned long long start = now_ns (), index_start;
+  int fd = open (filename, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  int i;
+
+  if (fd == -1) { /* Unable to open file */
+    return -1;
+  }
+  if (fstat (fd, &st) == -1) {
+    close (fd);
+    return -1;
+  }
+
+  json_stop ();
+  symbols_stop ();
+  free_rows ();
+  highlight_forget ();
+  mem_free (ALLOC_ROWS, config.filename);
+  config.filename = mem_strdup (ALLOC_ROWS, filename);
+  config.cur_x = 0;
+  config.cur_y = 0;
+  config.row_offset = 0;
+  config.col_offset = 0;
+  config.sel_active = 0;
+  for (i = 0; i < DENSITY_COUNT; i++) {
+    density_reset (&config.density[i]);
+  }
+
+  if (load_file (fd, S_ISREG (st.st_mode) ? st.st_size : 0) == -1) {
+    set_status_message ("Can't read all of %s: %s", filename,
+        strerror (errno));
+  }
+  close (fd);
+
+  config.gutter_width = config.num_rows ? num_len (config.num_rows) + 2 : 0;
+  index_start = now_ns ();
+  vcs_refresh ();
+  json_start ();
+  symbols_start ();
+  if (!config.first_frame_ns) profile_phase (PHASE_INDEX, index_start);
+  trace_span ("load", start);
+  return 0;
+}
+
+/* Waits for write r and returns -1 with errno set if it failed or came
+ * up short. */
+int io_written (io_req *r)
+{
+  if (io_finish (r) == -1) return -1;
+  if (r->got < r->want) {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+/* Copies the rows from *row, *col on into buf, each with a newline after
+ * it, until cap bytes or the end. Returns the bytes copied. */
+unsigned fill_chunk (char *buf, unsigned cap, int *row, int *col)
+{
+  unsigned len = 0;
+
+  while (*row < config.num_rows && len < cap) {
+    erow *e = &config.row[*row];
+    unsigned n = e->size - *col;
+
+    if (n > cap - len) n = cap - len;
+    memcpy (buf + len, e->chars + *col, n);
+    len += n;
+    *col += n;
+    if (*col == e->size && len < cap) {
+      buf[len++] = '\n';
+      (*row)++;
+      *col = 0;
+    }
+  }
+  return len;
+}
+
+/* Writes the rows to fd compressed with codec. Every round fills one block
+ * per thread, compresses them all at once and starts writing them, and the
+ * next round goes on while they are written. The caller has checked that
+ * the codec's library loads. Returns the bytes written, or -1 with errno
+ * set. */
+long long save_compressed (int fd, int codec)
+{
+  long long off = 0;
+  int num_threads = sysconf (_SC_NPROCESSORS_ONLN);
+  int row = 0, col = 0, set = 0, i, n, err = 0;
+  compress_batch batch[2];
+  io_req *reqs;
+  size_t out_cap;
+  char *ins, *outs;
+
+  if (num_threads < 1) num_threads = 1;
+  if (num_threads > COMPRESS_MAX_THREADS) num_threads = COMPRESS_MAX_THREADS;
+  out_cap = compress_bound (codec, COMPRESS_BLOCK);
+  ins = mem_alloc (ALLOC_IO, (size_t) 2 * num_threads * COMPRESS_BLOCK);
+  outs = mem_alloc (ALLOC_IO, 2 * num_threads * out_cap);
+  reqs = mem_calloc (ALLOC_IO, 2 * num_threads, sizeof (io_req));
+  for (set = 0; set < 2; set++) {
+    batch[set].blocks = mem_calloc (ALLOC_IO, num_threads,
+        sizeof (compress_block));
+    batch[set].count = 0;
+    batch[set].codec = codec;
+    for (i = 0; i < num_threads; i++) {
+      compress_block *k = &batch[set].blocks[i];
+      k->in = ins + ((size_t) set * num_threads + i) * COMPRESS_BLOCK;
+      k->out = outs + ((size_t) set * num_threads + i) * out_cap;
+      k->out_cap = out_cap;
+      reqs[set * num_threads + i].done = 1;
+    }
+  }
+
+  /* an empty file still gets one (empty) block */
+  set = 0;
+  do {
+    compress_batch *b = &batch[set];
+
+    /* the blocks of two rounds ago have to be written first */
+    for (i = 0; i < b->count; i++) {
+      if (io_written (&reqs[set * num_threads + i]) == -1) err = errno;
+    }
+    if (err) break;
+
+    n = 0;
+    do {
+      b->blocks[n].in_len = fill_chunk (b->blocks[n].in, COMPRESS_BLOCK,
+          &row, &col);
+    } while (++n < num_threads && row < config.num_rows);
+    b->count = n;
+    if (compress_blocks (b, num_threads) == -1) {
+      err = EIO;
+      break;
+    }
+
+    for (i = 0; i < n; i++) {
+      io_req *r = &reqs[set * num_threads + i];
+      r->fd = fd;
+      r->write = 1;
+      r->buf = b->blocks[i].out;
+      r->want = b->blocks[i].out_len;
+      r->off = off;
+      r->got = 0;
+      io_start (r);
+      off += r->want;
+    }
+    set ^= 1;
+  } while (row < config.num_rows);
+
+  for (set = 0; set < 2; set++) {
+    for (i = 0; i < batch[set].count; i++) {
+      io_req *r = &reqs[set * num_threads + i];
+      if (err) {
+        while (!r->done) io_wait ();
+      } else if (io_written (r) == -1) {
+        err = errno;
+      }
+    }
+    mem_free (ALLOC_IO, batch[set].blocks);
+  }
+  mem_free (ALLOC_IO, reqs);
+  mem_free (ALLOC_IO, outs);
+  mem_free (ALLOC_IO, ins);
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return off;
+}
+
+/* Writes the rows to fd, each with a newline after it, compressed if
+ * compression_for says so. Plain text goes through the same pipeline as
+ * loading: one chunk is filled while the chunks before it are being
+ * written. Returns the bytes written, or -1 with errno set. */
+long long save_rows (int fd, int codec)
+{
+  io_req reqs[IO_DEPTH];
+  long long off = 0;
+  int row = 0, col = 0, slot = 0, i, err = 0;
+  char *bufs;
+
+  if (codec != COMPRESS_NONE) return save_compressed (fd, codec);
+
+  bufs = mem_alloc (ALLOC_IO, (size_t) IO_DEPTH * IO_CHUNK);
+  for (i = 0; i < IO_DEPTH; i++) {
+    reqs[i].buf = NULL;         /* no write to check */
+    reqs[i].done = 1;
+  }
+
+  while (row < config.num_rows) {
+    io_req *r = &reqs[slot];
+
+    if (r->buf && io_written (r) == -1) {
+      err = errno;
+      break;
+    }
+    r->buf = bufs + (size_t) slot * IO_CHUNK;
+    r->fd = fd;
+    r->write = 1;
+    r->want = fill_chunk (r->buf, IO_CHUNK, &row, &col);
+    r->off = off;
+    r->got = 0;
+    io_start (r);
+    off += r->want;
+    slot = (slot + 1) % IO_DEPTH;
+  }
+
+  for (i = 0; i < IO_DEPTH; i++) {
+    if (reqs[i].buf && io_written (&reqs[i]) == -1 && !err) err = errno;
+  }
+  mem_free (ALLOC_IO, bufs);
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return off;
+}
+
+/* Writes the rows to path, compressed if its name says so. They go to a
+ * temporary file first, which replaces path only once all of it is
+ * written, so a failed save leaves the old file alone. Returns the bytes
+ * written, or -1 with errno set. */
+long long editor_save (const char *path)
+{
+  char real[PATH_MAX], tmp[PATH_MAX + 32];
+  int codec = compression_for (path);
+  struct stat st;
+  long long bytes;
+  int fd, err = 0;
+
+  /* no library, no file: checked before anything is created */
+  if (codec == COMPRESS_ZSTD && zstd_load () == -1) {
+    errno = ENOTSUP;
+    return -1;
+  }
+  /* through a symlink, the file it points to is replaced */
+  if (realpath (path, real)) path = real;
+  if (snprintf (tmp, sizeof (tmp), "%s.tmp.%d", path, (int) getpid ()) >=
+      (int) sizeof (tmp)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  if ((fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+          0644)) == -1) {
+    return -1;
+  }
+  if (stat (path, &st) == 0) fchmod (fd, st.st_mode & 07777);
+
+  if ((bytes = save_rows (fd, codec)) == -1) err = errno;
+  if (!err && fsync (fd) == -1) err = errno;
+  if (close (fd) == -1 && !err) err = errno;
+  if (!err && rename (tmp, path) == -1) err = errno;
+  if (err) {
+    unlink (tmp);
+    errno = err;
+    return -1;
+  }
+  return bytes;
+}
+
+/*** append buffer ***/
+
+/* Makes room for size bytes in total. */
+void ab_reserve (append_buffer *ab, int size, int sub)
+{
+  char *new;
+
+  if (size <= ab->cap) return;
+  if ((new = mem_realloc (sub, ab->buf, size)) == NULL) return;
   ab->buf = new;
+  ab->cap = size;
+}
+
+void ab_append (append_buffer * ab, const char *s, int len)
+{
+  if (ab->len + len > ab->cap) {
+    int cap = ab->cap ? ab->cap : 256;
+    while (cap < ab->len + len) cap *= 2;
+    ab_reserve (ab, cap, ALLOC_OUTPUT);
+    if (ab->len + len > ab->cap) return;
+  }
+  memcpy (&ab->buf[ab->len], s, len);
   ab->len += len;
 }
 
-void ab_free (append_buffer *ab)
+void ab_free (append_buffer *ab)
+{
+  mem_free (ALLOC_OUTPUT, ab->buf);
+}
+
+/*** screen ***/
+
+/* Frames are drawn into the back grid. screen_flush compares it with the
+ * front grid, which holds what the terminal shows, and sends the shortest
+ * update it can find: for every changed stretch it picks the cheapest of an
+ * absolute move, a relative move or reprinting the unchanged cells in
+ * between, and sends runs of one character as REP, ECH or EL when those are
+ * shorter than the characters themselves. */
+
+/* the highlight rules fill in the rest */
+const char *style_sgr[STYLE_COUNT] = {
+  "\x1b[m",                     /* STYLE_NORMAL */
+  "\x1b[0;7m"                   /* STYLE_REVERSE */
+};
+
+void screen_resize ()
+{
+  int rows = config.terminal_rows + 2;
+  int cols = config.terminal_cols;
+  size_t cells = (size_t) rows * cols;
+
+  if (rows == config.screen_rows && cols == config.screen_cols) {
+    return;
+  }
+  config.front.chars = mem_realloc (ALLOC_SCREEN, config.front.chars,
+      cells * sizeof (glyph));
+  config.front.styles = mem_realloc (ALLOC_SCREEN, config.front.styles, cells);
+  config.back.chars = mem_realloc (ALLOC_SCREEN, config.back.chars,
+      cells * sizeof (glyph));
+  config.back.styles = mem_realloc (ALLOC_SCREEN, config.back.styles, cells);
+  /* enough for a frame that changes every cell and style */
+  ab_reserve (&config.out,
+      (int) cells * OUTPUT_RESERVE_PER_CELL + OUTPUT_RESERVE_FRAME,
+      ALLOC_SCREEN);
+  config.screen_rows = rows;
+  config.screen_cols = cols;
+  config.front_valid = 0;
+}
+
+/* Returns how many bytes g has. */
+int glyph_len (glyph g)
+{
+  int n = 1;
+  while (n < 4 && (g >> (8 * n)) != 0) n++;
+  return n;
+}
+
+void ab_append_glyph (append_buffer *ab, glyph g)
+{
+  char buf[4];
+  int i, n = glyph_len (g);
+
+  for (i = 0; i < n; i++) buf[i] = g >> (8 * i);
+  ab_append (ab, buf, n);
+}
+
+void glyph_fill (glyph *cells, glyph g, size_t n)
+{
+  while (n--) *cells++ = g;
+}
+
+/* Fills columns [x, to) of screen line y with c. */
+void screen_fill (int y, int x, int to, char c, int style)
+{
+  size_t at = (size_t) y * config.screen_cols;
+
+  if (to > config.screen_cols) to = config.screen_cols;
+  if (x < 0) x = 0;
+  if (x >= to) return;
+  glyph_fill (&config.back.chars[at + x], (unsigned char) c, to - x);
+  memset (&config.back.styles[at + x], style, to - x);
+}
+
+/* Sets the style of columns [x, to) of screen line y. */
+void screen_style (int y, int x, int to, int style)
+{
+  size_t at = (size_t) y * config.screen_cols;
+
+  if (to > config.screen_cols) to = config.screen_cols;
+  if (x < 0) x = 0;
+  if (x >= to) return;
+  memset (&config.back.styles[at + x], style, to - x);
+}
+
+/* Draws len bytes of s at y, x, clipped to the screen. A UTF-8 sequence
+ * takes one cell, and control characters are shown as '?'. Returns the
+ * column after the last cell drawn. */
+int screen_put (int y, int x, const char *s, int len, int style)
+{
+  size_t at = (size_t) y * config.screen_cols;
+  int i;
+
+  for (i = 0; i < len; i++) {
+    unsigned char c = s[i];
+
+    if ((c & 0xc0) == 0x80) {
+      /* continuation bytes join the character before them, which may
+       * have come from an earlier call */
+      glyph *g = x > 0 ? &config.back.chars[at + x - 1] : NULL;
+      if (g && (*g & 0xff) >= 0xc0 && glyph_len (*g) < 4) {
+        *g |= (glyph) c << (8 * glyph_len (*g));
+      }
+      continue;
+    }
+    if (x >= config.screen_cols) break;
+    config.back.chars[at + x] = (c < 0x20 || c == 0x7f) ? '?' : c;
+    config.back.styles[at + x] = style;
+    x++;
+  }
+  return x;
+}
+
+int num_len (int n)
+{
+  int len = 1;
+  while (n >= 10) {
+    n /= 10;
+    len++;
+  }
+  return len;
+}
+
+/* Writes n right aligned into the width bytes at buf, padded with spaces,
+ * two digits per division. */
+void format_number (char *buf, int width, unsigned int n)
+{
+  static const char pairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+  char *p = buf + width;
+
+  while (n >= 100 && p - buf >= 2) {
+    const char *pair = &pairs[(n % 100) * 2];
+    n /= 100;
+    *--p = pair[1];
+    *--p = pair[0];
+  }
+  if (n >= 10 && p - buf >= 2) {
+    *--p = pairs[n * 2 + 1];
+    *--p = pairs[n * 2];
+  } else if (p > buf) {
+    *--p = '0' + n;
+  }
+  while (p > buf) *--p = ' ';
+}
+
+void screen_set_style (append_buffer *ab, int style)
+{
+  if (config.term_style != style) {
+    ab_append (ab, style_sgr[style], strlen (style_sgr[style]));
+    config.term_style = style;
+  }
+}
+
+void screen_hide_cursor (append_buffer *ab)
+{
+  if (!config.term_cursor_hidden) {
+    ab_append (ab, "\x1b[?25l", 6);
+    config.term_cursor_hidden = 1;
+  }
+}
+
+/* Records that the cursor moved past the last byte printed. Printing into
+ * the last column leaves the cursor waiting to wrap, which terminals don't
+ * agree on, so its position becomes unknown. */
+void screen_advance (int x)
+{
+  config.term_x = x < config.screen_cols ? x : -1;
+}
+
+/* Writes the shortest sequence that moves the cursor to y, x into buf and
+ * returns its length. */
+int cursor_move_seq (char *buf, int y, int x)
+{
+  char rel[64];
+  int len, rel_len = 0;
+  int dy = y - config.term_y, dx = x - config.term_x;
+
+  if (y == 0 && x == 0) {
+    len = sprintf (buf, "\x1b[H");
+  } else if (x == 0) {
+    len = sprintf (buf, "\x1b[%dH", y + 1);
+  } else {
+    len = sprintf (buf, "\x1b[%d;%dH", y + 1, x + 1);
+  }
+  if (config.term_y < 0 || config.term_x < 0) {
+    return len;
+  }
+
+  /* without OPOST a line feed moves straight down */
+  if (dy > 0 && dy <= 3) {
+    memset (rel, '\n', dy);
+    rel_len = dy;
+  } else if (dy > 0) {
+    rel_len = sprintf (rel, "\x1b[%dB", dy);
+  } else if (dy < 0) {
+    rel_len = sprintf (rel, "\x1b[%dA", -dy);
+  }
+  if (x == 0 && dx != 0) {
+    rel[rel_len++] = '\r';
+  } else if (dx > 0) {
+    rel_len += sprintf (&rel[rel_len], "\x1b[%dC", dx);
+  } else if (dx < 0 && dx >= -3) {
+    memset (&rel[rel_len], '\b', -dx);
+    rel_len -= dx;
+  } else if (dx < 0) {
+    rel_len += sprintf (&rel[rel_len], "\x1b[%dD", -dx);
+  }
+
+  if (rel_len < len) {
+    memcpy (buf, rel, rel_len);
+    len = rel_len;
+  }
+  return len;
+}
+
+/* Moves the cursor to y, x. On the same line, reprinting the cells in
+ * between can be cheaper than a cursor movement; they are unchanged, so
+ * reprinting them is invisible as long as they share the current style. */
+void screen_move (append_buffer *ab, int y, int x)
+{
+  char seq[64];
+  int len, i;
+
+  if (config.term_y == y && config.term_x == x) return;
+  len = cursor_move_seq (seq, y, x);
+
+  if (config.term_y == y && config.term_x >= 0 && config.term_x < x &&
+      x - config.term_x <= len) {
+    size_t at = (size_t) y * config.screen_cols;
+    int cost = 0;
+
+    for (i = config.term_x; i < x && cost <= len; i++) {
+      if (config.front.styles[at + i] != config.term_style) break;
+      cost += glyph_len (config.front.chars[at + i]);
+    }
+    if (i == x && cost <= len) {
+      for (i = config.term_x; i < x; i++) {
+        ab_append_glyph (ab, config.front.chars[at + i]);
+      }
+      config.term_x = x;
+      return;
+    }
+  }
+
+  ab_append (ab, seq, len);
+  config.term_y = y;
+  config.term_x = x;
+}
+
+/* Returns the bytes a full redraw of the back grid would take, the way
+ * frames were drawn before the encoder: every line up to its last non blank
+ * cell, then erase to end of line. */
+long long screen_full_cost (int cursor_y, int cursor_x)
+{
+  char seq[32];
+  long long cost = 6 + 3 + 6;  /* hide cursor, home, show cursor */
+  int y, x;
+
+  cost += snprintf (seq, sizeof (seq), "\x1b[%d;%dH", cursor_y + 1,
+      cursor_x + 1);
+  for (y = 0; y < config.screen_rows; y++) {
+    size_t at = (size_t) y * config.screen_cols;
+    int style = STYLE_NORMAL, last = config.screen_cols - 1;
+
+    while (last >= 0 && config.back.chars[at + last] == ' ' &&
+        config.back.styles[at + last] == STYLE_NORMAL) {
+      last--;
+    }
+    for (x = 0; x <= last; x++) {
+      if (config.back.styles[at + x] != style) {
+        style = config.back.styles[at + x];
+        cost += strlen (style_sgr[style]);
+      }
+      cost += glyph_len (config.back.chars[at + x]);
+    }
+    if (style != STYLE_NORMAL) cost += strlen (style_sgr[STYLE_NORMAL]);
+    cost += 3;  /* erase to end of line */
+    if (y < config.screen_rows - 1) cost += 2;
+  }
+  return cost;
+}
+
+/* Scrolls the first rows lines of the terminal by delta (positive moves the
+ * text up) inside a scroll region and shifts the front grid to match, so
+ * that only the lines scrolled into view differ from the next frame. */
+void screen_scroll (append_buffer *ab, int rows, int delta)
+{
+  char buf[48];
+  int n = abs (delta);
+  size_t line = config.screen_cols;
+
+  if (!config.front_valid || n == 0 || n >= rows) return;
+
+  screen_hide_cursor (ab);
+  /* lines scrolled in take the current background */
+  screen_set_style (ab, STYLE_NORMAL);
+  snprintf (buf, sizeof (buf), "\x1b[1;%dr\x1b[%d%c\x1b[r", rows, n,
+      delta > 0 ? 'S' : 'T');
+  ab_append (ab, buf, strlen (buf));
+  config.term_x = 0;  /* setting the scroll region homes the cursor */
+  config.term_y = 0;
+
+  if (delta > 0) {
+    memmove (config.front.chars, &config.front.chars[n * line],
+        (rows - n) * line * sizeof (glyph));
+    memmove (config.front.styles, &config.front.styles[n * line],
+        (rows - n) * line);
+    glyph_fill (&config.front.chars[(rows - n) * line], ' ', n * line);
+    memset (&config.front.styles[(rows - n) * line], STYLE_NORMAL, n * line);
+  } else {
+    memmove (&config.front.chars[n * line], config.front.chars,
+        (rows - n) * line * sizeof (glyph));
+    memmove (&config.front.styles[n * line], config.front.styles,
+        (rows - n) * line);
+    glyph_fill (config.front.chars, ' ', n * line);
+    memset (config.front.styles, STYLE_NORMAL, n * line);
+  }
+}
+
+/* Sends the changes of line y from column x on, knowing that cell x
+ * changed. Returns the column to continue comparing from. */
+int screen_flush_run (append_buffer *ab, int y, int x)
+{
+  size_t at = (size_t) y * config.screen_cols;
+  glyph *bc = &config.back.chars[at], *fc = &config.front.chars[at];
+  unsigned char *bs = &config.back.styles[at], *fs = &config.front.styles[at];
+  char seq[32];
+  int cols = config.screen_cols;
+  int end, blank_from;
+
+  /* from blank_from on the line is blank, which a single erase covers */
+  blank_from = cols;
+  while (blank_from > x && bc[blank_from - 1] == ' ' &&
+      bs[blank_from - 1] == STYLE_NORMAL) {
+    blank_from--;
+  }
+
+  end = x;
+  while (end < cols && (bc[end] != fc[end] || bs[end] != fs[end])) end++;
+
+  screen_move (ab, y, x);
+  while (x < end) {
+    if (x >= blank_from) {
+      screen_set_style (ab, STYLE_NORMAL);
+      ab_append (ab, "\x1b[K", 3);
+      glyph_fill (&fc[x], ' ', cols - x);
+      memset (&fs[x], STYLE_NORMAL, cols - x);
+      return cols;
+    }
+
+    glyph c = bc[x];
+    int style = bs[x], n = 1, i;
+    int c_len = glyph_len (c);
+    int rep_cost = 1 << 30, ech_cost = 1 << 30;
+
+    while (x + n < end && x + n < blank_from && bc[x + n] == c &&
+        bs[x + n] == style) {
+      n++;
+    }
+    screen_set_style (ab, style);
+
+    if (n > 1 && (config.term_caps & CAP_REP)) {
+      rep_cost = c_len + 3 + num_len (n - 1);
+    }
+    /* ECH leaves the cursor in place, so only use it at the end of a run */
+    if (c == ' ' && style == STYLE_NORMAL && x + n == end) {
+      ech_cost = 3 + num_len (n);
+    }
+
+    if (ech_cost < n && ech_cost <= rep_cost) {
+      snprintf (seq, sizeof (seq), "\x1b[%dX", n);
+      ab_append (ab, seq, strlen (seq));
+    } else if (rep_cost < n * c_len) {
+      ab_append_glyph (ab, c);
+      snprintf (seq, sizeof (seq), "\x1b[%db", n - 1);
+      ab_append (ab, seq, strlen (seq));
+      screen_advance (x + n);
+    } else {
+      for (i = 0; i < n; i++) ab_append_glyph (ab, c);
+      screen_advance (x + n);
+    }
+    glyph_fill (&fc[x], c, n);
+    memset (&fs[x], style, n);
+    x += n;
+  }
+  return end;
+}
+
+/* Brings the terminal up to date with the back grid, leaving the cursor at
+ * cursor_y, cursor_x, and writes out ab along with it. */
+void screen_flush (append_buffer *ab, int cursor_y, int cursor_x)
+{
+  size_t cells = (size_t) config.screen_rows * config.screen_cols;
+  unsigned long long start;
+  int y, x;
+
+  config.bytes_full += screen_full_cost (cursor_y, cursor_x);
+
+  if (!config.front_valid) {
+    screen_hide_cursor (ab);
+    config.term_style = -1;
+    screen_set_style (ab, STYLE_NORMAL);
+    ab_append (ab, "\x1b[H\x1b[2J", 7);
+    config.term_x = 0;
+    config.term_y = 0;
+    glyph_fill (config.front.chars, ' ', cells);
+    memset (config.front.styles, STYLE_NORMAL, cells);
+    config.front_valid = 1;
+  }
+
+  for (y = 0; y < config.screen_rows; y++) {
+    size_t at = (size_t) y * config.screen_cols;
+    x = 0;
+    while (x < config.screen_cols) {
+      if (config.back.chars[at + x] == config.front.chars[at + x] &&
+          config.back.styles[at + x] == config.front.styles[at + x]) {
+        x++;
+        continue;
+      }
+      screen_hide_cursor (ab);
+      x = screen_flush_run (ab, y, x);
+    }
+  }
+
+  screen_move (ab, cursor_y, cursor_x);
+  if (config.term_cursor_hidden) {
+    ab_append (ab, "\x1b[?25h", 6);
+    config.term_cursor_hidden = 0;
+  }
+
+  start = now_ns ();
+  if (ab->len && (config.term_caps & CAP_SYNC)) {
+    /* the terminal shows the frame only once all of it has arrived */
+    struct iovec iov[3] = {
+      {"\x1b[?2026h", 8}, {ab->buf, ab->len}, {"\x1b[?2026l", 8}
+    };
+    writev (STDOUT_FILENO, iov, 3);
+    config.bytes_sent += ab->len + 16;
+  } else if (ab->len) {
+    write (STDOUT_FILENO, ab->buf, ab->len);
+    config.bytes_sent += ab->len;
+  }
+
+  /* inputs that changed nothing on screen have no latency to measure */
+  if (ab->len) {
+    trace_span ("write", start);
+    latency_frame_written ();
+  } else {
+    config.num_pending_input = 0;
+  }
+}
+
+/*** terminal capabilities ***/
+
+/* Features are detected without ever waiting on the terminal: the queries
+ * go out at startup and the answers come back through decode_key like any
+ * other input. Terminals answer in order, so once the DA1 reply that closes
+ * the probe arrives, every query before it that went unanswered is not
+ * supported. The result is cached per $TERM and used from the start on the
+ * next run. */
+
+/* Stores the path of cache file prefix followed by key in path, with the
+ * slashes in key turned into underscores. */
+int cache_path (char *path, size_t size, const char *prefix, const char *key)
+{
+  const char *cache = getenv ("XDG_CACHE_HOME");
+  const char *home = getenv ("HOME");
+  size_t len;
+  int n;
+
+  if (!key || !*key) return -1;
+  if (cache && *cache) {
+    n = snprintf (path, size, "%s/pico/%s", cache, prefix);
+  } else if (home && *home) {
+    n = snprintf (path, size, "%s/.cache/pico/%s", home, prefix);
+  } else {
+    return -1;
+  }
+  if (n < 0 || (size_t) n + strlen (key) >= size) return -1;
+
+  for (len = n; *key; key++) {
+    path[len++] = *key == '/' ? '_' : *key;
+  }
+  path[len] = '\0';
+  return 0;
+}
+
+/* Creates the directories leading up to the file at path. */
+void make_parent_dirs (char *path)
+{
+  char *slash;
+
+  for (slash = strchr (path + 1, '/'); slash; slash = strchr (slash + 1, '/')) {
+    *slash = '\0';
+    mkdir (path, 0700);
+    *slash = '/';
+  }
+}
+
+/* Stores the cache file for the current $TERM in path. */
+int caps_cache_path (char *path, size_t size)
+{
+  return cache_path (path, size, "term-", getenv ("TERM"));
+}
+
+/* Returns the cached CAP_* flags, or -1 if there are none. */
+int load_cached_caps ()
+{
+  char path[512];
+  unsigned int caps;
+  FILE *fp;
+
+  if (caps_cache_path (path, sizeof (path)) == -1) return -1;
+  if ((fp = fopen (path, "r")) == NULL) return -1;
+  if (fscanf (fp, "%x", &caps) != 1) caps = -1;
+  fclose (fp);
+  return (int) caps;
+}
+
+void save_cached_caps (int caps)
+{
+  char path[512];
+  FILE *fp;
+
+  if (caps_cache_path (path, sizeof (path)) == -1) return;
+  make_parent_dirs (path);
+  if ((fp = fopen (path, "w")) == NULL) return;
+  fprintf (fp, "%x\n", caps);
+  fclose (fp);
+}
+
+int env_truecolor ()
+{
+  const char *colorterm = getenv ("COLORTERM");
+  return colorterm && (strcmp (colorterm, "truecolor") == 0 ||
+      strcmp (colorterm, "24bit") == 0);
+}
+
+void set_term_caps (int caps)
+{
+  int changed = caps ^ config.term_caps;
+
+  if (changed & CAP_PASTE) {
+    write (STDOUT_FILENO, caps & CAP_PASTE ? "\x1b[?2004h" : "\x1b[?2004l", 8);
+  }
+  if (changed & CAP_REP) {
+    /* the screen may hold frames that relied on REP */
+    config.front_valid = 0;
+  }
+  config.term_caps = caps;
+  if (changed & CAP_TRUECOLOR) highlight_styles ();
+}
+
+/* Starts using what the cache (or $TERM) says the terminal supports, and
+ * sends the queries that confirm it. When need_size is set, the terminal
+ * size comes from a cursor position report as well. */
+void probe_terminal (int need_size)
+{
+  append_buffer ab = ABUF_INIT;
+  const char *term = getenv ("TERM");
+  int caps = load_cached_caps ();
+
+  if (caps == -1) {
+    /* xterm and its descendants understand REP */
+    caps = (term && strncmp (term, "xterm", 5) == 0) ? CAP_REP : 0;
+  }
+  if (env_truecolor ()) caps |= CAP_TRUECOLOR;
+  set_term_caps (caps);
+
+  config.probe_caps = 0;
+  config.cpr_len = 0;
+  if (need_size) {
+    ab_append (&ab, "\x1b[999C\x1b[999B\x1b[6n", 16);
+    config.cpr_queue[config.cpr_len++] = CPR_SIZE;
+  }
+  /* REP works if "x" repeated twice leaves the cursor in column 4; the
+   * first frame clears the screen again */
+  ab_append (&ab, "\x1b[Hx\x1b[2b\x1b[6n", 12);
+  config.cpr_queue[config.cpr_len++] = CPR_REP;
+  ab_append (&ab, "\x1b[?2026$p", 9);        /* synchronized output */
+  ab_append (&ab, "\x1b[?2004$p", 9);        /* bracketed paste */
+  ab_append (&ab, "\x1bP+q524742\x1b\\", 12); /* XTGETTCAP RGB */
+  ab_append (&ab, "\x1b[c", 3);              /* DA1, answered by everyone */
+  config.probing = 1;
+
+  write (STDOUT_FILENO, ab.buf, ab.len);
+  ab_free (&ab);
+}
+
+/* Handles a CSI sequence if it answers one of our queries. Returns whether
+ * it did. */
+int probe_reply_csi (const char *params, char final)
+{
+  int a, b;
+
+  if (final == 'R' && config.cpr_len > 0) {
+    int probe = config.cpr_queue[0];
+
+    config.cpr_len--;
+    memmove (config.cpr_queue, &config.cpr_queue[1],
+        sizeof (int) * config.cpr_len);
+    if (sscanf (params, "%d;%d", &a, &b) != 2) return 1;
+    if (probe == CPR_SIZE && a > 2 && b > 0) {
+      config.terminal_rows = a - 2;
+      config.terminal_cols = b;
+      screen_resize ();
+    } else if (probe == CPR_REP && b == 4) {
+      config.probe_caps |= CAP_REP;
+    }
+    return 1;
+  }
+
+  if (final == 'y' && params[0] == '?') {
+    /* DECRPM: mode, then 1 or 2 if it is set or reset, 0 if unknown */
+    if (sscanf (params, "?%d;%d", &a, &b) == 2 && b >= 1 && b <= 3) {
+      if (a == 2026) config.probe_caps |= CAP_SYNC;
+      if (a == 2004) config.probe_caps |= CAP_PASTE;
+    }
+    return 1;
+  }
+
+  if (final == 'c' && params[0] == '?') {
+    if (config.probing) {
+      int caps = config.probe_caps;
+
+      config.probing = 0;
+      if (env_truecolor ()) caps |= CAP_TRUECOLOR;
+      set_term_caps (caps);
+      if (caps != load_cached_caps ()) save_cached_caps (caps);
+    }
+    return 1;
+  }
+
+  return 0;
+}
+
+/* Handles a device control string, the XTGETTCAP answer. */
+void probe_reply_dcs (const char *data)
+{
+  if (strncmp (data, "1+r", 3) == 0 && strstr (data, "524742")) {
+    config.probe_caps |= CAP_TRUECOLOR;
+  }
+}
+
+/*** json ***/
+
+/* A file that starts with { or [ gets a structural index: the offset of
+ * every { } [ ] : , outside strings, with brackets linked to their
+ * partners. Offsets count the rows as if they were joined with newlines.
+ * The index is built on a worker thread, and navigation walks the index
+ * rather than the text, skipping whole containers through the links. */
+
+typedef struct json_index {
+  long long *pos;               /* offsets of the structural characters */
+  char *kind;                   /* the characters */
+  int *match;                   /* partner of a bracket, -1 otherwise */
+  int *sep;                     /* see json_add */
+  int *nth;                     /* for a comma, the element after it */
+  int count;
+  int cap;
+  long long *row_start;         /* offset of every row and of the end */
+  int num_rows;
+} json_index;
+
+/* String state of the scan between bytes */
+typedef struct json_scan {
+  int in_string;
+  long long escaped;            /* offset of the byte a backslash escapes */
+  int *stack;                   /* open brackets not closed yet */
+  int depth;
+  int stack_cap;
+  int sep;                      /* separator of the current element */
+  int nth;                      /* its position in the container */
+  int *outer;                   /* sep and nth of the levels further out */
+} json_scan;
+
+pthread_t json_thread;
+int json_running;               /* json_thread has to be joined */
+atomic_int json_cancelled;
+pthread_mutex_t json_lock = PTHREAD_MUTEX_INITIALIZER;
+json_index *json_done;          /* finished index not collected yet */
+
+void json_free (json_index *ix)
+{
+  if (!ix) return;
+  mem_free (ALLOC_INDEX, ix->pos);
+  mem_free (ALLOC_INDEX, ix->kind);
+  mem_free (ALLOC_INDEX, ix->match);
+  mem_free (ALLOC_INDEX, ix->sep);
+  mem_free (ALLOC_INDEX, ix->nth);
+  mem_free (ALLOC_INDEX, ix->row_start);
+  mem_free (ALLOC_INDEX, ix);
+}
+
+/* Adds the structural character c at offset at. Elements are what commas
+ * separate, and the comma or opening bracket in front of one is its
+ * separator. sep of an entry is the separator of the element it is part
+ * of, where a container is part of the element it makes up. For a comma
+ * it is the opening bracket of its container instead, and nth holds the
+ * position of the element after the comma. */
+void json_add (json_index *ix, json_scan *st, char c, long long at)
+{
+  int i = ix->count;
+
+  if (ix->count == ix->cap) {
+    ix->cap = ix->cap ? ix->cap * 2 : 4096;
+    ix->pos = mem_realloc (ALLOC_INDEX, ix->pos, sizeof (long long) * ix->cap);
+    ix->kind = mem_realloc (ALLOC_INDEX, ix->kind, ix->cap);
+    ix->match = mem_realloc (ALLOC_INDEX, ix->match, sizeof (int) * ix->cap);
+    ix->sep = mem_realloc (ALLOC_INDEX, ix->sep, sizeof (int) * ix->cap);
+    ix->nth = mem_realloc (ALLOC_INDEX, ix->nth, sizeof (int) * ix->cap);
+  }
+  ix->pos[i] = at;
+  ix->kind[i] = c;
+  ix->match[i] = -1;
+  ix->sep[i] = st->sep;
+  ix->nth[i] = 0;
+  ix->count++;
+
+  if (c == '{' || c == '[') {
+    if (st->depth == st->stack_cap) {
+      st->stack_cap = st->stack_cap ? st->stack_cap * 2 : 64;
+      st->stack = mem_realloc (ALLOC_INDEX, st->stack,
+          sizeof (int) * st->stack_cap);
+      st->outer = mem_realloc (ALLOC_INDEX, st->outer,
+          sizeof (int) * 2 * st->stack_cap);
+    }
+    st->outer[2 * st->depth] = st->sep;
+    st->outer[2 * st->depth + 1] = st->nth;
+    st->stack[st->depth++] = i;
+    st->sep = i;
+    st->nth = 0;
+  } else if ((c == '}' || c == ']') && st->depth > 0) {
+    int open = st->stack[st->depth - 1];
+    if ((ix->kind[open] == '{') == (c == '}')) {
+      ix->match[open] = i;
+      ix->match[i] = open;
+      st->depth--;
+      st->sep = st->outer[2 * st->depth];
+      st->nth = st->outer[2 * st->depth + 1];
+      ix->sep[i] = st->sep;
+    }
+  } else if (c == ',') {
+    ix->sep[i] = st->depth > 0 ? st->stack[st->depth - 1] : -1;
+    ix->nth[i] = ++st->nth;
+    st->sep = i;
+  }
+}
+
+void json_scan_byte (json_index *ix, json_scan *st, char c, long long at)
+{
+  if (st->in_string) {
+    if (at == st->escaped) return;
+    if (c == '\\') {
+      st->escaped = at + 1;
+    } else if (c == '"') {
+      st->in_string = 0;
+    }
+  } else if (c == '"') {
+    st->in_string = 1;
+  } else if (c != '\\') {
+    json_add (ix, st, c, at);
+  }
+}
+
+/* Adds the structural characters of s, which starts at offset base. With
+ * SSE2, 16 bytes at a time are checked for quotes, backslashes and
+ * structural characters, and only the bytes found go through the string
+ * state machine; long strings and numbers are skipped whole. */
+void json_scan_bytes (json_index *ix, json_scan *st, const char *s,
+    long long len, long long base)
+{
+  long long i = 0;
+
+#ifdef __SSE2__
+  const __m128i quote = _mm_set1_epi8 ('"');
+  const __m128i backslash = _mm_set1_epi8 ('\\');
+  const __m128i open = _mm_set1_epi8 ('{');       /* { and [ after | 0x20 */
+  const __m128i close = _mm_set1_epi8 ('}');      /* } and ] after | 0x20 */
+  const __m128i colon = _mm_set1_epi8 (':');
+  const __m128i comma = _mm_set1_epi8 (',');
+  const __m128i lower = _mm_set1_epi8 (0x20);
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128 ((const __m128i *) (s + i));
+    __m128i folded = _mm_or_si128 (v, lower);
+    __m128i hits = _mm_or_si128 (
+        _mm_or_si128 (_mm_cmpeq_epi8 (v, quote), _mm_cmpeq_epi8 (v, backslash)),
+        _mm_or_si128 (
+          _mm_or_si128 (_mm_cmpeq_epi8 (folded, open),
+            _mm_cmpeq_epi8 (folded, close)),
+          _mm_or_si128 (_mm_cmpeq_epi8 (v, colon), _mm_cmpeq_epi8 (v, comma))));
+    unsigned int mask = _mm_movemask_epi8 (hits);
+
+    while (mask) {
+      int bit = __builtin_ctz (mask);
+      json_scan_byte (ix, st, s[i + bit], base + i + bit);
+      mask &= mask - 1;
+    }
+  }
+#endif
+  for (; i < len; i++) {
+    switch (s[i]) {
+      case '"': case '\\': case '{': case '}': case '[': case ']':
+      case ':': case ',':
+        json_scan_byte (ix, st, s[i], base + i);
+    }
+  }
+}
+
+void *json_worker (void *arg)
+{
+  json_index *ix = arg;
+  json_scan st = {0, -1, NULL, 0, 0, -1, 0, NULL};
+  unsigned long long start = now_ns ();
+  int r;
+
+  trace_thread ("json index");
+  for (r = 0; r < ix->num_rows; r++) {
+    erow *row = &config.row[r];
+    long long at;
+
+    /* one huge line is cut into pieces so that cancelling is quick */
+    for (at = 0; at < row->size; at += JSON_SCAN_CHUNK) {
+      long long len = row->size - at;
+      if (len > JSON_SCAN_CHUNK) len = JSON_SCAN_CHUNK;
+      if (atomic_load (&json_cancelled)) break;
+      json_scan_bytes (ix, &st, row->chars + at, len, ix->row_start[r] + at);
+    }
+    if (atomic_load (&json_cancelled)) break;
+  }
+  mem_free (ALLOC_INDEX, st.stack);
+  mem_free (ALLOC_INDEX, st.outer);
+  trace_span ("index", start);
+
+  if (atomic_load (&json_cancelled)) {
+    json_free (ix);
+    return NULL;
+  }
+  pthread_mutex_lock (&json_lock);
+  json_free (json_done);
+  json_done = ix;
+  pthread_mutex_unlock (&json_lock);
+  wake_main ();
+  return NULL;
+}
+
+/* Stops indexing and drops the index; call before the rows go away. */
+void json_stop ()
+{
+  if (json_running) {
+    atomic_store (&json_cancelled, 1);
+    pthread_join (json_thread, NULL);
+    json_running = 0;
+  }
+  pthread_mutex_lock (&json_lock);
+  json_free (json_done);
+  json_done = NULL;
+  pthread_mutex_unlock (&json_lock);
+  json_free (config.json);
+  config.json = NULL;
+  mem_free (ALLOC_INDEX, config.json_folds);
+  config.json_folds = NULL;
+  config.num_json_folds = 0;
+  config.json_path_at = -1;
+}
+
+/* Starts indexing the rows if they look like a JSON document. */
+void json_start ()
+{
+  json_index *ix;
+  int r, i = 0;
+
+  for (r = 0; r < config.num_rows; r++) {
+    erow *row = &config.row[r];
+    for (i = 0; i < row->size && isspace ((unsigned char) row->chars[i]); i++);
+    if (i < row->size) break;
+  }
+  if (r == config.num_rows ||
+      (config.row[r].chars[i] != '{' && config.row[r].chars[i] != '[')) {
+    return;
+  }
+
+  ix = mem_calloc (ALLOC_INDEX, 1, sizeof (json_index));
+  ix->num_rows = config.num_rows;
+  ix->row_start = mem_alloc (ALLOC_INDEX,
+      sizeof (long long) * (config.num_rows + 1));
+  ix->row_start[0] = 0;
+  for (r = 0; r < config.num_rows; r++) {
+    ix->row_start[r + 1] = ix->row_start[r] + config.row[r].size + 1;
+  }
+  atomic_store (&json_cancelled, 0);
+  if (pthread_create (&json_thread, NULL, json_worker, ix) != 0) {
+    json_free (ix);
+    return;
+  }
+  json_running = 1;
+}
+
+/* Takes the index once the worker has built it. */
+void json_collect ()
+{
+  json_index *ix;
+
+  pthread_mutex_lock (&json_lock);
+  ix = json_done;
+  json_done = NULL;
+  pthread_mutex_unlock (&json_lock);
+  if (!ix) return;
+
+  pthread_join (json_thread, NULL);
+  json_running = 0;
+  json_free (config.json);
+  config.json = ix;
+  config.json_path_at = -1;
+  set_status_message ("Indexed %d structural characters: Alt-U = parent | "
+      "Alt-N/Alt-B = next/previous | Alt-K = next key | Alt-F = fold",
+      ix->count);
+}
+
+/* Returns the row that holds offset at. */
+int json_row_of (long long at)
+{
+  long long *start = config.json->row_start;
+  int lo = 0, hi = config.json->num_rows - 1;
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (start[mid] <= at) lo = mid; else hi = mid - 1;
+  }
+  return lo;
+}
+
+/* Returns the byte at offset at, '\n' between rows. */
+char json_byte (long long at)
+{
+  int row = json_row_of (at);
+  long long col = at - config.json->row_start[row];
+  return col < config.row[row].size ? config.row[row].chars[col] : '\n';
+}
+
+/* Returns the first offset from at on that isn't white space. */
+long long json_skip_space (long long at)
+{
+  long long end = config.json->row_start[config.json->num_rows];
+  while (at < end && isspace ((unsigned char) json_byte (at))) at++;
+  return at;
+}
+
+/* Returns the offset of the cursor. */
+long long json_cursor ()
+{
+  if (config.cur_y >= config.json->num_rows) {
+    return config.json->row_start[config.json->num_rows];
+  }
+  return config.json->row_start[config.cur_y] + config.cur_x;
+}
+
+/* Moves the cursor to offset at. */
+void json_goto (long long at)
+{
+  int row = json_row_of (at);
+  config.cur_y = row;
+  config.cur_x = at - config.json->row_start[row];
+  config.sel_active = 0;
+}
+
+/* Returns the number of index entries before offset at. */
+int json_entries_before (long long at)
+{
+  int lo = 0, hi = config.json->count;
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (config.json->pos[mid] < at) lo = mid + 1; else hi = mid;
+  }
+  return lo;
+}
+
+/* Returns the entry of the opening bracket of the container around offset
+ * at, or -1 at the top level. *sep is set to the comma or bracket in front
+ * of the element at is in, and *index to the position of that element.
+ * The separators recorded by json_add make this a lookup however many
+ * elements come before. */
+int json_enclosing (long long at, int *sep, int *index)
+{
+  json_index *ix = config.json;
+  int k = json_entries_before (at) - 1;
+  char c;
+
+  *sep = -1;
+  *index = 0;
+  if (k < 0) return -1;
+  c = ix->kind[k];
+  *sep = (c == '{' || c == '[' || c == ',') ? k : ix->sep[k];
+  if (*sep < 0) return -1;
+  if (ix->kind[*sep] != ',') return *sep;
+  *index = ix->nth[*sep];
+  return ix->sep[*sep];
+}
+
+void json_parent ()
+{
+  int sep, index, open = json_enclosing (json_cursor (), &sep, &index);
+
+  if (open < 0) {
+    set_status_message ("Already at the top level");
+    return;
+  }
+  json_goto (config.json->pos[open]);
+}
+
+void json_next_sibling ()
+{
+  json_index *ix = config.json;
+  long long at = json_cursor ();
+  int k = json_entries_before (at);
+
+  /* from an opening bracket, its own container is the current element */
+  if (k < ix->count && ix->pos[k] == at &&
+      (ix->kind[k] == '{' || ix->kind[k] == '[') && ix->match[k] >= 0) {
+    k = ix->match[k] + 1;
+  }
+  while (k < ix->count) {
+    char c = ix->kind[k];
+    if (c == ',') {
+      json_goto (json_skip_space (ix->pos[k] + 1));
+      return;
+    }
+    if (c == '}' || c == ']') break;
+    if ((c == '{' || c == '[') && ix->match[k] >= 0) {
+      k = ix->match[k] + 1;
+    } else {
+      k++;
+    }
+  }
+  set_status_message ("No next element");
+}
+
+void json_previous_sibling ()
+{
+  json_index *ix = config.json;
+  int sep, index, before;
+
+  if (json_enclosing (json_cursor (), &sep, &index) < 0 || sep < 0 ||
+      ix->kind[sep] != ',') {
+    set_status_message ("No previous element");
+    return;
+  }
+  json_enclosing (ix->pos[sep], &before, &index);
+  json_goto (json_skip_space (ix->pos[before] + 1));
+}
+
+/* Returns the index in config.json_folds of the first fold at or after
+ * offset at. */
+int json_fold_from (long long at)
+{
+  int lo = 0, hi = config.num_json_folds;
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (config.json->pos[config.json_folds[mid]] < at) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+int json_is_folded (int open)
+{
+  int f = json_fold_from (config.json->pos[open]);
+  return f < config.num_json_folds && config.json_folds[f] == open;
+}
+
+/* Moves to the next object key after the cursor, at any depth outside
+ * folds. */
+void json_next_key ()
+{
+  json_index *ix = config.json;
+  long long at = json_cursor ();
+  int k;
+
+  for (k = json_entries_before (at); k < ix->count; k++) {
+    if (ix->match[k] > k && json_is_folded (k)) {
+      k = ix->match[k];
+    } else if (ix->kind[k] == ':' && k > 0) {
+      long long key = json_skip_space (ix->pos[k - 1] + 1);
+      if (key > at) {
+        json_goto (key);
+        return;
+      }
+    }
+  }
+  set_status_message ("No more keys");
+}
+
+/* Writes the path of the element under the cursor, such as
+ * $.items[3].name, into config.json_path. */
+void json_update_path ()
+{
+  char parts[JSON_MAX_DEPTH][JSON_MAX_KEY + 8];
+  long long at = json_cursor ();
+  int depth = 0, len, i;
+
+  if (at == config.json_path_at) return;
+  config.json_path_at = at;
+
+  while (depth < JSON_MAX_DEPTH) {
+    int sep, index, open = json_enclosing (at, &sep, &index);
+    char *part = parts[depth];
+
+    if (open < 0) break;
+    if (config.json->kind[open] == '[') {
+      snprintf (part, sizeof (parts[0]), "[%d]", index);
+    } else {
+      /* the key is the string right after the separator */
+      long long key = json_skip_space (config.json->pos[sep] + 1);
+      int n = 0;
+
+      part[n++] = '.';
+      if (json_byte (key) == '"') {
+        char c, prev = 0;
+        while (n < JSON_MAX_KEY && (c = json_byte (++key)) != '\n' &&
+            (c != '"' || prev == '\\')) {
+          part[n++] = c;
+          prev = c;
+        }
+      }
+      part[n] = '\0';
+    }
+    depth++;
+    at = config.json->pos[open];
+  }
+
+  len = snprintf (config.json_path, sizeof (config.json_path), "%s",
+      depth == JSON_MAX_DEPTH ? "$..." : "$");
+  for (i = depth - 1; i >= 0 && len < (int) sizeof (config.json_path); i--) {
+    len += snprintf (config.json_path + len, sizeof (config.json_path) - len,
+        "%s", parts[i]);
+  }
+}
+
+/* Folds or unfolds the container the cursor is on or in. Only containers
+ * that start and end on the same line can be folded. */
+void json_toggle_fold ()
+{
+  json_index *ix = config.json;
+  long long at = json_cursor ();
+  int k = json_entries_before (at), sep, index, open, close, f;
+
+  if (k < ix->count && ix->pos[k] == at &&
+      (ix->kind[k] == '{' || ix->kind[k] == '[')) {
+    open = k;
+  } else {
+    open = json_enclosing (at, &sep, &index);
+  }
+  if (open < 0 || (close = ix->match[open]) < 0) {
+    set_status_message ("Nothing to fold here");
+    return;
+  }
+
+  f = json_fold_from (ix->pos[open]);
+  if (json_is_folded (open)) {
+    config.num_json_folds--;
+    memmove (&config.json_folds[f], &config.json_folds[f + 1],
+        sizeof (int) * (config.num_json_folds - f));
+    return;
+  }
+  if (json_row_of (ix->pos[open]) != json_row_of (ix->pos[close])) {
+    set_status_message ("Can't fold a container that spans lines");
+    return;
+  }
+  if (ix->pos[close] - ix->pos[open] - 1 < (int) strlen (JSON_FOLD_TEXT)) {
+    set_status_message ("Too short to fold");
+    return;
+  }
+  config.json_folds = mem_realloc (ALLOC_INDEX, config.json_folds,
+      sizeof (int) * (config.num_json_folds + 1));
+  memmove (&config.json_folds[f + 1], &config.json_folds[f],
+      sizeof (int) * (config.num_json_folds - f));
+  config.json_folds[f] = open;
+  config.num_json_folds++;
+  json_goto (ix->pos[open]);
+}
+
+/* Splits what file_row shows from byte start on into runs of text and
+ * folded containers, at most max of them. Returns how many there are. */
+int row_segments (int file_row, int start, text_seg *segs, int max)
+{
+  erow *row = &config.row[file_row];
+  int n = 0, x = 0, at = start, f;
+
+  if (config.json && config.num_json_folds &&
+      file_row < config.json->num_rows) {
+    json_index *ix = config.json;
+    long long base = ix->row_start[file_row];
+
+    for (f = json_fold_from (base); f < config.num_json_folds &&
+        n < max - 2; f++) {
+      int open = config.json_folds[f];
+      long long o = ix->pos[open] - base, c = ix->pos[ix->match[open]] - base;
+
+      if (o >= row->size) break;
+      if (c < at) continue;     /* scrolled past, or inside another fold */
+      if (o < at) {
+        at = c;                 /* the view starts inside the fold */
+        continue;
+      }
+      segs[n].from = at;
+      segs[n].to = o + 1;
+      segs[n].x = x;
+      segs[n].folded = 0;
+      x = text_advance (&row->chars[at], o + 1 - at, x);
+      n++;
+      segs[n].from = o + 1;
+      segs[n].to = c;
+      segs[n].x = x;
+      segs[n].folded = 1;
+      x += strlen (JSON_FOLD_TEXT);
+      n++;
+      at = c;
+    }
+  }
+  segs[n].from = at;
+  segs[n].to = row->size > at ? row->size : at;
+  segs[n].x = x;
+  segs[n].folded = 0;
+  return n + 1;
+}
+
+/* Returns the column of byte col of file_row on screen when the text area
+ * starts at byte start. */
+int row_col_to_x (int file_row, int start, int col)
+{
+  text_seg segs[MAX_SEGMENTS];
+  int n, i;
+
+  if (file_row >= config.num_rows) return col - start;
+  if (col > config.row[file_row].size) col = config.row[file_row].size;
+  n = row_segments (file_row, start, segs, MAX_SEGMENTS);
+  for (i = 0; i < n - 1; i++) {
+    if (col < segs[i + 1].from) break;
+  }
+  if (segs[i].folded) return segs[i].x + col - segs[i].from;
+  return text_advance (&config.row[file_row].chars[segs[i].from],
+      col - segs[i].from, segs[i].x);
+}
+
+/* Returns the byte of file_row shown at screen column x of the text area. */
+int row_x_to_col (int file_row, int start, int x)
+{
+  text_seg segs[MAX_SEGMENTS];
+  int n, i;
+
+  if (file_row >= config.num_rows) return start + x;
+  n = row_segments (file_row, start, segs, MAX_SEGMENTS);
+  for (i = 0; i < n - 1; i++) {
+    if (x < segs[i + 1].x) break;
+  }
+  if (segs[i].folded) return segs[i].from - 1;
+  return segs[i].from + text_bytes_before (
+      &config.row[file_row].chars[segs[i].from], segs[i].to - segs[i].from,
+      segs[i].x, x);
+}
+
+/* Moves the cursor out of a folded container: towards its end if dir is
+ * positive, otherwise to its opening bracket. */
+void json_snap_cursor (int dir)
+{
+  json_index *ix = config.json;
+  long long base;
+  int f;
+
+  if (!ix || !config.num_json_folds || config.cur_y >= ix->num_rows) return;
+  base = ix->row_start[config.cur_y];
+  for (f = json_fold_from (base); f < config.num_json_folds; f++) {
+    int open = config.json_folds[f];
+    long long o = ix->pos[open] - base, c = ix->pos[ix->match[open]] - base;
+
+    if (o >= config.cur_x) break;
+    if (config.cur_x < c) {
+      config.cur_x = dir > 0 ? c : o;
+      return;
+    }
+  }
+}
+
+/*** highlight ***/
+
+/* Highlight rules give a color to the text a regex matches, such as ERROR
+ * in red. All the rules are compiled into one alternation, (r1)|(r2)|...,
+ * so a row is matched once however many rules there are, and the group
+ * that took part in a match tells which rule it was. Only rows being drawn
+ * are matched, and their spans are kept in a small cache by row number,
+ * so scrolling only pays for the rows it brings into view. */
+
+typedef struct hl_rule {
+  char *pattern;
+  char color[16];               /* a name or #rrggbb */
+  char sgr[STYLE_SGR_MAX];      /* for style STYLE_HIGHLIGHT + rule */
+  int group;                    /* its group in the alternation */
+} hl_rule;
+
+typedef struct hl_span {
+  int from, to;
+  int style;
+} hl_span;
+
+typedef struct hl_line {
+  int row;                      /* -1 for an empty slot */
+  int count;
+  hl_span spans[HL_MAX_SPANS];
+} hl_line;
+
+typedef struct highlight {
+  hl_rule rules[HL_MAX_RULES];
+  int num_rules;
+  regex_t re;                   /* the alternation of all rules */
+  int groups;                   /* in re, counting the whole match */
+  regmatch_t *match;            /* one per group */
+  hl_line *cache;               /* HL_CACHE_ROWS slots */
+} highlight;
+
+const struct hl_color {
+  const char *name;
+  const char *sgr;
+} hl_colors[] = {
+  {"red", "31"}, {"green", "32"}, {"yellow", "33"}, {"blue", "34"},
+  {"magenta", "35"}, {"cyan", "36"}, {"white", "37"}, {"bold", "1"},
+  {"dim", "2"}, {"underline", "4"}
+};
+
+/* Returns whether s starts with a #rrggbb word. */
+int hl_is_rgb (const char *s)
+{
+  int i;
+
+  if (s[0] != '#') return 0;
+  for (i = 1; i < 7; i++) {
+    if (!isxdigit ((unsigned char) s[i])) return 0;
+  }
+  return s[7] == '\0' || isspace ((unsigned char) s[7]);
+}
+
+/* Writes the SGR sequence for color into sgr. #rrggbb falls back to the
+ * nearest of the 256 colors on terminals without 24 bit color. Returns -1
+ * for an unknown color. */
+int hl_color_sgr (const char *color, char *sgr, size_t size)
+{
+  unsigned int rgb, r, g, b;
+  size_t i;
+
+  if (hl_is_rgb (color)) {
+    sscanf (color + 1, "%x", &rgb);
+    r = rgb >> 16;
+    g = (rgb >> 8) & 0xff;
+    b = rgb & 0xff;
+    if (config.term_caps & CAP_TRUECOLOR) {
+      snprintf (sgr, size, "\x1b[0;38;2;%u;%u;%um", r, g, b);
+    } else {
+      snprintf (sgr, size, "\x1b[0;38;5;%um",
+          16 + 36 * ((r * 5 + 127) / 255) + 6 * ((g * 5 + 127) / 255) +
+          (b * 5 + 127) / 255);
+    }
+    return 0;
+  }
+  for (i = 0; i < sizeof (hl_colors) / sizeof (hl_colors[0]); i++) {
+    if (strcmp (color, hl_colors[i].name) == 0) {
+      snprintf (sgr, size, "\x1b[0;%sm", hl_colors[i].sgr);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/* Empties the row cache, for new rules or a new file. */
+void highlight_forget ()
+{
+  highlight *h = config.highlight;
+  int i;
+
+  if (!h) return;
+  for (i = 0; i < HL_CACHE_ROWS; i++) h->cache[i].row = -1;
+}
+
+/* Sets the SGR sequences of the rules' styles for the terminal. */
+void highlight_styles ()
+{
+  highlight *h = config.highlight;
+  int i;
+
+  if (!h) return;
+  for (i = 0; i < h->num_rules; i++) {
+    hl_color_sgr (h->rules[i].color, h->rules[i].sgr,
+        sizeof (h->rules[i].sgr));
+    style_sgr[STYLE_HIGHLIGHT + i] = h->rules[i].sgr;
+  }
+  /* cells on screen may be in the old colors */
+  config.front_valid = 0;
+}
+
+/* Compiles the alternation of all the rules. */
+int highlight_compile (highlight *h)
+{
+  append_buffer ab = ABUF_INIT;
+  int i, ret, group = 1;
+
+  for (i = 0; i < h->num_rules; i++) {
+    regex_t re;
+
+    /* a rule's own groups come after the one around it */
+    if (regcomp (&re, h->rules[i].pattern, REG_EXTENDED) != 0) return -1;
+    h->rules[i].group = group;
+    group += 1 + re.re_nsub;
+    regfree (&re);
+
+    if (i > 0) ab_append (&ab, "|", 1);
+    ab_append (&ab, "(", 1);
+    ab_append (&ab, h->rules[i].pattern, strlen (h->rules[i].pattern));
+    ab_append (&ab, ")", 1);
+  }
+  ab_append (&ab, "", 1);
+
+  ret = regcomp (&h->re, ab.buf, REG_EXTENDED);
+  ab_free (&ab);
+  if (ret != 0) return -1;
+  h->groups = group;
+  h->match = mem_realloc (ALLOC_SEARCH, h->match, sizeof (regmatch_t) *
+      group);
+  return 0;
+}
+
+/* Adds a rule coloring what pattern matches. Returns NULL, or what is
+ * wrong with the rule. */
+const char *highlight_add (const char *color, const char *pattern)
+{
+  static char error[64];
+  highlight *h = config.highlight;
+  char sgr[STYLE_SGR_MAX];
+  regex_t re;
+  int ret;
+
+  if (hl_color_sgr (color, sgr, sizeof (sgr)) == -1 ||
+      strlen (color) >= sizeof (h->rules[0].color)) {
+    return "unknown color, use a name or #rrggbb";
+  }
+  if ((ret = regcomp (&re, pattern, REG_EXTENDED)) != 0) {
+    regerror (ret, &re, error, sizeof (error));
+    return error;
+  }
+  regfree (&re);
+
+  if (!h) {
+    h = config.highlight = mem_calloc (ALLOC_SEARCH, 1, sizeof (highlight));
+    h->cache = mem_alloc (ALLOC_SEARCH, sizeof (hl_line) * HL_CACHE_ROWS);
+  } else if (h->num_rules == HL_MAX_RULES) {
+    return "too many rules";
+  } else {
+    regfree (&h->re);
+  }
+
+  strcpy (h->rules[h->num_rules].color, color);
+  h->rules[h->num_rules].pattern = mem_strdup (ALLOC_SEARCH, pattern);
+  h->num_rules++;
+  if (highlight_compile (h) == -1) {
+    /* each rule compiled on its own, but not together */
+    h->num_rules--;
+    mem_free (ALLOC_SEARCH, h->rules[h->num_rules].pattern);
+    highlight_compile (h);
+    return "the rule doesn't combine with the others";
+  }
+  highlight_forget ();
+  highlight_styles ();
+  return NULL;
+}
+
+void highlight_clear ()
+{
+  highlight *h = config.highlight;
+  int i;
+
+  if (!h) return;
+  for (i = 0; i < h->num_rules; i++) {
+    mem_free (ALLOC_SEARCH, h->rules[i].pattern);
+  }
+  regfree (&h->re);
+  mem_free (ALLOC_SEARCH, h->match);
+  mem_free (ALLOC_SEARCH, h->cache);
+  mem_free (ALLOC_SEARCH, h);
+  config.highlight = NULL;
+  config.front_valid = 0;
+}
+
+/* Adds the rule on line, "color regex". Returns NULL, or what is wrong. */
+const char *highlight_parse (char *line)
+{
+  char *color = line, *pattern;
+
+  while (isspace ((unsigned char) *color)) color++;
+  pattern = color;
+  while (*pattern && !isspace ((unsigned char) *pattern)) pattern++;
+  if (*pattern == '\0') return "expected a color and a regex";
+  *pattern++ = '\0';
+  while (isspace ((unsigned char) *pattern)) pattern++;
+  return highlight_add (color, pattern);
+}
+
+/* Loads the rules in $XDG_CONFIG_HOME/pico/highlight (or
+ * ~/.config/pico/highlight), one "color regex" per line. Lines starting
+ * with # that aren't a color are comments. */
+void highlight_load ()
+{
+  const char *dir = getenv ("XDG_CONFIG_HOME");
+  const char *home = getenv ("HOME");
+  char path[512], *line = NULL;
+  const char *error;
+  size_t cap = 0;
+  ssize_t len;
+  int line_no = 0;
+  FILE *fp;
+
+  if (dir && *dir) {
+    snprintf (path, sizeof (path), "%s/pico/highlight", dir);
+  } else if (home && *home) {
+    snprintf (path, sizeof (path), "%s/.config/pico/highlight", home);
+  } else {
+    return;
+  }
+  if ((fp = fopen (path, "r")) == NULL) return;
+
+  while ((len = getline (&line, &cap, fp)) != -1) {
+    line_no++;
+    while (len > 0 && isspace ((unsigned char) line[len - 1])) len--;
+    line[len] = '\0';
+    if (len == 0 || (line[0] == '#' && !hl_is_rgb (line))) continue;
+    if ((error = highlight_parse (line)) != NULL) {
+      set_status_message ("%.40s:%d: %s", path, line_no, error);
+    }
+  }
+  free (line);
+  fclose (fp);
+}
+
+/* Returns the highlighted spans of file_row, matching it if it isn't in the
+ * cache. */
+hl_line *highlight_row (int file_row)
+{
+  highlight *h = config.highlight;
+  hl_line *line = &h->cache[file_row % HL_CACHE_ROWS];
+  erow *row = &config.row[file_row];
+  int len = row->size < HL_SCAN_BYTES ? row->size : HL_SCAN_BYTES;
+  regmatch_t *m = h->match;
+  int at = 0, i;
+
+  if (line->row == file_row) return line;
+  line->row = file_row;
+  line->count = 0;
+
+  /* most rows match nothing, which is quicker to find out without the
+   * groups */
+  m[0].rm_so = 0;
+  m[0].rm_eo = len;
+  if (regexec (&h->re, row->chars, 0, m, REG_STARTEND) != 0) return line;
+
+  while (at < len && line->count < HL_MAX_SPANS) {
+    m[0].rm_so = at;
+    m[0].rm_eo = len;
+    if (regexec (&h->re, row->chars, h->groups, m, REG_STARTEND) != 0) {
+      break;
+    }
+    if (m[0].rm_eo == m[0].rm_so) {
+      at = m[0].rm_eo + 1;
+      continue;
+    }
+    for (i = h->num_rules - 1; i > 0; i--) {
+      if (m[h->rules[i].group].rm_so != -1) break;
+    }
+    line->spans[line->count].from = m[0].rm_so;
+    line->spans[line->count].to = m[0].rm_eo;
+    line->spans[line->count].style = STYLE_HIGHLIGHT + i;
+    line->count++;
+    at = m[0].rm_eo;
+  }
+  return line;
+}
+
+/* Adds a rule for this session, or clears them all. */
+void highlight_command ()
+{
+  char *rule = editor_prompt ("Highlight: %s (color regex, or clear)");
+  const char *error;
+
+  if (!rule) return;
+  if (strcmp (rule, "clear") == 0) {
+    highlight_clear ();
+    set_status_message ("Highlight rules cleared");
+  } else if ((error = highlight_parse (rule)) != NULL) {
+    set_status_message ("Highlight: %s", error);
+  } else {
+    set_status_message ("Highlight rules: %d", config.highlight->num_rules);
+  }
+  mem_free (ALLOC_PROMPT, rule);
+}
+
+/*** output ***/
+
+/* Returns the width of the text area, between the gutter and the
+ * scrollbar. */
+int text_cols ()
+{
+  int cols = config.terminal_cols - config.gutter_width -
+    (config.num_rows ? SCROLLBAR_WIDTH : 0);
+  return cols > 1 ? cols : 1;
+}
+
+/* Applies wheel scrolling gathered since the last frame, then makes sure
+ * the cursor is on screen. Wheel scrolling moves the view and drags the
+ * cursor along only when it would leave the screen. */
+void scroll ()
+{
+  int row_len;
+
+  if (config.scroll_pending) {
+    int max_offset = config.num_rows - config.terminal_rows;
+
+    config.row_offset += config.scroll_pending;
+    config.scroll_pending = 0;
+    if (config.row_offset > max_offset) config.row_offset = max_offset;
+    if (config.row_offset < 0) config.row_offset = 0;
+
+    if (config.cur_y < config.row_offset) {
+      config.cur_y = config.row_offset;
+    }
+    if (config.cur_y >= config.row_offset + config.terminal_rows) {
+      config.cur_y = config.row_offset + config.terminal_rows - 1;
+    }
+  }
+  /* the cursor can be left past the end of a shorter row, and everything
+   * below reads the row up to it */
+  row_len = config.cur_y < config.num_rows ? config.row[config.cur_y].size : 0;
+  if (config.cur_x > row_len) config.cur_x = row_len;
+
+  if (config.cur_y < config.row_offset) {
+    config.row_offset = config.cur_y;
+  }
+  if (config.cur_y >= config.row_offset + config.terminal_rows) {
+    config.row_offset = config.cur_y - config.terminal_rows + 1;
+  }
+  json_snap_cursor (-1);
+  if (config.cur_x < config.col_offset) {
+    config.col_offset = config.cur_x;
+  }
+  /* folds, tabs and UTF-8 make columns and bytes differ, so the offset
+   * that brings the cursor on screen has to be found */
+  if (row_col_to_x (config.cur_y, config.col_offset, config.cur_x) >=
+      text_cols ()) {
+    if (config.col_offset < config.cur_x - text_cols () + 1) {
+      config.col_offset = config.cur_x - text_cols () + 1;
+    }
+    while (config.col_offset < config.cur_x &&
+        row_col_to_x (config.cur_y, config.col_offset, config.cur_x) >=
+        text_cols ()) {
+      config.col_offset++;
+    }
+  }
+}
+
+/* Stores the selected columns of file_row in [*from, *to) and returns
+ * whether any of the row is selected. */
+int selection_in_row (int file_row, int *from, int *to)
+{
+  int sy = config.sel_y, sx = config.sel_x;
+  int ey = config.cur_y, ex = config.cur_x;
+
+  if (!config.sel_active) return 0;
+  if (sy > ey || (sy == ey && sx > ex)) {
+    sy = config.cur_y; sx = config.cur_x;
+    ey = config.sel_y; ex = config.sel_x;
+  }
+  if (file_row < sy || file_row > ey) return 0;
+  *from = file_row == sy ? sx : 0;
+  *to = file_row == ey ? ex : config.row[file_row].size;
+  return *from < *to;
+}
+
+/* Draws the line number and change mark of file_row at the start of screen
+ * line y. */
+void draw_gutter (int y, int file_row)
+{
+  static const char marks[] = " +~-";
+  char buf[16];
+  int digits = config.gutter_width - 2;
+
+  format_number (buf, digits, file_row + 1);
+  buf[digits] = config.vcs_marks ? marks[config.vcs_marks[file_row]] : ' ';
+  buf[digits + 1] = ' ';
+  screen_put (y, 0, buf, config.gutter_width, STYLE_NORMAL);
+}
+
+/* Returns the screen column of byte b of file_row in a run that starts
+ * with byte start at column x. */
+int run_x (int file_row, int start, int x, int b)
+{
+  int origin = config.gutter_width;
+  return origin + text_advance (&config.row[file_row].chars[start],
+      b - start, x - origin);
+}
+
+/* Draws bytes [start, end) of file_row from screen column x up to column
+ * limit. Tab stops count from the left edge of the text area. */
+void draw_text_run (int y, int x, int limit, int file_row, int start,
+    int end)
+{
+  erow *row = &config.row[file_row];
+  int origin = config.gutter_width, x0 = x;
+  int from, to, at;
+
+  if (end <= start) return;
+  /* a character cut off by scrolling shows as nothing */
+  while (start < end && (row->chars[start] & 0xc0) == 0x80) start++;
+  end = start + text_bytes_before (&row->chars[start], end - start,
+      x - origin, limit - origin);
+
+  for (at = start; at < end; ) {
+    const char *tab = memchr (&row->chars[at], '\t', end - at);
+    int n = tab ? tab - &row->chars[at] : end - at;
+
+    x = screen_put (y, x, &row->chars[at], n, STYLE_NORMAL);
+    at += n;
+    if (at < end) {
+      int next = origin + text_advance ("\t", 1, x - origin);
+      screen_fill (y, x, next, ' ', STYLE_NORMAL);
+      x = next;
+      at++;
+    }
+  }
+
+  /* highlights and the selection only restyle the columns of their bytes */
+  if (config.highlight) {
+    hl_line *line = highlight_row (file_row);
+    int i;
+
+    for (i = 0; i < line->count; i++) {
+      from = line->spans[i].from < start ? start : line->spans[i].from;
+      to = line->spans[i].to > end ? end : line->spans[i].to;
+      if (from < to) {
+        screen_style (y, run_x (file_row, start, x0, from),
+            run_x (file_row, start, x0, to), line->spans[i].style);
+      }
+    }
+  }
+  if (selection_in_row (file_row, &from, &to) && from < end && to > start) {
+    if (from < start) from = start;
+    if (to > end) to = end;
+    screen_style (y, run_x (file_row, start, x0, from),
+        run_x (file_row, start, x0, to), STYLE_REVERSE);
+  }
+}
+
+/* Draws screen line y. */
+void draw_row (int y)
+{
+  int file_row = y + config.row_offset;
+  int gutter = config.gutter_width;
+
+  screen_fill (y, 0, config.screen_cols, ' ', STYLE_NORMAL);
+  if (file_row >= config.num_rows) {
+    if (config.num_rows == 0 && y == config.terminal_rows / 3) {
+      char welcome[80];
+      int welcome_len = snprintf (welcome, sizeof (welcome),
+          "Pico editor -- version %s", PICO_VERSION);
+      if (welcome_len > config.terminal_rows) {
+        welcome_len = config.terminal_rows;
+      }
+      int padding = (config.terminal_cols - welcome_len) / 2;
+      if (padding) {
+        screen_put (y, 0, "~", 1, STYLE_NORMAL);
+      }
+      screen_put (y, padding, welcome, welcome_len, STYLE_NORMAL);
+    } else {
+      screen_put (y, gutter, "~", 1, STYLE_NORMAL);
+    }
+  } else {
+    text_seg segs[MAX_SEGMENTS];
+    int width = text_cols ();
+    int n = row_segments (file_row, config.col_offset, segs, MAX_SEGMENTS);
+    int i;
+
+    draw_gutter (y, file_row);
+    for (i = 0; i < n && segs[i].x < width; i++) {
+      int room = width - segs[i].x;
+      if (segs[i].folded) {
+        int len = strlen (JSON_FOLD_TEXT);
+        screen_put (y, gutter + segs[i].x, JSON_FOLD_TEXT,
+            len < room ? len : room, STYLE_REVERSE);
+      } else {
+        /* no character that fits takes more than four bytes */
+        int to = segs[i].to - segs[i].from < 4 * room ? segs[i].to :
+          segs[i].from + 4 * room;
+        draw_text_run (y, gutter + segs[i].x, gutter + width, file_row,
+            segs[i].from, to);
+      }
+    }
+  }
+}
+
+void draw_rows ()
+{
+  int y;
+  for (y = 0; y < config.terminal_rows; y++) {
+    draw_row (y);
+  }
+}
+
+/* Draws the scrollbar in the last column: the rows on screen in reverse,
+ * and for the rows behind every scrollbar line the most important kind of
+ * mark there is, as '.', ':' or its own sign by how dense it is compared
+ * with the other lines. */
+void draw_scrollbar ()
+{
+  static const char ramps[DENSITY_COUNT][3] = {
+    {'.', ':', '*'},            /* DENSITY_MATCHES */
+    {'.', ':', '!'},            /* DENSITY_ERRORS */
+    {'.', ':', '+'}             /* DENSITY_CHANGES */
+  };
+  unsigned int max[DENSITY_COUNT] = {0};
+  int rows = config.terminal_rows, n = config.num_rows;
+  int x = config.terminal_cols - SCROLLBAR_WIDTH;
+  int y, k;
+
+  if (n == 0 || x < 0) return;
+  for (k = 0; k < DENSITY_COUNT; k++) {
+    for (y = 0; y < rows; y++) {
+      unsigned int c = density_count (&config.density[k],
+          (long long) y * n / rows, (long long) (y + 1) * n / rows);
+      if (c > max[k]) max[k] = c;
+    }
+  }
+
+  for (y = 0; y < rows; y++) {
+    int from = (long long) y * n / rows, to = (long long) (y + 1) * n / rows;
+    int style = STYLE_NORMAL;
+    char c = ' ';
+
+    if (to == from) to = from + 1;
+    if (from < config.row_offset + rows && to > config.row_offset) {
+      style = STYLE_REVERSE;
+    }
+    for (k = 0; k < DENSITY_COUNT; k++) {
+      unsigned int count = density_count (&config.density[k], from, to);
+      if (count) {
+        unsigned long long scaled = (unsigned long long) count * 3;
+        c = ramps[k][scaled > (unsigned long long) max[k] * 2 ? 2 :
+          scaled > max[k]];
+        break;
+      }
+    }
+    screen_put (y, x, &c, 1, style);
+  }
+}
+
+void draw_status_bar ()
+{
+  char status[80], rstatus[80];
+  int len, rlen;
+  int y = config.terminal_rows;
+
+  screen_fill (y, 0, config.screen_cols, ' ', STYLE_REVERSE);
+  len = snprintf (status, sizeof (status), "%.20s - %d lines",
+      config.filename ? config.filename : "[No Name]", config.num_rows);
+  rlen = snprintf (rstatus, sizeof (rstatus), "%d/%d",
+      config.cur_y + 1, config.num_rows);
+  screen_put (y, 0, status, len, STYLE_REVERSE);
+  if (len + rlen <= config.terminal_cols) {
+    screen_put (y, config.terminal_cols - rlen, rstatus, rlen, STYLE_REVERSE);
+  }
+
+  /* the JSON path goes in between, cut from the left to fit */
+  if (config.json) {
+    int room = config.terminal_cols - len - rlen - 4;
+    int path_len;
+
+    json_update_path ();
+    path_len = strlen (config.json_path);
+    if (room > 0 && path_len > room) {
+      screen_put (y, len + 2, config.json_path + path_len - room, room,
+          STYLE_REVERSE);
+    } else if (room > 0) {
+      screen_put (y, len + 2, config.json_path, path_len, STYLE_REVERSE);
+    }
+  }
+}
+
+/* Draws the latency overlay in the top right corner of the text area. */
+void draw_overlay ()
+{
+  char buf[128];
+  int len;
+
+  if (!config.show_overlay) return;
+  len = latency_summary (buf, sizeof (buf));
+  if (len > config.terminal_cols) len = config.terminal_cols;
+  screen_put (0, config.terminal_cols - len, buf, len, STYLE_REVERSE);
+}
+
+void draw_message_bar ()
+{
+  int len = strlen (config.status_msg);
+  int y = config.terminal_rows + 1;
+
+  screen_fill (y, 0, config.screen_cols, ' ', STYLE_NORMAL);
+  if (len && time (NULL) - config.status_msg_time < PICO_MESSAGE_TIMEOUT) {
+    screen_put (y, 0, config.status_msg, len, STYLE_NORMAL);
+  }
+}
+
+void refresh_screen ()
+{
+  unsigned long long start = now_ns ();
+
+  if (config.rendering_suspended) {
+    return;
+  }
+
+  scroll ();
+
+  append_buffer *ab = &config.out;
+  ab->len = 0;
+
+  if (config.col_offset == config.drawn_col_offset) {
+    screen_scroll (ab, config.terminal_rows,
+        config.row_offset - config.drawn_row_offset);
+  }
+  config.drawn_row_offset = config.row_offset;
+  config.drawn_col_offset = config.col_offset;
+
+  draw_rows ();
+  draw_scrollbar ();
+  draw_overlay ();
+  draw_status_bar ();
+  draw_message_bar ();
+  screen_flush (ab, config.cur_y - config.row_offset,
+      row_col_to_x (config.cur_y, config.col_offset, config.cur_x) +
+      config.gutter_width);
+  trace_span ("render", start);
+}
+
+void set_status_message (const char *fmt, ...)
+{
+  va_list ap;
+  va_start (ap, fmt);
+  vsnprintf (config.status_msg, sizeof (config.status_msg), fmt, ap);
+  va_end (ap);
+  config.status_msg_time = time (NULL);
+}
+
+/*** input ***/
+
+/* Shows prompt in the message bar and returns what the user typed, or NULL
+ * if the prompt was cancelled. The prompt is a format string with a single
+ * %s for the input so far. */
+char *editor_prompt (char *prompt)
+{
+  size_t buf_size = 128;
+  char *buf = mem_alloc (ALLOC_PROMPT, buf_size);
+  size_t buf_len = 0;
+
+  buf[0] = '\0';
+  while (1) {
+    set_status_message (prompt, buf);
+    refresh_screen ();
+
+    int c = read_key ();
+    if (c == DEL_KEY || c == CTRL_KEY('h') || c == 127) {
+      if (buf_len != 0) buf[--buf_len] = '\0';
+    } else if (c == '\x1b') {
+      set_status_message ("");
+      mem_free (ALLOC_PROMPT, buf);
+      return NULL;
+    } else if (c == PASTE_EVENT) {
+      int i;
+      for (i = 0; i < config.paste_len; i++) {
+        if (iscntrl ((unsigned char) config.paste[i])) continue;
+        if (buf_len == buf_size - 1) {
+          buf_size *= 2;
+          buf = mem_realloc (ALLOC_PROMPT, buf, buf_size);
+        }
+        buf[buf_len++] = config.paste[i];
+      }
+      buf[buf_len] = '\0';
+    } else if (c == '\r') {
+      if (buf_len != 0) {
+        set_status_message ("");
+        return buf;
+      }
+    } else if (c < 128 && !iscntrl (c)) {
+      if (buf_len == buf_size - 1) {
+        buf_size *= 2;
+        buf = mem_realloc (ALLOC_PROMPT, buf, buf_size);
+      }
+      buf[buf_len++] = c;
+      buf[buf_len] = '\0';
+    }
+  }
+}
+
+/* Moves the cursor to the start of line, scrolling it into the middle of
+ * the screen. */
+void jump_to_line (int line)
+{
+  if (line >= config.num_rows) line = config.num_rows ? config.num_rows - 1 : 0;
+  if (line < 0) line = 0;
+  config.cur_y = line;
+  config.cur_x = 0;
+  config.col_offset = 0;
+  config.row_offset = line - config.terminal_rows / 2;
+  if (config.row_offset < 0) config.row_offset = 0;
+}
+
+void move_cursor (int key)
+{
+  erow *row;
+
+  row = (config.cur_y >= config.num_rows) ? NULL : &config.row[config.cur_y];
+  switch (key) {
+    case ARROW_LEFT:
+      if (config.cur_x > 0) {
+        /* a UTF-8 character is one step */
+        do {
+          config.cur_x--;
+        } while (config.cur_x > 0 &&
+            (row->chars[config.cur_x] & 0xc0) == 0x80);
+      } else if (config.cur_y > 0) {
+        config.cur_y--;
+        config.cur_x = config.row[config.cur_y].size;
+      }
+      break;
+    case ARROW_RIGHT:
+      if (row && config.cur_x < row->size) {
+        do {
+          config.cur_x++;
+        } while (config.cur_x < row->size &&
+            (row->chars[config.cur_x] & 0xc0) == 0x80);
+      } else if (row && config.cur_x == row->size) {
+        config.cur_y++;
+        config.cur_x = 0;
+      }
+      break;
+    case ARROW_UP:
+      if (config.cur_y > 0) {
+        config.cur_y--;
+      }
+      break;
+    case ARROW_DOWN:
+      if (config.cur_y < config.num_rows) {
+        config.cur_y++;
+      }
+      break;
+  }
+
+  row = (config.cur_y >= config.num_rows) ? NULL : &config.row[config.cur_y];
+  int row_len = row ? row->size : 0;
+  if (config.cur_x > row_len) {
+    config.cur_x = row_len;
+  }
+  json_snap_cursor (key == ARROW_RIGHT ? 1 : -1);
+}
+
+/* Moves the cursor to screen position x, y (one based), if that is inside
+ * the text area. Returns whether the cursor moved. */
+int place_cursor (int x, int y)
+{
+  int file_row, row_len;
+
+  if (y < 1 || y > config.terminal_rows) return 0;
+  file_row = config.row_offset + y - 1;
+  if (file_row >= config.num_rows) {
+    file_row = config.num_rows ? config.num_rows - 1 : 0;
+  }
+  row_len = file_row < config.num_rows ? config.row[file_row].size : 0;
+  config.cur_y = file_row;
+  x -= 1 + config.gutter_width;
+  config.cur_x = row_x_to_col (file_row, config.col_offset, x < 0 ? 0 : x);
+  if (config.cur_x > row_len) config.cur_x = row_len;
+  return 1;
+}
+
+/* Clicking places the cursor, dragging selects and the wheel scrolls. Wheel
+ * events only add to scroll_pending, so a burst of them read before the next
+ * frame is drawn ends up as a single scroll. */
+void handle_mouse ()
+{
+  mouse_event *m = &config.mouse;
+  int button = m->button & MOUSE_BUTTON_MASK;
+
+  if (button == MOUSE_WHEEL_UP || button == MOUSE_WHEEL_DOWN) {
+    config.scroll_pending += button == MOUSE_WHEEL_UP ?
+      -MOUSE_WHEEL_LINES : MOUSE_WHEEL_LINES;
+    return;
+  }
+  if (button != MOUSE_LEFT) return;
+
+  /* a click on the scrollbar jumps to that part of the file */
+  if (m->pressed && !(m->button & MOUSE_MOTION) && config.num_rows &&
+      m->x > config.terminal_cols - SCROLLBAR_WIDTH &&
+      m->y >= 1 && m->y <= config.terminal_rows) {
+    jump_to_line ((long long) (m->y - 1) * config.num_rows /
+        config.terminal_rows);
+    config.sel_active = 0;
+    return;
+  }
+
+  if (!m->pressed) {
+    config.dragging = 0;
+  } else if (m->button & MOUSE_MOTION) {
+    if (config.dragging && place_cursor (m->x, m->y)) {
+      config.sel_active = config.cur_x != config.sel_x ||
+        config.cur_y != config.sel_y;
+    }
+  } else if (place_cursor (m->x, m->y)) {
+    config.dragging = 1;
+    config.sel_active = 0;
+    config.sel_x = config.cur_x;
+    config.sel_y = config.cur_y;
+  }
+}
+
+/*** motions ***/
+
+/* Motions over words, paragraphs and indentation. They scan far more text
+ * than the cursor moves over, so the scans go 16 bytes of a row, or four
+ * rows of the row table, at a time with SSE2. */
+
+/* Byte classes for word motions. Letters, digits, '_' and the bytes of
+ * UTF-8 sequences make up words, and runs of other punctuation are words
+ * of their own. CLASS_TEXT is anything but a blank, for the motions over
+ * words separated by blanks only. */
+enum byte_class {
+  CLASS_BLANK,
+  CLASS_WORD,
+  CLASS_PUNCT,
+  CLASS_TEXT
+};
+
+int byte_class (char c, int big)
+{
+  unsigned char u = c;
+
+  if (u == ' ' || u == '\t') return CLASS_BLANK;
+  if (big) return CLASS_TEXT;
+  return isalnum (u) || u == '_' || u >= 0x80 ? CLASS_WORD : CLASS_PUNCT;
+}
+
+#ifdef __SSE2__
+/* Returns a mask of the bytes among the 16 at s that are of class. */
+unsigned int class_mask (const char *s, int class)
+{
+  __m128i v = _mm_loadu_si128 ((const __m128i *) s);
+  __m128i folded = _mm_or_si128 (v, _mm_set1_epi8 (0x20));
+  __m128i blank = _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 (' ')),
+      _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\t')));
+  __m128i word;
+
+  if (class == CLASS_BLANK) return _mm_movemask_epi8 (blank);
+  if (class == CLASS_TEXT) return ~_mm_movemask_epi8 (blank) & 0xffff;
+  /* the compares are signed, so bytes of UTF-8 sequences are negative */
+  word = _mm_or_si128 (
+      _mm_or_si128 (
+        _mm_and_si128 (_mm_cmpgt_epi8 (folded, _mm_set1_epi8 ('a' - 1)),
+          _mm_cmplt_epi8 (folded, _mm_set1_epi8 ('z' + 1))),
+        _mm_and_si128 (_mm_cmpgt_epi8 (v, _mm_set1_epi8 ('0' - 1)),
+          _mm_cmplt_epi8 (v, _mm_set1_epi8 ('9' + 1)))),
+      _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('_')),
+        _mm_cmplt_epi8 (v, _mm_setzero_si128 ())));
+  if (class == CLASS_WORD) return _mm_movemask_epi8 (word);
+  return ~_mm_movemask_epi8 (_mm_or_si128 (word, blank)) & 0xffff;
+}
+#endif
+
+/* Returns the first position of the len bytes at s, from from on in
+ * direction dir, that is not of class; len or -1 if there is none. */
+int skip_class (const char *s, int len, int from, int dir, int class)
+{
+  int i = from;
+
+#ifdef __SSE2__
+  if (dir > 0) {
+    for (; i + 16 <= len; i += 16) {
+      unsigned int mask = ~class_mask (s + i, class) & 0xffff;
+      if (mask) return i + __builtin_ctz (mask);
+    }
+  } else {
+    for (; i >= 15; i -= 16) {
+      unsigned int mask = ~class_mask (s + i - 15, class) & 0xffff;
+      if (mask) return i - 15 + 31 - __builtin_clz (mask);
+    }
+  }
+#endif
+  for (; i >= 0 && i < len; i += dir) {
+    if (byte_class (s[i], class == CLASS_TEXT) != class) return i;
+  }
+  return i;
+}
+
+/* Returns the first row from from on in direction dir that is empty if
+ * empty is set, or that is not otherwise; -1 or num_rows if there is none.
+ * from may be one past the rows in direction dir, but not after them.
+ * With SSE2 the sizes of four rows are picked out of the row table and
+ * compared at once. */
+int find_row (int from, int dir, int empty)
+{
+  int r = from;
+
+#ifdef __SSE2__
+  if (sizeof (erow) == 16 && offsetof (erow, size) == 0) {
+    for (; dir > 0 ? r + 4 <= config.num_rows : r >= 3; r += 4 * dir) {
+      const __m128i *e = (const __m128i *) &config.row[dir > 0 ? r : r - 3];
+      __m128i sizes = _mm_unpacklo_epi64 (
+          _mm_unpacklo_epi32 (_mm_loadu_si128 (e), _mm_loadu_si128 (e + 1)),
+          _mm_unpacklo_epi32 (_mm_loadu_si128 (e + 2),
+            _mm_loadu_si128 (e + 3)));
+      unsigned int mask = _mm_movemask_ps (_mm_castsi128_ps (
+            _mm_cmpeq_epi32 (sizes, _mm_setzero_si128 ())));
+
+      if (!empty) mask ^= 0xf;
+      if (mask && dir > 0) return r + __builtin_ctz (mask);
+      if (mask) return r - 3 + 31 - __builtin_clz (mask);
+    }
+  }
+#endif
+  for (; r >= 0 && r < config.num_rows; r += dir) {
+    if ((config.row[r].size == 0) == empty) return r;
+  }
+  return r;
+}
+
+void motion_goto (int y, int x, int dir)
+{
+  config.cur_y = y;
+  config.cur_x = x;
+  json_snap_cursor (dir);
+}
+
+/* Moves to the start of the next word, or of the word before the cursor,
+ * like vi's w and b. Big words are separated by blanks only, like W and
+ * B, so moving forward goes to the next non-blank after a blank. Empty
+ * rows count as words. */
+void word_motion (int dir, int big)
+{
+  int y = config.cur_y, x = config.cur_x;
+  erow *row;
+
+  if (config.num_rows == 0) return;
+  if (y >= config.num_rows) {
+    if (dir > 0) return;
+    y = config.num_rows - 1;
+    x = config.row[y].size;
+  }
+  row = &config.row[y];
+
+  if (dir > 0) {
+    if (x < row->size) {
+      int class = byte_class (row->chars[x], big);
+      if (class != CLASS_BLANK) {
+        x = skip_class (row->chars, row->size, x, 1, class);
+      }
+      x = skip_class (row->chars, row->size, x, 1, CLASS_BLANK);
+    }
+    while (x == row->size && y + 1 < config.num_rows) {
+      row = &config.row[++y];
+      x = skip_class (row->chars, row->size, 0, 1, CLASS_BLANK);
+      if (row->size == 0) break;
+    }
+  } else {
+    x = skip_class (row->chars, row->size, x - 1, -1, CLASS_BLANK);
+    while (x < 0 && y > 0) {
+      row = &config.row[--y];
+      if (row->size == 0) break;
+      x = skip_class (row->chars, row->size, row->size - 1, -1, CLASS_BLANK);
+    }
+    if (x < 0) {
+      x = 0;
+    } else {
+      x = skip_class (row->chars, row->size, x, -1,
+          byte_class (row->chars[x], big)) + 1;
+    }
+  }
+  motion_goto (y, x, dir);
+}
+
+/* Moves to the first row of the next paragraph, or to the first row of
+ * this one or the one before. Paragraphs are separated by empty rows. */
+void paragraph_motion (int dir)
+{
+  int y;
+
+  if (config.num_rows == 0) return;
+  if (dir > 0) {
+    y = find_row (find_row (config.cur_y, 1, 1), 1, 0);
+    if (y == config.num_rows) y = config.num_rows - 1;
+  } else {
+    y = find_row (find_row (config.cur_y - 1, -1, 0), -1, 1) + 1;
+  }
+  motion_goto (y, 0, dir);
+}
+
+/* Moves to the next empty row that follows text, like vi's } and {. */
+void blank_motion (int dir)
+{
+  int y = config.cur_y + dir;
+
+  if (config.num_rows == 0) return;
+  if (y > config.num_rows) y = config.num_rows;
+  y = find_row (find_row (y, dir, 0), dir, 1);
+  if (y < 0) y = 0;
+  if (y >= config.num_rows) y = config.num_rows - 1;
+  motion_goto (y, 0, dir);
+}
+
+/* Returns how many blanks row r starts with. */
+int row_indent (int r)
+{
+  erow *row = &config.row[r];
+  return skip_class (row->chars, row->size, 0, 1, CLASS_BLANK);
+}
+
+/* Moves to the first non-blank of the next row whose indentation differs
+ * from this row's, skipping rows that are empty or all blanks. */
+void indent_motion (int dir)
+{
+  int y = config.cur_y, indent;
+
+  if (config.num_rows == 0) return;
+  if (y >= config.num_rows) y = config.num_rows - 1;
+  indent = row_indent (y);
+  for (y += dir; (y = find_row (y, dir, 0)) >= 0 && y < config.num_rows;
+      y += dir) {
+    int x = row_indent (y);
+    if (x != indent && x < config.row[y].size) {
+      motion_goto (y, x, dir);
+      return;
+    }
+  }
+  set_status_message ("No line with a different indentation %s",
+      dir > 0 ? "below" : "above");
+}
+
+/*** macros ***/
+
+void toggle_macro_recording ()
+{
+  if (config.macro_recording) {
+    config.macro_recording = 0;
+    config.macro_len--;  /* drop the key that stopped the recording */
+    set_status_message ("Recorded macro of %d keys", config.macro_len);
+  } else {
+    config.macro_recording = 1;
+    config.macro_len = 0;
+    set_status_message ("Recording macro... (Ctrl-R to stop)");
+  }
+}
+
+/* Replays the macro times times, or once on every line if every_line is
+ * set. Nothing is drawn until the replay is over, so the cost of a replay is
+ * the cost of the commands it runs; the main loop draws a single frame once
+ * we return. */
+void play_macro (int times, int every_line)
+{
+  unsigned long long start = now_ns ();
+  int i, line;
+
+  config.rendering_suspended = 1;
+  if (every_line) {
+    for (line = 0; line < config.num_rows; line++) {
+      config.cur_y = line;
+      config.cur_x = 0;
+      config.macro_pos = 0;
+      while (config.macro_pos < config.macro_len) process_key_press ();
+    }
+  } else {
+    for (i = 0; i < times; i++) {
+      config.macro_pos = 0;
+      while (config.macro_pos < config.macro_len) process_key_press ();
+    }
+  }
+  config.macro_pos = -1;
+  config.rendering_suspended = 0;
+  trace_span ("macro replay", start);
+}
+
+void apply_macro ()
+{
+  char *answer;
+  int times;
+
+  if (config.macro_recording) {
+    config.macro_len--;  /* a macro can't replay itself */
+    set_status_message ("Can't apply a macro while recording");
+    return;
+  }
+  if (config.macro_pos >= 0) {
+    return;
+  }
+  if (config.macro_len == 0) {
+    set_status_message ("No macro recorded (Ctrl-R to record)");
+    return;
+  }
+
+  answer = editor_prompt ("Apply macro: %s (count, or 'a' for every line)");
+  if (!answer) return;
+  if (strcmp (answer, "a") == 0) {
+    play_macro (0, 1);
+    set_status_message ("Applied macro to %d lines", config.num_rows);
+  } else if ((times = atoi (answer)) > 0) {
+    play_macro (times, 0);
+    set_status_message ("Applied macro %d times", times);
+  } else {
+    set_status_message ("Invalid count: %s", answer);
+  }
+  mem_free (ALLOC_PROMPT, answer);
+}
+
+/*** key dispatch ***/
+
+void json_command (int key)
+{
+  if (!config.json) {
+    set_status_message (json_running ? "Still indexing..." :
+        "Not a JSON document");
+    return;
+  }
+  switch (key) {
+    case ALT_KEY('u'): json_parent (); break;
+    case ALT_KEY('n'): json_next_sibling (); break;
+    case ALT_KEY('b'): json_previous_sibling (); break;
+    case ALT_KEY('k'): json_next_key (); break;
+    case ALT_KEY('f'): json_toggle_fold (); break;
+    case ALT_KEY('p'): pretty_view (); break;
+  }
+}
+
+void export_trace ()
+{
+  char *path = editor_prompt ("Write trace to: %s (ESC to cancel)");
+  int spans;
+
+  if (!path) return;
+  if ((spans = trace_export (path)) == -1) {
+    set_status_message ("Can't write %s: %s", path, strerror (errno));
+  } else {
+    set_status_message ("Wrote %d spans to %s", spans, path);
+  }
+  mem_free (ALLOC_PROMPT, path);
+}
+
+void save_file ()
+{
+  char *path = editor_prompt ("Save as: %s (ESC to cancel)");
+  unsigned long long start = now_ns ();
+  long long bytes;
+
+  if (!path) return;
+  if ((bytes = editor_save (path)) == -1) {
+    set_status_message ("Can't write %s: %s", path, strerror (errno));
+  } else {
+    set_status_message ("Wrote %lld bytes to %s in %llu ms", bytes, path,
+        (now_ns () - start) / 1000000);
+    /* the change marks compare the file on disk with git */
+    if (config.filename && strcmp (path, config.filename) == 0) {
+      vcs_refresh ();
+    }
+  }
+  trace_span ("save", start);
+  mem_free (ALLOC_PROMPT, path);
+}
+
+void process_key_press ()
+{
+  int c = read_key ();
+
+  switch (c) {
+    case CTRL_KEY('q'):
+      write (STDOUT_FILENO, "\x1b[2J", 4);
+      write (STDOUT_FILENO, "\x1b[H", 3);
+      exit (0);
+      break;
+    case HOME_KEY:
+      config.sel_active = 0;
+      config.cur_x = 0;
+      break;
+    case END_KEY:
+      config.sel_active = 0;
+      config.cur_x = config.cur_y < config.num_rows ?
+        config.row[config.cur_y].size : 0;
+      break;
+    case PAGE_UP:
+    case PAGE_DOWN:
+      config.sel_active = 0;
+      {
+        int times = config.terminal_rows;
+        while (times--) move_cursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+      }
+      break;
+    case ARROW_UP:
+    case ARROW_DOWN:
+    case ARROW_LEFT:
+    case ARROW_RIGHT:
+      config.sel_active = 0;
+      move_cursor (c);
+      break;
+    case CTRL_LEFT:
+    case CTRL_RIGHT:
+    case ALT_LEFT:
+    case ALT_RIGHT:
+      config.sel_active = 0;
+      word_motion (c == CTRL_RIGHT || c == ALT_RIGHT ? 1 : -1,
+          c == ALT_LEFT || c == ALT_RIGHT);
+      break;
+    case CTRL_UP:
+    case CTRL_DOWN:
+      config.sel_active = 0;
+      paragraph_motion (c == CTRL_DOWN ? 1 : -1);
+      break;
+    case ALT_UP:
+    case ALT_DOWN:
+      config.sel_active = 0;
+      blank_motion (c == ALT_DOWN ? 1 : -1);
+      break;
+    case SHIFT_UP:
+    case SHIFT_DOWN:
+      config.sel_active = 0;
+      indent_motion (c == SHIFT_DOWN ? 1 : -1);
+      break;
+    case MOUSE_EVENT:
+      handle_mouse ();
+      break;
+    case PASTE_EVENT:
+      set_status_message ("Can't paste %d bytes: the buffer is read-only",
+          config.paste_len);
+      break;
+    case CTRL_KEY('g'):
+      grep_project ();
+      break;
+    case CTRL_KEY('r'):
+      toggle_macro_recording ();
+      break;
+    case CTRL_KEY('e'):
+      apply_macro ();
+      break;
+    case CTRL_KEY('t'):
+      config.show_overlay = !config.show_overlay;
+      break;
+    case CTRL_KEY('x'):
+      export_trace ();
+      break;
+    case CTRL_KEY('s'):
+      save_file ();
+      break;
+    case ALT_KEY('c'):
+      group_rows ();
+      break;
+    case ALT_KEY('s'):
+      stats_rows ();
+      break;
+    case ALT_KEY('m'):
+      multi_search ();
+      break;
+    case ALT_KEY('h'):
+      highlight_command ();
+      break;
+    case ALT_KEY('a'):
+      approx_search ();
+      break;
+    case ALT_KEY('l'):
+      multiline_search ();
+      break;
+    case CTRL_KEY('p'):
+      line_finder ();
+      break;
+    case CTRL_KEY('o'):
+      quick_open ();
+      break;
+    case ALT_KEY('o'):
+      symbol_outline ();
+      break;
+    case ALT_KEY('d'):
+      goto_definition ();
+      break;
+    case ALT_KEY('u'):
+    case ALT_KEY('n'):
+    case ALT_KEY('b'):
+    case ALT_KEY('k'):
+    case ALT_KEY('f'):
+    case ALT_KEY('p'):
+      json_command (c);
+      break;
+  }
+
+}
+
+/*** picker ***/
+
+void picker_draw (const char *title, char **items, int count, int selected,
+    int offset)
+{
+  append_buffer *ab = &config.out;
+  char info[32];
+  int y, info_len;
+
+  if (config.rendering_suspended) {
+    return;
+  }
+
+  screen_fill (0, 0, config.screen_cols, ' ', STYLE_REVERSE);
+  screen_put (0, 0, title, strlen (title), STYLE_REVERSE);
+  info_len = snprintf (info, sizeof (info), "%d/%d",
+      count ? selected + 1 : 0, count);
+  if ((int) strlen (title) + info_len <= config.terminal_cols) {
+    screen_put (0, config.terminal_cols - info_len, info, info_len,
+        STYLE_REVERSE);
+  }
+
+  for (y = 0; y < config.terminal_rows; y++) {
+    int i = offset + y;
+    int style = i == selected ? STYLE_REVERSE : STYLE_NORMAL;
+
+    screen_fill (y + 1, 0, config.screen_cols, ' ', style);
+    if (i < count) {
+      screen_put (y + 1, 0, items[i], strlen (items[i]), style);
+    }
+  }
+
+  y = config.terminal_rows + 1;
+  screen_fill (y, 0, config.screen_cols, ' ', STYLE_NORMAL);
+  screen_put (y, 0, "Enter = open | Esc = cancel", 27, STYLE_NORMAL);
+
+  ab->len = 0;
+  screen_flush (ab, selected - offset + 1, 0);
+}
+
+/* Shows items as a full screen list the user can move through with the
+ * arrow keys. Returns the index of the chosen item, or -1 if the picker was
+ * cancelled. */
+int picker_select (const char *title, char **items, int count)
+{
+  int selected = 0, offset = 0;
+  int height = config.terminal_rows;
+
+  while (1) {
+    if (selected < offset) offset = selected;
+    if (selected >= offset + height) offset = selected - height + 1;
+    picker_draw (title, items, count, selected, offset);
+
+    int c = read_key ();
+    switch (c) {
+      case '\r':
+        if (count) return selected;
+        break;
+      case '\x1b':
+      case CTRL_KEY('q'):
+        return -1;
+      case ARROW_UP:
+        if (selected > 0) selected--;
+        break;
+      case ARROW_DOWN:
+        if (selected < count - 1) selected++;
+        break;
+      case PAGE_UP:
+        selected -= height;
+        if (selected < 0) selected = 0;
+        break;
+      case PAGE_DOWN:
+        selected += height;
+        if (selected > count - 1) selected = count ? count - 1 : 0;
+        break;
+      case HOME_KEY:
+        selected = 0;
+        break;
+      case END_KEY:
+        selected = count ? count - 1 : 0;
+        break;
+    }
+  }
+}
+
+/*** pretty view ***/
+
+/* The pretty view shows a JSON document with one element per line,
+ * indented by depth, without touching the rows. Lines are never stored:
+ * each one is found from its neighbour through the structural index, so
+ * only the lines on screen are looked at, however big the document is. A
+ * line breaks after an opening bracket or a comma and before a closing
+ * bracket; empty containers stay on one line. Every position on screen is
+ * a byte offset of the document, and that is where the cursor is left on
+ * the way back. */
+
+int pretty_break_after (int k)
+{
+  json_index *ix = config.json;
+  char c = ix->kind[k];
+
+  if (c == ',') return 1;
+  return (c == '{' || c == '[') && ix->match[k] != k + 1;
+}
+
+int pretty_break_before (int k)
+{
+  json_index *ix = config.json;
+  char c = ix->kind[k];
+
+  return (c == '}' || c == ']') && (k == 0 || ix->match[k] != k - 1);
+}
+
+long long pretty_end ()
+{
+  return config.json->row_start[config.json->num_rows];
+}
+
+/* Returns where the line that starts at start ends. */
+long long pretty_next_start (long long start)
+{
+  json_index *ix = config.json;
+  int k;
+
+  for (k = json_entries_before (start); k < ix->count; k++) {
+    if (ix->pos[k] > start && pretty_break_before (k)) return ix->pos[k];
+    if (pretty_break_after (k)) return ix->pos[k] + 1;
+  }
+  return pretty_end ();
+}
+
+/* Returns where the last line that starts before start starts. */
+long long pretty_prev_start (long long start)
+{
+  json_index *ix = config.json;
+  int k;
+
+  for (k = json_entries_before (start) - 1; k >= 0; k--) {
+    if (pretty_break_after (k) && ix->pos[k] + 1 < start) {
+      return ix->pos[k] + 1;
+    }
+    if (pretty_break_before (k) && ix->pos[k] < start) return ix->pos[k];
+  }
+  return 0;
+}
+
+/* Returns whether the line that starts at start begins with a closing
+ * bracket, which goes one level out. */
+int pretty_starts_close (long long start)
+{
+  json_index *ix = config.json;
+  int k = json_entries_before (start);
+
+  return k < ix->count && ix->pos[k] == start && pretty_break_before (k);
+}
+
+/* Returns whether line l ends with an opening bracket. */
+int pretty_ends_open (pretty_line *l)
+{
+  json_index *ix = config.json;
+  int k = json_entries_before (l->end) - 1;
+
+  return k >= 0 && ix->pos[k] == l->end - 1 && ix->kind[k] != ',' &&
+    pretty_break_after (k);
+}
+
+/* Returns the line that holds offset at. Its depth takes a walk out
+ * through the enclosing containers, so moving from line to line goes
+ * through pretty_next and pretty_prev instead. */
+pretty_line pretty_line_at (long long at)
+{
+  pretty_line l;
+  int sep, index, open;
+
+  if (at >= pretty_end ()) at = pretty_end () - 1;
+  l.start = pretty_prev_start (at + 1);
+  l.end = pretty_next_start (l.start);
+  l.depth = pretty_starts_close (l.start) ? -1 : 0;
+  for (open = json_enclosing (l.start, &sep, &index); open >= 0;
+      open = json_enclosing (config.json->pos[open], &sep, &index)) {
+    l.depth++;
+  }
+  if (l.depth < 0) l.depth = 0;
+  return l;
+}
+
+/* Moves l to the next line. Returns 0 if it is the last one. */
+int pretty_next (pretty_line *l)
+{
+  int depth = l->depth + pretty_ends_open (l);
+
+  if (l->end >= pretty_end ()) return 0;
+  l->start = l->end;
+  l->end = pretty_next_start (l->start);
+  depth -= pretty_starts_close (l->start);
+  l->depth = depth > 0 ? depth : 0;
+  return 1;
+}
+
+/* Moves l to the line before. Returns 0 if it is the first one. */
+int pretty_prev (pretty_line *l)
+{
+  int depth;
+
+  if (l->start == 0) return 0;
+  depth = l->depth + pretty_starts_close (l->start);
+  l->end = l->start;
+  l->start = pretty_prev_start (l->start);
+  depth -= pretty_ends_open (l);
+  l->depth = depth > 0 ? depth : 0;
+  return 1;
+}
+
+/* Stores the bytes line l shows, without the white space around them, in
+ * [*from, *to). */
+void pretty_text (pretty_line *l, long long *from, long long *to)
+{
+  long long a = l->start, b = l->end;
+
+  while (a < b && isspace ((unsigned char) json_byte (a))) a++;
+  while (b > a && isspace ((unsigned char) json_byte (b - 1))) b--;
+  *from = a;
+  *to = b;
+}
+
+/* Copies len bytes from offset at into buf, with spaces for row breaks and
+ * control characters. */
+void pretty_copy (long long at, char *buf, int len)
+{
+  int row = json_row_of (at), i = 0;
+  long long col = at - config.json->row_start[row];
+
+  while (i < len) {
+    erow *r = &config.row[row];
+    if (col < r->size) {
+      char c = r->chars[col++];
+      buf[i++] = (unsigned char) c < 0x20 ? ' ' : c;
+    } else {
+      buf[i++] = ' ';
+      row++;
+      col = 0;
+    }
+  }
+}
+
+/* Returns the column of the cursor. */
+int pretty_x (pretty_state *v)
+{
+  long long from, to;
+
+  pretty_text (&v->line, &from, &to);
+  return v->line.depth * PRETTY_INDENT + (int) (v->at - from);
+}
+
+/* Puts the cursor as close to column x of its line as the text allows. */
+void pretty_set_x (pretty_state *v, int x)
+{
+  long long from, to, at;
+
+  pretty_text (&v->line, &from, &to);
+  at = from + x - v->line.depth * PRETTY_INDENT;
+  if (at > to - 1) at = to - 1;
+  if (at < from) at = from;
+  v->at = at;
+}
+
+/* Moves the cursor one line down, scrolling if it has to. Returns 0 on the
+ * last line. */
+int pretty_down (pretty_state *v)
+{
+  if (!pretty_next (&v->line)) return 0;
+  if (++v->y >= config.terminal_rows) {
+    pretty_next (&v->top);
+    v->y--;
+  }
+  return 1;
+}
+
+int pretty_up (pretty_state *v)
+{
+  if (!pretty_prev (&v->line)) return 0;
+  if (--v->y < 0) {
+    v->top = v->line;
+    v->y = 0;
+  }
+  return 1;
+}
+
+void pretty_move (pretty_state *v, int key)
+{
+  long long from, to;
+
+  pretty_text (&v->line, &from, &to);
+  switch (key) {
+    case ARROW_UP:
+      if (pretty_up (v)) pretty_set_x (v, v->want_x);
+      return;
+    case ARROW_DOWN:
+      if (pretty_down (v)) pretty_set_x (v, v->want_x);
+      return;
+    case ARROW_LEFT:
+      if (v->at > from) {
+        v->at--;
+      } else if (pretty_up (v)) {
+        pretty_set_x (v, INT_MAX);
+      }
+      break;
+    case ARROW_RIGHT:
+      if (v->at < to - 1) {
+        v->at++;
+      } else if (pretty_down (v)) {
+        pretty_set_x (v, 0);
+      }
+      break;
+    case HOME_KEY:
+      v->at = from;
+      break;
+    case END_KEY:
+      v->at = to > from ? to - 1 : from;
+      break;
+  }
+  v->want_x = pretty_x (v);
+}
+
+/* Moves the cursor to offset at. The screen stays where it is if the line
+ * is on it, otherwise the line goes to the middle. */
+void pretty_show (pretty_state *v, long long at, int centre)
+{
+  pretty_line l = v->top;
+  int y;
+
+  v->line = pretty_line_at (at);
+  v->at = at;
+  pretty_set_x (v, pretty_x (v));
+  v->want_x = pretty_x (v);
+
+  for (y = 0; !centre && y < config.terminal_rows; y++) {
+    if (l.start == v->line.start) {
+      v->y = y;
+      return;
+    }
+    if (!pretty_next (&l)) break;
+  }
+  v->top = v->line;
+  for (v->y = 0; v->y < config.terminal_rows / 2 && pretty_prev (&v->top);
+      v->y++);
+}
+
+/* The wheel moves the screen and drags the cursor along when it would
+ * leave it; a click places the cursor. */
+void pretty_mouse (pretty_state *v)
+{
+  mouse_event *m = &config.mouse;
+  int button = m->button & MOUSE_BUTTON_MASK;
+  int i;
+
+  if (button == MOUSE_WHEEL_DOWN) {
+    for (i = 0; i < MOUSE_WHEEL_LINES && pretty_next (&v->top); i++) {
+      if (--v->y < 0) {
+        v->line = v->top;
+        v->y = 0;
+        pretty_set_x (v, v->want_x);
+      }
+    }
+  } else if (button == MOUSE_WHEEL_UP) {
+    for (i = 0; i < MOUSE_WHEEL_LINES && pretty_prev (&v->top); i++) {
+      if (++v->y >= config.terminal_rows) {
+        pretty_prev (&v->line);
+        v->y--;
+        pretty_set_x (v, v->want_x);
+      }
+    }
+  } else if (button == MOUSE_LEFT && m->pressed && m->y >= 1 &&
+      m->y <= config.terminal_rows) {
+    v->line = v->top;
+    for (v->y = 0; v->y < m->y - 1 && pretty_next (&v->line); v->y++);
+    pretty_set_x (v, m->x - 1 + v->col_offset);
+    v->want_x = pretty_x (v);
+  }
+}
+
+/* Draws line l on screen line y. */
+void pretty_draw_line (int y, pretty_line *l, int col_offset)
+{
+  char buf[256];
+  long long from, to;
+  int x = l->depth * PRETTY_INDENT - col_offset;
+
+  pretty_text (l, &from, &to);
+  if (x < 0) {
+    from -= x;
+    x = 0;
+  }
+  while (from < to && x < config.terminal_cols) {
+    int n = sizeof (buf);
+    if (n > to - from) n = to - from;
+    if (n > config.terminal_cols - x) n = config.terminal_cols - x;
+    pretty_copy (from, buf, n);
+    x = screen_put (y, x, buf, n, STYLE_NORMAL);
+    from += n;
+  }
+}
+
+void pretty_draw (pretty_state *v)
+{
+  unsigned long long start = now_ns ();
+  append_buffer *ab = &config.out;
+  pretty_line l = v->top;
+  int y, x = pretty_x (v), more = 1;
+
+  if (config.rendering_suspended) {
+    return;
+  }
+  if (x < v->col_offset) v->col_offset = x;
+  if (x >= v->col_offset + config.terminal_cols) {
+    v->col_offset = x - config.terminal_cols + 1;
+  }
+
+  ab->len = 0;
+  for (y = 0; y < config.terminal_rows; y++) {
+    screen_fill (y, 0, config.screen_cols, ' ', STYLE_NORMAL);
+    if (y > 0) more = more && pretty_next (&l);
+    if (more) {
+      pretty_draw_line (y, &l, v->col_offset);
+    } else {
+      screen_put (y, 0, "~", 1, STYLE_NORMAL);
+    }
+  }
+  draw_status_bar ();
+  draw_message_bar ();
+  screen_flush (ab, v->y, x - v->col_offset);
+  trace_span ("render", start);
+}
+
+/* Runs the pretty view until Esc or Alt-P, leaving the cursor on the byte
+ * it was on in the view. */
+void pretty_view ()
+{
+  pretty_state v;
+  int c, times;
+
+  memset (&v, 0, sizeof (v));
+  pretty_show (&v, json_cursor (), 1);
+  set_status_message ("Pretty view -- Esc or Alt-P to go back");
+
+  while (1) {
+    if (v.y >= config.terminal_rows) pretty_show (&v, v.at, 1);
+    json_goto (v.at);
+    pretty_draw (&v);
+
+    switch ((c = read_key ())) {
+      case '\x1b':
+      case CTRL_KEY('q'):
+      case ALT_KEY('p'):
+        set_status_message ("");
+        return;
+      case ARROW_UP:
+      case ARROW_DOWN:
+      case ARROW_LEFT:
+      case ARROW_RIGHT:
+      case HOME_KEY:
+      case END_KEY:
+        pretty_move (&v, c);
+        break;
+      case PAGE_UP:
+      case PAGE_DOWN:
+        for (times = config.terminal_rows; times--; ) {
+          pretty_move (&v, c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+        }
+        break;
+      case MOUSE_EVENT:
+        pretty_mouse (&v);
+        break;
+      case ALT_KEY('u'):
+      case ALT_KEY('n'):
+      case ALT_KEY('b'):
+      case ALT_KEY('k'):
+        json_command (c);
+        pretty_show (&v, json_cursor (), 0);
+        break;
+      case ALT_KEY('f'):
+        set_status_message ("Folds only apply outside the pretty view");
+        break;
+    }
+  }
+}
+
+/*** grep ***/
+
+#define GREP_MAX_THREADS 64
+#define GREP_MAX_LINE 200
+#define GREP_BINARY_PROBE 8192
+
+typedef struct grep_hit {
+  char *path;
+  int line;                     /* zero based line number */
+  char *text;                   /* the matching line, possibly truncated */
+} grep_hit;
+
+typedef struct grep_hits {
+  grep_hit *hits;
+  int count;
+  int cap;
+} grep_hits;
+
+/* State shared by the workers of a project wide search. Directories are
+ * handed out from a stack; the walk is over once the stack is empty and no
+ * worker is still reading a directory that could push more. */
+struct grep_walk {
+  const char *needle;
+  size_t needle_len;
+  char **dirs;                  /* directories waiting to be read */
+  int num_dirs;
+  int cap_dirs;
+  int busy;                     /* workers currently reading a directory */
+  int num_files;                /* files searched */
+  grep_hits result;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+/* Returns the first occurrence of needle in hay, or NULL. Compares the
+ * first and last byte of needle against 16 positions at a time and only
+ * runs memcmp where both agree. */
+const char *find_literal (const char *hay, size_t hay_len, const char *needle,
+    size_t needle_len)
+{
+  size_t i = 0;
+
+  if (needle_len == 0) return hay;
+  if (needle_len > hay_len) return NULL;
+  if (needle_len == 1) return memchr (hay, needle[0], hay_len);
+
+#ifdef __SSE2__
+  __m128i first = _mm_set1_epi8 (needle[0]);
+  __m128i last = _mm_set1_epi8 (needle[needle_len - 1]);
+
+  for (; i + needle_len - 1 + 16 <= hay_len; i += 16) {
+    __m128i a = _mm_loadu_si128 ((const __m128i *) (hay + i));
+    __m128i b = _mm_loadu_si128 ((const __m128i *) (hay + i + needle_len - 1));
+    unsigned mask = _mm_movemask_epi8 (_mm_and_si128 (
+          _mm_cmpeq_epi8 (a, first), _mm_cmpeq_epi8 (b, last)));
+    while (mask) {
+      int bit = __builtin_ctz (mask);
+      if (memcmp (hay + i + bit + 1, needle + 1, needle_len - 2) == 0) {
+        return hay + i + bit;
+      }
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  return memmem (hay + i, hay_len - i, needle, needle_len);
+}
+
+int count_newlines (const char *start, const char *end)
+{
+  int n = 0;
+  while ((start = memchr (start, '\n', end - start)) != NULL) {
+    n++;
+    start++;
+  }
+  return n;
+}
+
+void grep_add_hit (grep_hits *hits, const char *path, int line,
+    const char *text, int len)
+{
+  int i;
+
+  if (hits->count == hits->cap) {
+    hits->cap = hits->cap ? hits->cap * 2 : 64;
+    hits->hits = mem_realloc (ALLOC_SEARCH, hits->hits,
+        sizeof (grep_hit) * hits->cap);
+  }
+  if (len > GREP_MAX_LINE) len = GREP_MAX_LINE;
+
+  grep_hit *hit = &hits->hits[hits->count++];
+  hit->path = mem_strdup (ALLOC_SEARCH, path);
+  hit->line = line;
+  hit->text = mem_alloc (ALLOC_SEARCH, len + 1);
+  for (i = 0; i < len; i++) {
+    hit->text[i] = iscntrl ((unsigned char) text[i]) ? ' ' : text[i];
+  }
+  hit->text[len] = '\0';
+}
+
+void grep_file (struct grep_walk *w, const char *path, grep_hits *hits)
+{
+  struct stat st;
+  int fd = open (path, O_RDONLY);
+
+  if (fd == -1) return;
+  if (fstat (fd, &st) == -1 || st.st_size == 0) {
+    close (fd);
+    return;
+  }
+  char *data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (data == MAP_FAILED) return;
+  madvise (data, st.st_size, MADV_SEQUENTIAL);
+
+  const char *end = data + st.st_size;
+  size_t probe = st.st_size < GREP_BINARY_PROBE ? st.st_size : GREP_BINARY_PROBE;
+  if (memchr (data, '\0', probe) == NULL) {  /* skip binary files */
+    const char *p = data, *counted = data, *m;
+    int line = 0;
+
+    while ((m = find_literal (p, end - p, w->needle, w->needle_len))) {
+      const char *line_start = memrchr (data, '\n', m - data);
+      const char *line_end = memchr (m, '\n', end - m);
+
+      line_start = line_start ? line_start + 1 : data;
+      if (!line_end) line_end = end;
+      line += count_newlines (counted, m);
+      counted = m;
+      grep_add_hit (hits, path, line, line_start, line_end - line_start);
+      if (line_end == end) break;
+      p = line_end + 1;
+    }
+  }
+
+  munmap (data, st.st_size);
+
+  pthread_mutex_lock (&w->lock);
+  w->num_files++;
+  pthread_mutex_unlock (&w->lock);
+}
+
+/* Queues dir to be read by any worker. Takes ownership of dir. */
+void grep_push_dir (struct grep_walk *w, char *dir)
+{
+  pthread_mutex_lock (&w->lock);
+  if (w->num_dirs == w->cap_dirs) {
+    w->cap_dirs = w->cap_dirs ? w->cap_dirs * 2 : 64;
+    w->dirs = mem_realloc (ALLOC_SEARCH, w->dirs,
+        sizeof (char *) * w->cap_dirs);
+  }
+  w->dirs[w->num_dirs++] = dir;
+  pthread_cond_signal (&w->cond);
+  pthread_mutex_unlock (&w->lock);
+}
+
+void grep_dir (struct grep_walk *w, const char *dir, grep_hits *hits)
+{
+  unsigned long long start = now_ns ();
+  DIR *d = opendir (dir);
+  struct dirent *entry;
+
+  if (!d) return;
+  while ((entry = readdir (d)) != NULL) {
+    char *path;
+    int type = entry->d_type;
+
+    /* skips ".", ".." and hidden entries such as .git */
+    if (entry->d_name[0] == '.') continue;
+
+    if (strcmp (dir, ".") == 0) {
+      path = mem_strdup (ALLOC_SEARCH, entry->d_name);
+    } else if (mem_asprintf (ALLOC_SEARCH, &path, "%s/%s", dir,
+          entry->d_name) == -1) {
+      continue;
+    }
+
+    if (type == DT_UNKNOWN) {
+      struct stat st;
+      if (lstat (path, &st) == 0) {
+        type = S_ISDIR (st.st_mode) ? DT_DIR : S_ISREG (st.st_mode) ? DT_REG : 0;
+      }
+    }
+    if (type == DT_DIR) {
+      grep_push_dir (w, path);
+      continue;
+    }
+    if (type == DT_REG) {
+      grep_file (w, path, hits);
+    }
+    mem_free (ALLOC_SEARCH, path);
+  }
+  closedir (d);
+  trace_span ("grep dir", start);
+}
+
+void *grep_worker (void *arg)
+{
+  struct grep_walk *w = arg;
+  grep_hits hits = {NULL, 0, 0};
+
+  trace_thread ("grep");
+  pthread_mutex_lock (&w->lock);
+  while (1) {
+    while (w->num_dirs == 0 && w->busy > 0) {
+      pthread_cond_wait (&w->cond, &w->lock);
+    }
+    if (w->num_dirs == 0) break;
+
+    char *dir = w->dirs[--w->num_dirs];
+    w->busy++;
+    pthread_mutex_unlock (&w->lock);
+
+    grep_dir (w, dir, &hits);
+    mem_free (ALLOC_SEARCH, dir);
+
+    pthread_mutex_lock (&w->lock);
+    w->busy--;
+  }
+  pthread_cond_broadcast (&w->cond);
+
+  /* merge this worker's hits into the shared result */
+  if (hits.count) {
+    grep_hits *r = &w->result;
+    if (r->count + hits.count > r->cap) {
+      r->cap = r->count + hits.count;
+      r->hits = mem_realloc (ALLOC_SEARCH, r->hits, sizeof (grep_hit) * r->cap);
+    }
+    memcpy (&r->hits[r->count], hits.hits, sizeof (grep_hit) * hits.count);
+    r->count += hits.count;
+  }
+  pthread_mutex_unlock (&w->lock);
+
+  mem_free (ALLOC_SEARCH, hits.hits);
+  return NULL;
+}
+
+int grep_hit_cmp (const void *a, const void *b)
+{
+  const grep_hit *x = a, *y = b;
+  int c = strcmp (x->path, y->path);
+  return c ? c : x->line - y->line;
+}
+
+/* Searches every file under the working directory for a literal string and
+ * lets the user pick a match to open. */
+void grep_project ()
+{
+  pthread_t threads[GREP_MAX_THREADS];
+  struct grep_walk w;
+  unsigned long long start;
+  int i, num_threads;
+
+  char *needle = editor_prompt ("Grep: %s (ESC to cancel)");
+  if (!needle) return;
+
+  set_status_message ("Searching for \"%s\"...", needle);
+  refresh_screen ();
+
+  start = now_ns ();
+  memset (&w, 0, sizeof (w));
+  w.needle = needle;
+  w.needle_len = strlen (needle);
+  pthread_mutex_init (&w.lock, NULL);
+  pthread_cond_init (&w.cond, NULL);
+  grep_push_dir (&w, mem_strdup (ALLOC_SEARCH, "."));
+
+  num_threads = sysconf (_SC_NPROCESSORS_ONLN);
+  if (num_threads < 1) num_threads = 1;
+  if (num_threads > GREP_MAX_THREADS) num_threads = GREP_MAX_THREADS;
+  for (i = 0; i < num_threads; i++) {
+    if (pthread_create (&threads[i], NULL, grep_worker, &w) != 0) break;
+  }
+  if (i == 0) grep_worker (&w);
+  num_threads = i;
+  for (i = 0; i < num_threads; i++) {
+    pthread_join (threads[i], NULL);
+  }
+  pthread_mutex_destroy (&w.lock);
+  pthread_cond_destroy (&w.cond);
+  mem_free (ALLOC_SEARCH, w.dirs);
+  trace_span ("search", start);
+
+  grep_hits *r = &w.result;
+  if (r->count == 0) {
+    set_status_message ("No matches for \"%s\" in %d files", needle,
+        w.num_files);
+  } else {
+    char **items = mem_alloc (ALLOC_SEARCH, sizeof (char *) * r->count);
+    char *title;
+    int choice;
+
+    qsort (r->hits, r->count, sizeof (grep_hit), grep_hit_cmp);
+    for (i = 0; i < r->count; i++) {
+      if (mem_asprintf (ALLOC_SEARCH, &items[i], "%s:%d: %s",
+            r->hits[i].path, r->hits[i].line + 1, r->hits[i].text) == -1) {
+        items[i] = mem_strdup (ALLOC_SEARCH, "");
+      }
+    }
+    if (mem_asprintf (ALLOC_SEARCH, &title,
+          "%d matches for \"%s\" in %d files", r->count, needle,
+          w.num_files) == -1) {
+      title = NULL;
+    }
+
+    choice = picker_select (title ? title : "Grep", items, r->count);
+    if (choice >= 0) {
+      grep_hit *hit = &r->hits[choice];
+      if (editor_open (hit->path) == -1) {
+        set_status_message ("Can't open %s: %s", hit->path, strerror (errno));
+      } else {
+        jump_to_line (hit->line);
+        set_status_message ("%s:%d", hit->path, hit->line + 1);
+      }
+    }
+
+    for (i = 0; i < r->count; i++) {
+      mem_free (ALLOC_SEARCH, items[i]);
+    }
+    mem_free (ALLOC_SEARCH, items);
+    mem_free (ALLOC_SEARCH, title);
+  }
+
+  for (i = 0; i < r->count; i++) {
+    mem_free (ALLOC_SEARCH, r->hits[i].path);
+    mem_free (ALLOC_SEARCH, r->hits[i].text);
+  }
+  mem_free (ALLOC_SEARCH, r->hits);
+  mem_free (ALLOC_PROMPT, needle);
+}
+
+/*** group by ***/
+
+/* Counts the values of a field over all rows, like sort | uniq -c. The
+ * field is a regex match (its first group if it has one), the Nth field
+ * split at white space or at a delimiter, or the value of a JSON key.
+ * Threads take GROUP_CHUNK_ROWS rows at a time and count into tables of
+ * their own, which are merged at the end; values point into the rows
+ * rather than being copied. Picking a value lists its lines and marks them
+ * on the scrollbar. */
+
+#define GROUP_CHUNK_ROWS 16384  /* a multiple of 8, for the row bitmap */
+#define GROUP_MAX_THREADS 64
+#define GROUP_MAX_VALUE 200     /* longer values are cut in the table */
+#define GROUP_MAX_LINES 100000  /* lines listed for one value */
+
+enum group_kind {
+  GROUP_REGEX,
+  GROUP_FIELD,
+  GROUP_JSON_KEY
+};
+
+typedef struct group_spec {
+  int kind;
+  const char *pattern;          /* the regex, or the key in quotes */
+  int field;                    /* one based */
+  char delim;                   /* '\0' for runs of white space */
+} group_spec;
+
+typedef struct group_entry {
+  const char *value;            /* inside a row */
+  int len;
+  unsigned int hash;
+  long long count;
+  int first_row;
+} group_entry;
+
+/* Open addressing hash table of values */
+typedef struct group_table {
+  group_entry *slots;
+  int cap;
+  int count;
+} group_table;
+
+typedef struct group_run {
+  group_spec *spec;
+  atomic_int next_chunk;
+  atomic_int next_table;
+  group_table *tables;          /* one per thread */
+  atomic_llong missing;         /* rows without the field */
+  const char *want;             /* when set, only mark rows with this value */
+  int want_len;
+  unsigned char *marked;        /* a bit per row that has it */
+} group_run;
+
+unsigned int group_hash (const char *s, int len)
+{
+  unsigned int h = 2166136261u;
+  int i;
+
+  for (i = 0; i < len; i++) {
+    h = (h ^ (unsigned char) s[i]) * 16777619u;
+  }
+  return h;
+}
+
+/* Adds count rows with value s (first seen at row) to t. */
+void group_add (group_table *t, const char *s, int len, unsigned int hash,
+    long long count, int row)
+{
+  group_entry *e;
+  int i;
+
+  if (t->count * 2 >= t->cap) {
+    group_table bigger;
+
+    bigger.cap = t->cap ? t->cap * 2 : 1024;
+    bigger.count = 0;
+    bigger.slots = mem_calloc (ALLOC_SEARCH, bigger.cap, sizeof (group_entry));
+    for (i = 0; i < t->cap; i++) {
+      e = &t->slots[i];
+      if (e->value) {
+        group_add (&bigger, e->value, e->len, e->hash, e->count,
+            e->first_row);
+      }
+    }
+    mem_free (ALLOC_SEARCH, t->slots);
+    *t = bigger;
+  }
+
+  for (i = hash & (t->cap - 1); ; i = (i + 1) & (t->cap - 1)) {
+    e = &t->slots[i];
+    if (!e->value) break;
+    if (e->hash == hash && e->len == len && memcmp (e->value, s, len) == 0) {
+      e->count += count;
+      if (row < e->first_row) e->first_row = row;
+      return;
+    }
+  }
+  e->value = s;
+  e->len = len;
+  e->hash = hash;
+  e->count = count;
+  e->first_row = row;
+  t->count++;
+}
+
+/* Finds the field of spec in s. Returns 0 if the row doesn't have it. */
+int group_extract (group_spec *spec, regex_t *re, const char *s, int len,
+    const char **value, int *value_len)
+{
+  if (spec->kind == GROUP_REGEX) {
+    regmatch_t m[2];
+
+    if (regexec (re, s, 2, m, 0) != 0) return 0;
+    if (m[1].rm_so < 0) m[1] = m[0];
+    *value = s + m[1].rm_so;
+    *value_len = m[1].rm_eo - m[1].rm_so;
+    return 1;
+  }
+
+  if (spec->kind == GROUP_FIELD) {
+    const char *end = s + len, *p = s, *q;
+    int field = 1;
+
+    while (1) {
+      if (!spec->delim) {
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+      }
+      for (q = p; q < end; q++) {
+        if (spec->delim ? *q == spec->delim : *q == ' ' || *q == '\t') break;
+      }
+      if (field == spec->field) {
+        *value = p;
+        *value_len = q - p;
+        /* between delimiters a field can be empty, not between blanks */
+        return spec->delim || q > p;
+      }
+      if (q == end) return 0;
+      p = q + 1;
+      field++;
+    }
+  }
+
+  /* "key" then a colon, then a string or a scalar */
+  {
+    size_t key_len = strlen (spec->pattern);
+    const char *end = s + len, *p = s, *q;
+
+    while ((p = find_literal (p, end - p, spec->pattern, key_len)) != NULL) {
+      p += key_len;
+      while (p < end && isspace ((unsigned char) *p)) p++;
+      if (p == end || *p != ':') continue;
+      p++;
+      while (p < end && isspace ((unsigned char) *p)) p++;
+      if (p < end && *p == '"') {
+        for (q = ++p; q < end && *q != '"'; q++) {
+          if (*q == '\\' && q + 1 < end) q++;
+        }
+      } else {
+        for (q = p; q < end && !strchr (",}] \t", *q); q++);
+      }
+      *value = p;
+      *value_len = q - p;
+      return 1;
+    }
+    return 0;
+  }
+}
+
+/* Runs fn (arg) on a thread per core, GROUP_MAX_THREADS at most, this one
+ * among them, and waits for all of them. Returns how many ran, which is
+ * fewer when threads can't be started. */
+int run_workers (void *(*fn) (void *), void *arg)
+{
+  pthread_t threads[GROUP_MAX_THREADS];
+  int i, num_threads = sysconf (_SC_NPROCESSORS_ONLN);
+
+  if (num_threads < 1) num_threads = 1;
+  if (num_threads > GROUP_MAX_THREADS) num_threads = GROUP_MAX_THREADS;
+  for (i = 0; i < num_threads - 1; i++) {
+    if (pthread_create (&threads[i], NULL, fn, arg) != 0) break;
+  }
+  num_threads = i + 1;
+  fn (arg);
+  for (i = 0; i < num_threads - 1; i++) {
+    pthread_join (threads[i], NULL);
+  }
+  return num_threads;
+}
+
+/* Takes the next chunk of size items of the total off *next and puts its
+ * bounds in *begin and *end. Returns its number, or -1 when all are
+ * taken. */
+int claim_chunk (atomic_int *next, int size, int total, int *begin, int *end)
+{
+  int chunk = atomic_fetch_add (next, 1);
+
+  if ((long long) chunk * size >= total) return -1;
+  *begin = chunk * size;
+  *end = total - *begin > size ? *begin + size : total;
+  return chunk;
+}
+
+void *group_worker (void *arg)
+{
+  group_run *run = arg;
+  group_spec *spec = run->spec;
+  group_table *t = &run->tables[atomic_fetch_add (&run->next_table, 1)];
+  unsigned long long start = now_ns ();
+  long long missing = 0;
+  regex_t re;
+  int row, end;
+
+  /* regexec serializes threads that share a regex_t */
+  if (spec->kind == GROUP_REGEX &&
+      regcomp (&re, spec->pattern, REG_EXTENDED) != 0) {
+    return NULL;
+  }
+
+  while (claim_chunk (&run->next_chunk, GROUP_CHUNK_ROWS, config.num_rows,
+          &row, &end) != -1) {
+    for (; row < end; row++) {
+      erow *r = &config.row[row];
+      const char *value;
+      int len;
+
+      if (!group_extract (spec, &re, r->chars, r->size, &value, &len)) {
+        missing++;
+      } else if (run->want) {
+        if (len == run->want_len && memcmp (value, run->want, len) == 0) {
+          run->marked[row / 8] |= 1 << (row % 8);
+        }
+      } else {
+        group_add (t, value, len, group_hash (value, len), 1, row);
+      }
+    }
+  }
+
+  if (spec->kind == GROUP_REGEX) regfree (&re);
+  atomic_fetch_add (&run->missing, missing);
+  trace_span ("group", start);
+  return NULL;
+}
+
+/* Runs group_worker over all rows on every core. */
+void group_scan (group_run *run)
+{
+  atomic_store (&run->next_chunk, 0);
+  atomic_store (&run->next_table, 0);
+  atomic_store (&run->missing, 0);
+  run->tables = mem_calloc (ALLOC_SEARCH, GROUP_MAX_THREADS,
+      sizeof (group_table));
+  run_workers (group_worker, run);
+}
+
+int group_entry_cmp (const void *a, const void *b)
+{
+  const group_entry *x = a, *y = b;
+
+  if (x->count != y->count) return x->count < y->count ? 1 : -1;
+  return x->first_row - y->first_row;
+}
+
+/* Reads what to group by: /regex/ (or any regex), N or N followed by a
+ * delimiter for a field, or .key for a JSON key. Returns -1 if it makes no
+ * sense. */
+int group_parse (char *text, group_spec *spec)
+{
+  size_t len = strlen (text);
+  char *end;
+
+  memset (spec, 0, sizeof (*spec));
+  if (text[0] == '.' && text[1]) {
+    spec->kind = GROUP_JSON_KEY;
+    text[0] = '"';
+    text[len] = '"';            /* group_rows made room for it */
+    text[len + 1] = '\0';
+    spec->pattern = text;
+    return 0;
+  }
+  if (isdigit ((unsigned char) text[0])) {
+    spec->kind = GROUP_FIELD;
+    spec->field = strtol (text, &end, 10);
+    if (spec->field < 1 || (end[0] && end[1])) return -1;
+    spec->delim = end[0];
+    return 0;
+  }
+  spec->kind = GROUP_REGEX;
+  if (len > 2 && text[0] == '/' && text[len - 1] == '/') {
+    text[len - 1] = '\0';
+    text++;
+  }
+  spec->pattern = text;
+  return 0;
+}
+
+/* Lists the rows set in the bitmap marked, as lines with what, marks them
+ * on the scrollbar and jumps to the one picked. */
+void show_marked_rows (unsigned char *marked, const char *what)
+{
+  char **items = NULL, *title;
+  int *rows = NULL, count = 0, shown = 0, row, choice;
+  density *d = &config.density[DENSITY_MATCHES];
+
+  density_reset (d);
+  for (row = 0; row < config.num_rows; row++) {
+    if (!(marked[row / 8] & (1 << (row % 8)))) continue;
+    density_add (d, row, 1);
+    if (count++ >= GROUP_MAX_LINES) continue;
+    if (shown % 1024 == 0) {
+      items = mem_realloc (ALLOC_SEARCH, items,
+          sizeof (char *) * (shown + 1024));
+      rows = mem_realloc (ALLOC_SEARCH, rows, sizeof (int) * (shown + 1024));
+    }
+    if (mem_asprintf (ALLOC_SEARCH, &items[shown], "%d: %.*s", row + 1,
+          GROUP_MAX_VALUE, config.row[row].chars) == -1) {
+      items[shown] = mem_strdup (ALLOC_SEARCH, "");
+    }
+    rows[shown++] = row;
+  }
+
+  if (mem_asprintf (ALLOC_SEARCH, &title, "%d lines with %s%s", count, what,
+        count > shown ? ", the first ones shown" : "") == -1) {
+    title = NULL;
+  }
+  choice = picker_select (title ? title : "Lines", items, shown);
+  if (choice >= 0) {
+    jump_to_line (rows[choice]);
+    set_status_message ("%d lines with %s, marked on the scrollbar", count,
+        what);
+  }
+
+  for (row = 0; row < shown; row++) mem_free (ALLOC_SEARCH, items[row]);
+  mem_free (ALLOC_SEARCH, items);
+  mem_free (ALLOC_SEARCH, rows);
+  mem_free (ALLOC_SEARCH, title);
+}
+
+/* Asks for a field with prompt and fills in spec. Returns the text spec
+ * points into, to be freed after, or NULL if there is no valid field. */
+char *group_ask (char *prompt, group_spec *spec)
+{
+  char *text = editor_prompt (prompt), err[128];
+  regex_t re;
+  int ret;
+
+  if (!text) return NULL;
+  text = mem_realloc (ALLOC_PROMPT, text, strlen (text) + 2);
+  if (group_parse (text, spec) == -1) {
+    set_status_message ("Use /regex/, a field number like 3 or 3, or .key");
+    mem_free (ALLOC_PROMPT, text);
+    return NULL;
+  }
+  if (spec->kind == GROUP_REGEX) {
+    if ((ret = regcomp (&re, spec->pattern, REG_EXTENDED)) != 0) {
+      regerror (ret, &re, err, sizeof (err));
+      set_status_message ("Bad regex: %s", err);
+      mem_free (ALLOC_PROMPT, text);
+      return NULL;
+    }
+    regfree (&re);
+  }
+  return text;
+}
+
+void group_rows ()
+{
+  group_table all = {NULL, 0, 0};
+  group_entry *entries;
+  group_spec spec;
+  group_run run;
+  char **items, *title, *text, *what;
+  unsigned long long start;
+  int i, j, choice;
+
+  text = group_ask ("Group by (/regex/, N[delim] or .key): %s", &spec);
+  if (!text) return;
+
+  set_status_message ("Counting...");
+  refresh_screen ();
+  start = now_ns ();
+  memset (&run, 0, sizeof (run));
+  run.spec = &spec;
+  group_scan (&run);
+  for (i = 0; i < atomic_load (&run.next_table); i++) {
+    group_table *t = &run.tables[i];
+    for (j = 0; j < t->cap; j++) {
+      group_entry *e = &t->slots[j];
+      if (e->value) {
+        group_add (&all, e->value, e->len, e->hash, e->count, e->first_row);
+      }
+    }
+    mem_free (ALLOC_SEARCH, t->slots);
+  }
+  mem_free (ALLOC_SEARCH, run.tables);
+
+  /* pack and sort the values */
+  entries = all.slots;
+  for (i = j = 0; i < all.cap; i++) {
+    if (all.slots[i].value) entries[j++] = all.slots[i];
+  }
+  qsort (entries, all.count, sizeof (group_entry), group_entry_cmp);
+  trace_span ("group by", start);
+
+  if (all.count == 0) {
+    set_status_message ("No row has that field");
+    mem_free (ALLOC_SEARCH, entries);
+    mem_free (ALLOC_PROMPT, text);
+    return;
+  }
+
+  items = mem_alloc (ALLOC_SEARCH, sizeof (char *) * all.count);
+  for (i = 0; i < all.count; i++) {
+    group_entry *e = &entries[i];
+    if (mem_asprintf (ALLOC_SEARCH, &items[i], "%10lld  %.*s", e->count,
+          e->len < GROUP_MAX_VALUE ? e->len : GROUP_MAX_VALUE,
+          e->value) == -1) {
+      items[i] = mem_strdup (ALLOC_SEARCH, "");
+    }
+  }
+  if (mem_asprintf (ALLOC_SEARCH, &title,
+        "%d values in %d rows, %lld rows without one", all.count,
+        config.num_rows, (long long) atomic_load (&run.missing)) == -1) {
+    title = NULL;
+  }
+
+  choice = picker_select (title ? title : "Group by", items, all.count);
+  if (choice >= 0) {
+    run.want = entries[choice].value;
+    run.want_len = entries[choice].len;
+    run.marked = mem_calloc (ALLOC_SEARCH, config.num_rows / 8 + 1, 1);
+    group_scan (&run);
+    mem_free (ALLOC_SEARCH, run.tables);
+    if (mem_asprintf (ALLOC_SEARCH, &what, "\"%.*s\"",
+          run.want_len < GROUP_MAX_VALUE ? run.want_len : GROUP_MAX_VALUE,
+          run.want) == -1) {
+      what = NULL;
+    }
+    show_marked_rows (run.marked, what ? what : "the value");
+    mem_free (ALLOC_SEARCH, what);
+    mem_free (ALLOC_SEARCH, run.marked);
+  }
+
+  for (i = 0; i < all.count; i++) mem_free (ALLOC_SEARCH, items[i]);
+  mem_free (ALLOC_SEARCH, items);
+  mem_free (ALLOC_SEARCH, title);
+  mem_free (ALLOC_SEARCH, entries);
+  mem_free (ALLOC_PROMPT, text);
+}
+
+/*** stats ***/
+
+/* Sums up the numbers in a field of the selected rows, or of all rows
+ * without a selection. Threads take row chunks and keep a partial result
+ * each: count, sum, extremes and a sketch for the percentiles, which are
+ * added up at the end. The sketch counts values in log-linear buckets like
+ * the latency histogram, taken straight from the bits of the double: the
+ * exponent and the top STATS_SUB_BITS bits of the mantissa, so a
+ * percentile is off by less than 0.2% of its value. */
+
+#define STATS_SUB_BITS 8
+#define STATS_SUB (1 << STATS_SUB_BITS)
+#define STATS_MIN_EXP -64       /* smaller magnitudes share a bucket */
+#define STATS_MAX_EXP 64        /* and so do larger ones */
+#define STATS_BUCKETS ((STATS_MAX_EXP - STATS_MIN_EXP) * STATS_SUB)
+#define STATS_MAX_DIGITS 19     /* that fit an unsigned long long */
+
+typedef struct stats_part {
+  long long count;
+  long long skipped;            /* rows without a number */
+  double sum, min, max;
+  long long zeros;
+  long long *pos, *neg;         /* sketch buckets by magnitude */
+} stats_part;
+
+typedef struct stats_run {
+  group_spec *spec;
+  int from, to;                 /* rows */
+  atomic_int next_chunk;
+  atomic_int next_part;
+  stats_part *parts;            /* one per thread */
+} stats_run;
+
+#if defined (__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/* Returns whether the 8 bytes of v are all digits. */
+int is_8_digits (unsigned long long v)
+{
+  return ((v & 0xf0f0f0f0f0f0f0f0ULL) |
+      (((v + 0x0606060606060606ULL) & 0xf0f0f0f0f0f0f0f0ULL) >> 4)) ==
+    0x3333333333333333ULL;
+}
+
+/* Returns the value of 8 digits in v, the first one in the lowest byte,
+ * with three multiplications instead of eight. */
+unsigned int parse_8_digits (unsigned long long v)
+{
+  v = ((v & 0x0f0f0f0f0f0f0f0fULL) * 2561) >> 8;
+  v = ((v & 0x00ff00ff00ff00ffULL) * 6553601) >> 16;
+  return (unsigned int) (((v & 0x0000ffff0000ffffULL) * 42949672960001ULL)
+      >> 32);
+}
+#endif
+
+/* Adds the digits at *p to *mant, eight at a time while they last. Digits
+ * past STATS_MAX_DIGITS don't fit and are only counted in *dropped. */
+const char *parse_digits (const char *p, const char *end,
+    unsigned long long *mant, int *kept, int *dropped)
+{
+#if defined (__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (end - p >= 8 && *kept + 8 <= STATS_MAX_DIGITS) {
+    unsigned long long v;
+
+    memcpy (&v, p, 8);
+    if (!is_8_digits (v)) break;
+    *mant = *mant * 100000000 + parse_8_digits (v);
+    *kept += 8;
+    p += 8;
+  }
+#endif
+  for (; p < end && *p >= '0' && *p <= '9'; p++) {
+    if (*kept < STATS_MAX_DIGITS) {
+      *mant = *mant * 10 + (*p - '0');
+      (*kept)++;
+    } else {
+      (*dropped)++;
+    }
+  }
+  return p;
+}
+
+/* Parses the number at the start of [s, end), which may have a unit after
+ * it. Returns 0 if there is none. */
+int parse_number (const char *s, const char *end, double *value)
+{
+  static const double powers[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+  unsigned long long mant = 0;
+  int negative = 0, kept = 0, dropped = 0, exp10, digits;
+  const char *p;
+  double v;
+
+  while (s < end && (*s == ' ' || *s == '\t')) s++;
+  if (s < end && (*s == '-' || *s == '+')) negative = *s++ == '-';
+  p = s;
+  s = parse_digits (s, end, &mant, &kept, &dropped);
+  digits = s - p;
+  exp10 = dropped;
+  if (s < end && *s == '.') {
+    int before = kept, ignored = 0;
+
+    p = s + 1;
+    s = parse_digits (p, end, &mant, &kept, &ignored);
+    digits += s - p;
+    exp10 -= kept - before;
+  }
+  if (digits == 0) return 0;
+
+  if (s < end && (*s == 'e' || *s == 'E')) {
+    int sign = 1, e = 0;
+
+    p = s + 1;
+    if (p < end && (*p == '-' || *p == '+')) sign = *p++ == '-' ? -1 : 1;
+    if (p < end && *p >= '0' && *p <= '9') {
+      for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        if (e < 10000) e = e * 10 + (*p - '0');
+      }
+      exp10 += sign * e;
+    }
+  }
+
+  v = mant;
+  for (; exp10 > 22; exp10 -= 22) v *= 1e22;
+  for (; exp10 < -22; exp10 += 22) v /= 1e22;
+  v = exp10 >= 0 ? v * powers[exp10] : v / powers[-exp10];
+  *value = negative ? -v : v;
+  return 1;
+}
+
+/* Returns the sketch bucket of magnitude a, which isn't zero. */
+int stats_bucket (double a)
+{
+  unsigned long long bits;
+  int e;
+
+  memcpy (&bits, &a, sizeof (bits));
+  e = (int) ((bits >> 52) & 0x7ff) - 1023;
+  if (e < STATS_MIN_EXP) return 0;
+  if (e >= STATS_MAX_EXP) return STATS_BUCKETS - 1;
+  return (e - STATS_MIN_EXP) * STATS_SUB +
+    (int) ((bits >> (52 - STATS_SUB_BITS)) & (STATS_SUB - 1));
+}
+
+/* Returns the middle of the magnitudes in bucket i. */
+double stats_bucket_value (int i)
+{
+  unsigned long long bits = (unsigned long long)
+    (i / STATS_SUB + STATS_MIN_EXP + 1023) << 52;
+  double v;
+
+  bits |= (unsigned long long) (i % STATS_SUB) << (52 - STATS_SUB_BITS);
+  bits |= 1ULL << (52 - STATS_SUB_BITS - 1);
+  memcpy (&v, &bits, sizeof (v));
+  return v;
+}
+
+void stats_part_init (stats_part *p)
+{
+  memset (p, 0, sizeof (*p));
+  p->min = INFINITY;
+  p->max = -INFINITY;
+  p->pos = mem_calloc (ALLOC_SEARCH, STATS_BUCKETS, sizeof (long long));
+  p->neg = mem_calloc (ALLOC_SEARCH, STATS_BUCKETS, sizeof (long long));
+}
+
+void *stats_worker (void *arg)
+{
+  stats_run *run = arg;
+  stats_part *part = &run->parts[atomic_fetch_add (&run->next_part, 1)];
+  unsigned long long start = now_ns ();
+  regex_t re;
+  int row, end;
+
+  stats_part_init (part);
+  if (run->spec->kind == GROUP_REGEX &&
+      regcomp (&re, run->spec->pattern, REG_EXTENDED) != 0) {
+    return NULL;
+  }
+
+  while (claim_chunk (&run->next_chunk, GROUP_CHUNK_ROWS,
+          run->to - run->from, &row, &end) != -1) {
+    for (row += run->from, end += run->from; row < end; row++) {
+      erow *r = &config.row[row];
+      const char *s;
+      double v;
+      int len;
+
+      if (!group_extract (run->spec, &re, r->chars, r->size, &s, &len) ||
+          !parse_number (s, s + len, &v)) {
+        part->skipped++;
+        continue;
+      }
+      part->count++;
+      part->sum += v;
+      if (v < part->min) part->min = v;
+      if (v > part->max) part->max = v;
+      if (v > 0) {
+        part->pos[stats_bucket (v)]++;
+      } else if (v < 0) {
+        part->neg[stats_bucket (-v)]++;
+      } else {
+        part->zeros++;
+      }
+    }
+  }
+
+  if (run->spec->kind == GROUP_REGEX) regfree (&re);
+  trace_span ("stats", start);
+  return NULL;
+}
+
+/* Returns the value below which p percent of the values in s fall. */
+double stats_percentile (stats_part *s, double p)
+{
+  long long rank = (long long) (p / 100.0 * (s->count - 1) + 0.5), seen = 0;
+  double v = s->max;
+  int i;
+
+  for (i = STATS_BUCKETS - 1; i >= 0; i--) {
+    if ((seen += s->neg[i]) > rank) {
+      v = -stats_bucket_value (i);
+      break;
+    }
+  }
+  if (i < 0 && (seen += s->zeros) > rank) {
+    v = 0;
+  } else if (i < 0) {
+    for (i = 0; i < STATS_BUCKETS; i++) {
+      if ((seen += s->pos[i]) > rank) {
+        v = stats_bucket_value (i);
+        break;
+      }
+    }
+  }
+  if (v < s->min) v = s->min;
+  if (v > s->max) v = s->max;
+  return v;
+}
+
+void stats_rows ()
+{
+  static const double percentiles[] = {50, 90, 99, 99.9};
+  group_spec spec;
+  stats_run run;
+  stats_part total;
+  char report[16][64], *items[16], *title, *text;
+  unsigned long long start;
+  int i, j, n = 0, num_threads;
+
+  text = group_ask ("Stats of (/regex/, N[delim] or .key): %s", &spec);
+  if (!text) return;
+
+  memset (&run, 0, sizeof (run));
+  run.spec = &spec;
+  run.from = 0;
+  run.to = config.num_rows;
+  if (config.sel_active) {
+    run.from = config.sel_y < config.cur_y ? config.sel_y : config.cur_y;
+    run.to = (config.sel_y > config.cur_y ? config.sel_y : config.cur_y) + 1;
+  }
+
+  set_status_message ("Adding up...");
+  refresh_screen ();
+  start = now_ns ();
+  run.parts = mem_calloc (ALLOC_SEARCH, GROUP_MAX_THREADS, sizeof (stats_part));
+  num_threads = run_workers (stats_worker, &run);
+
+  stats_part_init (&total);
+  for (i = 0; i < num_threads; i++) {
+    stats_part *p = &run.parts[i];
+
+    total.count += p->count;
+    total.skipped += p->skipped;
+    total.sum += p->sum;
+    total.zeros += p->zeros;
+    if (p->min < total.min) total.min = p->min;
+    if (p->max > total.max) total.max = p->max;
+    for (j = 0; p->pos && j < STATS_BUCKETS; j++) {
+      total.pos[j] += p->pos[j];
+      total.neg[j] += p->neg[j];
+    }
+    mem_free (ALLOC_SEARCH, p->pos);
+    mem_free (ALLOC_SEARCH, p->neg);
+  }
+  mem_free (ALLOC_SEARCH, run.parts);
+  trace_span ("stats total", start);
+
+  if (total.count == 0) {
+    set_status_message ("No numbers in %d rows", run.to - run.from);
+  } else {
+    snprintf (report[n++], 64, "count    %lld", total.count);
+    snprintf (report[n++], 64, "skipped  %lld rows", total.skipped);
+    snprintf (report[n++], 64, "sum      %.10g", total.sum);
+    snprintf (report[n++], 64, "min      %.10g", total.min);
+    snprintf (report[n++], 64, "max      %.10g", total.max);
+    snprintf (report[n++], 64, "mean     %.10g", total.sum / total.count);
+    for (i = 0; i < (int) (sizeof (percentiles) / sizeof (double)); i++) {
+      snprintf (report[n++], 64, "p%-7g ~%.6g", percentiles[i],
+          stats_percentile (&total, percentiles[i]));
+    }
+    for (i = 0; i < n; i++) items[i] = report[i];
+    if (mem_asprintf (ALLOC_SEARCH, &title, "Stats of rows %d-%d in %llu ms",
+          run.from + 1, run.to, (now_ns () - start) / 1000000) == -1) {
+      title = NULL;
+    }
+    set_status_message ("%lld numbers, mean %.6g, p50 ~%.6g, p99 ~%.6g",
+        total.count, total.sum / total.count,
+        stats_percentile (&total, 50), stats_percentile (&total, 99));
+    picker_select (title ? title : "Stats", items, n);
+    mem_free (ALLOC_SEARCH, title);
+  }
+
+  mem_free (ALLOC_SEARCH, total.pos);
+  mem_free (ALLOC_SEARCH, total.neg);
+  mem_free (ALLOC_PROMPT, text);
+}
+
+/*** multi search ***/
+
+/* Finds the rows that have any of a list of terms in a single pass. The
+ * terms make an Aho-Corasick automaton, turned into a DFA so that every
+ * byte costs one table lookup. Bytes that no term uses share one class and
+ * the table has a column per class rather than per byte, which keeps it
+ * small for lists of IDs or addresses. Threads scan row chunks with it and
+ * mark the rows in a bitmap. */
+
+#define AC_MAX_CELLS (64 << 20) /* states times classes */
+
+typedef struct ac_dfa {
+  unsigned char cls[256];       /* class of every byte, 0 if in no term */
+  int classes;
+  int *next;                    /* next state by state and class */
+  unsigned char *accept;        /* a term ends in the state */
+  int states;
+  int cap;
+} ac_dfa;
+
+typedef struct ac_run {
+  ac_dfa *dfa;
+  atomic_int next_chunk;
+  unsigned char *marked;
+} ac_run;
+
+/* Adds a state with every transition going to the start. Returns -1 if
+ * the table would get too big. */
+int ac_new_state (ac_dfa *d)
+{
+  if (d->states == d->cap) {
+    long long cap = d->cap ? d->cap * 2LL : 1024;
+
+    if (cap * d->classes > AC_MAX_CELLS) cap = AC_MAX_CELLS / d->classes;
+    if (cap <= d->states) return -1;
+    d->next = mem_realloc (ALLOC_SEARCH, d->next,
+        sizeof (int) * cap * d->classes);
+    d->accept = mem_realloc (ALLOC_SEARCH, d->accept, cap);
+    d->cap = cap;
+  }
+  memset (&d->next[(size_t) d->states * d->classes], 0,
+      sizeof (int) * d->classes);
+  d->accept[d->states] = 0;
+  return d->states++;
+}
+
+void ac_free (ac_dfa *d)
+{
+  mem_free (ALLOC_SEARCH, d->next);
+  mem_free (ALLOC_SEARCH, d->accept);
+}
+
+/* Builds the automaton for count terms. Returns -1 if it is too big. */
+int ac_build (ac_dfa *d, char **terms, int *lens, int count)
+{
+  int *queue, *fail, head = 0, tail = 0, i, j, c;
+
+  memset (d, 0, sizeof (*d));
+  for (i = 0; i < count; i++) {
+    for (j = 0; j < lens[i]; j++) d->cls[(unsigned char) terms[i][j]] = 1;
+  }
+  d->classes = 1;
+  for (c = 0; c < 256; c++) {
+    if (d->cls[c]) d->cls[c] = d->classes++;
+  }
+
+  /* the trie, with 0 (the start) for no child */
+  ac_new_state (d);
+  for (i = 0; i < count; i++) {
+    int s = 0;
+    for (j = 0; j < lens[i]; j++) {
+      size_t at = (size_t) s * d->classes +
+        d->cls[(unsigned char) terms[i][j]];
+      if (d->next[at] == 0) {
+        int t = ac_new_state (d);
+        if (t == -1) return -1;
+        d->next[at] = t;
+      }
+      s = d->next[at];
+    }
+    d->accept[s] = 1;
+  }
+
+  /* Breadth first, so the failure state of a state (the longest suffix of
+   * its text that is in the trie) is complete before it. A missing
+   * transition is the one of the failure state. Class 0 stays at the
+   * start everywhere. */
+  queue = mem_alloc (ALLOC_SEARCH, sizeof (int) * d->states);
+  fail = mem_alloc (ALLOC_SEARCH, sizeof (int) * d->states);
+  fail[0] = 0;
+  queue[tail++] = 0;
+  while (head < tail) {
+    int s = queue[head++];
+    int *row = &d->next[(size_t) s * d->classes];
+    int *fail_row = &d->next[(size_t) fail[s] * d->classes];
+
+    for (c = 1; c < d->classes; c++) {
+      int t = row[c];
+      if (t) {
+        fail[t] = s == 0 ? 0 : fail_row[c];
+        d->accept[t] |= d->accept[fail[t]];
+        queue[tail++] = t;
+      } else {
+        row[c] = s == 0 ? 0 : fail_row[c];
+      }
+    }
+  }
+  mem_free (ALLOC_SEARCH, queue);
+  mem_free (ALLOC_SEARCH, fail);
+  return 0;
+}
+
+/* Returns whether any term is in the len bytes of s. */
+int ac_match (ac_dfa *d, const char *s, int len)
+{
+  const int *next = d->next;
+  const unsigned char *cls = d->cls;
+  int classes = d->classes, state = 0, i;
+
+  for (i = 0; i < len; i++) {
+    state = next[state * classes + cls[(unsigned char) s[i]]];
+    if (d->accept[state]) return 1;
+  }
+  return 0;
+}
+
+void *ac_worker (void *arg)
+{
+  ac_run *run = arg;
+  unsigned long long start = now_ns ();
+  int row, end;
+
+  while (claim_chunk (&run->next_chunk, GROUP_CHUNK_ROWS, config.num_rows,
+          &row, &end) != -1) {
+    for (; row < end; row++) {
+      if (ac_match (run->dfa, config.row[row].chars, config.row[row].size)) {
+        run->marked[row / 8] |= 1 << (row % 8);
+      }
+    }
+  }
+  trace_span ("multi search", start);
+  return NULL;
+}
+
+/* Adds the len bytes of s as a term, without the blanks around them. */
+void add_term (char ***terms, int **lens, int *count, const char *s,
+    int len)
+{
+  while (len > 0 && isspace ((unsigned char) *s)) {
+    s++;
+    len--;
+  }
+  while (len > 0 && isspace ((unsigned char) s[len - 1])) len--;
+  if (len == 0) return;
+  if (*count % 1024 == 0) {
+    *terms = mem_realloc (ALLOC_SEARCH, *terms,
+        sizeof (char *) * (*count + 1024));
+    *lens = mem_realloc (ALLOC_SEARCH, *lens, sizeof (int) * (*count + 1024));
+  }
+  (*terms)[*count] = mem_alloc (ALLOC_SEARCH, len);
+  memcpy ((*terms)[*count], s, len);
+  (*lens)[*count] = len;
+  (*count)++;
+}
+
+/* Searches for the lines of the selection, or of a file, all at once. */
+void multi_search ()
+{
+  char **terms = NULL, *path = NULL, what[64];
+  int *lens = NULL, count = 0, i, from, to;
+  unsigned long long start;
+  ac_dfa dfa;
+  ac_run run;
+
+  if (config.sel_active) {
+    int last = config.sel_y > config.cur_y ? config.sel_y : config.cur_y;
+    for (i = config.sel_y < config.cur_y ? config.sel_y : config.cur_y;
+        i <= last; i++) {
+      if (selection_in_row (i, &from, &to)) {
+        add_term (&terms, &lens, &count, &config.row[i].chars[from],
+            to - from);
+      }
+    }
+  } else {
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    FILE *fp;
+
+    path = editor_prompt ("Terms from file: %s (or select them first)");
+    if (!path) return;
+    if ((fp = fopen (path, "r")) == NULL) {
+      set_status_message ("Can't read %s: %s", path, strerror (errno));
+      mem_free (ALLOC_PROMPT, path);
+      return;
+    }
+    while ((len = getline (&line, &cap, fp)) != -1) {
+      add_term (&terms, &lens, &count, line, len);
+    }
+    free (line);
+    fclose (fp);
+  }
+
+  if (count == 0) {
+    set_status_message ("No terms to search for");
+  } else if (ac_build (&dfa, terms, lens, count) == -1) {
+    set_status_message ("Too many terms: the automaton would pass %d cells",
+        AC_MAX_CELLS);
+    ac_free (&dfa);
+  } else {
+    set_status_message ("Searching for %d terms...", count);
+    refresh_screen ();
+    start = now_ns ();
+    memset (&run, 0, sizeof (run));
+    run.dfa = &dfa;
+    run.marked = mem_calloc (ALLOC_SEARCH, config.num_rows / 8 + 1, 1);
+    run_workers (ac_worker, &run);
+    trace_span ("multi search total", start);
+
+    snprintf (what, sizeof (what), "any of %d terms", count);
+    show_marked_rows (run.marked, what);
+    mem_free (ALLOC_SEARCH, run.marked);
+    ac_free (&dfa);
+  }
+
+  for (i = 0; i < count; i++) mem_free (ALLOC_SEARCH, terms[i]);
+  mem_free (ALLOC_SEARCH, terms);
+  mem_free (ALLOC_SEARCH, lens);
+  mem_free (ALLOC_PROMPT, path);
+}
+
+/*** approximate search ***/
+
+/* Finds the rows with a match of a pattern within k edits (insertions,
+ * deletions or substitutions) using Myers' bit-parallel algorithm. A
+ * column of the edit distance table is kept as bit vectors of +1/-1
+ * differences, one bit per pattern character, so every byte of text
+ * takes a handful of word operations however long the pattern is, up to
+ * the 64 characters that fit in a word. */
+
+#define APPROX_MAX_PATTERN 64
+#define APPROX_MAX_EDITS 8
+
+typedef struct approx_run {
+  unsigned long long peq[256];  /* bit i set if pattern[i] is the byte */
+  int len;                      /* of the pattern */
+  int edits;                    /* most edits a match can take */
+  atomic_int next_chunk;
+  unsigned char *marked;
+} approx_run;
+
+/* Returns whether the len bytes of s have a match. */
+int approx_match (approx_run *run, const char *s, int len)
+{
+  unsigned long long pv = ~0ULL, mv = 0;
+  unsigned long long high = 1ULL << (run->len - 1);
+  int score = run->len, i;
+
+  /* a row shorter than the pattern by more than k can't match */
+  if (len < run->len - run->edits) return 0;
+  for (i = 0; i < len; i++) {
+    unsigned long long eq = run->peq[(unsigned char) s[i]];
+    unsigned long long xv = eq | mv;
+    unsigned long long xh = (((eq & pv) + pv) ^ pv) | eq;
+    unsigned long long ph = mv | ~(xh | pv);
+    unsigned long long mh = pv & xh;
+
+    if (ph & high) {
+      score++;
+    } else if (mh & high) {
+      score--;
+    }
+    /* a match can start anywhere, so the top row stays 0 and nothing is
+     * shifted in */
+    ph <<= 1;
+    mh <<= 1;
+    pv = mh | ~(xv | ph);
+    mv = ph & xv;
+    if (score <= run->edits) return 1;
+  }
+  return 0;
+}
+
+void *approx_worker (void *arg)
+{
+  approx_run *run = arg;
+  unsigned long long start = now_ns ();
+  int row, end;
+
+  while (claim_chunk (&run->next_chunk, GROUP_CHUNK_ROWS, config.num_rows,
+          &row, &end) != -1) {
+    for (; row < end; row++) {
+      if (approx_match (run, config.row[row].chars, config.row[row].size)) {
+        run->marked[row / 8] |= 1 << (row % 8);
+      }
+    }
+  }
+  trace_span ("approximate search", start);
+  return NULL;
+}
+
+/* Asks for "k pattern", or just a pattern to allow one edit, and lists the
+ * rows with a match. */
+void approx_search ()
+{
+  char *text, *pattern, what[APPROX_MAX_PATTERN + 32];
+  int i;
+  unsigned long long start;
+  approx_run run;
+
+  text = editor_prompt ("Approximate search: %s (edits, then pattern)");
+  if (!text) return;
+
+  memset (&run, 0, sizeof (run));
+  run.edits = 1;
+  pattern = text;
+  if (isdigit ((unsigned char) text[0])) {
+    char *end;
+    long k = strtol (text, &end, 10);
+    if (*end == ' ' && end[1]) {
+      run.edits = k;
+      pattern = end + 1;
+    }
+  }
+  run.len = strlen (pattern);
+
+  if (run.len > APPROX_MAX_PATTERN) {
+    set_status_message ("Patterns are at most %d bytes", APPROX_MAX_PATTERN);
+  } else if (run.edits > APPROX_MAX_EDITS || run.edits >= run.len) {
+    set_status_message ("Too many edits for the pattern");
+  } else {
+    for (i = 0; i < run.len; i++) {
+      run.peq[(unsigned char) pattern[i]] |= 1ULL << i;
+    }
+    set_status_message ("Searching...");
+    refresh_screen ();
+    start = now_ns ();
+    run.marked = mem_calloc (ALLOC_SEARCH, config.num_rows / 8 + 1, 1);
+    run_workers (approx_worker, &run);
+    trace_span ("approximate search total", start);
+
+    snprintf (what, sizeof (what), "\"%s\" within %d edits", pattern,
+        run.edits);
+    show_marked_rows (run.marked, what);
+    mem_free (ALLOC_SEARCH, run.marked);
+  }
+  mem_free (ALLOC_PROMPT, text);
+}
+
+/*** multi-line search ***/
+
+/* Searches for text that spans rows, such as an exception line followed
+ * by its first frame. The rows are streamed through a window with
+ * fill_chunk, the same way they are saved, so no joined copy of the file is
+ * built. The last MULTI_MAX_MATCH bytes of a window are carried over to
+ * the next one, and a match only counts in a window if it starts before
+ * them. A match of up to that length is then always whole in the window it
+ * counts in. */
+
+#define MULTI_CHUNK (1 << 20)
+#define MULTI_MAX_MATCH (64 << 10)
+
+/* Turns the \n escapes of s into line breaks, in place, and \\ into \
+ * unless s is a regex, which reads \\ the same way. Returns the new
+ * length. */
+int unescape_newlines (char *s, int regex)
+{
+  char *out = s, *in = s;
+
+  while (*in) {
+    if (in[0] == '\\' && in[1] == 'n') {
+      *out++ = '\n';
+      in += 2;
+    } else if (in[0] == '\\' && in[1] == '\\') {
+      if (regex) *out++ = *in;
+      *out++ = *in;
+      in += 2;
+    } else {
+      *out++ = *in++;
+    }
+  }
+  *out = '\0';
+  return out - s;
+}
+
+/* Finds the first match in buf from at on. last is set for the window at
+ * the end of the file, and bol when buf starts a line. Returns the match's
+ * start, with its end in *end, or -1. */
+long multi_find (const char *buf, long at, long len, int last, int bol,
+    regex_t *re, const char *needle, int needle_len, long *end)
+{
+  regmatch_t m;
+  const char *p;
+
+  if (!re) {
+    p = find_literal (buf + at, len - at, needle, needle_len);
+    if (!p) return -1;
+    *end = p - buf + needle_len;
+    return p - buf;
+  }
+  m.rm_so = at;
+  m.rm_eo = len;
+  /* the window ends mid line unless it reached the end of the file, and
+   * starts wherever the previous one stopped */
+  if (regexec (re, buf, 1, &m, REG_STARTEND | (last ? 0 : REG_NOTEOL) |
+          (bol ? 0 : REG_NOTBOL))) {
+    return -1;
+  }
+  *end = m.rm_eo;
+  return m.rm_so;
+}
+
+/* Asks for text or /regex/ where \n stands for a line break, and lists the
+ * rows where a match starts. */
+void multiline_search ()
+{
+  char *text, *buf, err[128], what[64];
+  unsigned char *marked;
+  int row = 0, col = 0, last = 0, bol = 1, needle_len, ret;
+  int at_row = 0;               /* row of buf[counted] */
+  long keep = 0, at = 0, counted = 0;
+  unsigned long long start;
+  regex_t re, *rep = NULL;
+
+  text = editor_prompt ("Multi-line search: %s (\\n = line break, /regex/)");
+  if (!text) return;
+  snprintf (what, sizeof (what), "%s", text);
+  needle_len = strlen (text);
+  if (needle_len > 2 && text[0] == '/' && text[needle_len - 1] == '/') {
+    text[needle_len - 1] = '\0';
+    unescape_newlines (text, 1);
+    if ((ret = regcomp (&re, text + 1, REG_EXTENDED | REG_NEWLINE)) != 0) {
+      regerror (ret, &re, err, sizeof (err));
+      set_status_message ("Bad regex: %s", err);
+      mem_free (ALLOC_PROMPT, text);
+      return;
+    }
+    rep = &re;
+  } else if ((needle_len = unescape_newlines (text, 0)) > MULTI_MAX_MATCH) {
+    set_status_message ("Text is at most %d bytes", MULTI_MAX_MATCH);
+    mem_free (ALLOC_PROMPT, text);
+    return;
+  }
+
+  start = now_ns ();
+  buf = mem_alloc (ALLOC_SEARCH, MULTI_CHUNK + MULTI_MAX_MATCH);
+  marked = mem_calloc (ALLOC_SEARCH, config.num_rows / 8 + 1, 1);
+  while (!last) {
+    long len = keep + fill_chunk (buf + keep, MULTI_CHUNK, &row, &col);
+    long limit, found, end;
+
+    last = row >= config.num_rows;
+    limit = last ? len : len - MULTI_MAX_MATCH;
+    while (at < limit &&
+        (found = multi_find (buf, at, len, last, bol, rep, text,
+            needle_len, &end)) != -1 && found < limit) {
+      /* the row of the match, from the newlines since the last one */
+      for (; counted < found; counted++) {
+        if (buf[counted] == '\n') at_row++;
+      }
+      if (at_row < config.num_rows) marked[at_row / 8] |= 1 << (at_row % 8);
+      at = end > found ? end : found + 1;
+    }
+
+    for (; counted < limit; counted++) {
+      if (buf[counted] == '\n') at_row++;
+    }
+    keep = len - limit;
+    /* the next window starts at limit */
+    if (limit > 0) bol = buf[limit - 1] == '\n';
+    memmove (buf, buf + limit, keep);
+    counted = 0;
+    at = at > limit ? at - limit : 0;
+  }
+  trace_span ("multi-line search", start);
+
+  if (rep) regfree (rep);
+  show_marked_rows (marked, what);
+  mem_free (ALLOC_SEARCH, buf);
+  mem_free (ALLOC_SEARCH, marked);
+  mem_free (ALLOC_PROMPT, text);
+}
+
+/*** line finder ***/
+
+/* Ctrl-P lists the lines that have the query as a subsequence, best first,
+ * and narrows the list as the query is typed; quick open does the same
+ * over file paths. Every item is scored by worker threads, which each
+ * keep their best FINDER_TOP items in a heap; the heaps are merged once
+ * the scan is done. Items matching a query are kept for every query
+ * length, and a longer query only looks at the items that matched its
+ * prefix, so each key typed scans fewer items than the one before. */
+
+#define FINDER_TOP 1000         /* best items listed */
+#define FINDER_CHUNK 16384      /* candidates a worker takes at a time */
+#define FINDER_MAX_QUERY 64
+#define FINDER_NO_MATCH INT_MIN
+
+typedef struct finder_hit {
+  int score;
+  int item;
+} finder_hit;
+
+/* Returns the text of item i and its length in *len */
+typedef const char *(*finder_text) (int i, int *len);
+
+/* A min heap of the best hits seen, the worst of them on top */
+typedef struct finder_heap {
+  finder_hit hits[FINDER_TOP];
+  int count;
+} finder_heap;
+
+typedef struct finder_run {
+  finder_text text;
+  int total;                    /* items */
+  const char *query;
+  int query_len;
+  int fold;                     /* the query is lower case: ignore case */
+  const int *in;                /* items to look at, or NULL for all */
+  int num_in;
+  int *out;                     /* matching items, at the start of chunks */
+  int *chunk_out;               /* matches in every chunk */
+  atomic_int next_chunk;
+  atomic_int next_heap;
+  finder_heap heaps[GROUP_MAX_THREADS];
+} finder_run;
+
+int finder_worse (finder_hit a, finder_hit b)
+{
+  return a.score < b.score || (a.score == b.score && a.item > b.item);
+}
+
+void finder_push (finder_heap *h, int score, int item)
+{
+  finder_hit hit = {score, item};
+  int i, child;
+
+  if (h->count < FINDER_TOP) {
+    /* sift up */
+    for (i = h->count++; i > 0 && finder_worse (hit, h->hits[(i - 1) / 2]);
+        i = (i - 1) / 2) {
+      h->hits[i] = h->hits[(i - 1) / 2];
+    }
+    h->hits[i] = hit;
+    return;
+  }
+  if (!finder_worse (h->hits[0], hit)) return;
+
+  /* replace the worst and sift down */
+  for (i = 0; (child = 2 * i + 1) < h->count; i = child) {
+    if (child + 1 < h->count &&
+        finder_worse (h->hits[child + 1], h->hits[child])) {
+      child++;
+    }
+    if (!finder_worse (h->hits[child], hit)) break;
+    h->hits[i] = h->hits[child];
+  }
+  h->hits[i] = hit;
+}
+
+int finder_hit_cmp (const void *a, const void *b)
+{
+  const finder_hit *x = a, *y = b;
+  return finder_worse (*x, *y) ? 1 : finder_worse (*y, *x) ? -1 : 0;
+}
+
+int finder_eq (char c, char q, int fold)
+{
+  return (fold ? tolower ((unsigned char) c) : c) == q;
+}
+
+/* Returns the first c in the len bytes of s, or NULL. memchr does the
+ * scanning, once per case when folding. */
+const char *finder_find (const char *s, int len, char c, int fold)
+{
+  const char *lower, *upper;
+
+  if (!fold || !isalpha ((unsigned char) c)) return memchr (s, c, len);
+  lower = memchr (s, c, len);
+  upper = memchr (s, toupper ((unsigned char) c), lower ? lower - s : len);
+  return upper ? upper : lower;
+}
+
+/* Scores the len bytes of s against the query, or returns FINDER_NO_MATCH.
+ * The match taken is the shortest one ending where the first one does;
+ * its characters score more when they follow each other or start a word,
+ * and every character skipped in between costs a little. */
+int finder_score (finder_run *run, const char *s, int len)
+{
+  const char *q = run->query, *p;
+  int qlen = run->query_len, fold = run->fold;
+  int i, j, end, score = 0, streak = 0;
+
+  for (i = 0, j = 0; j < qlen; j++, i++) {
+    if ((p = finder_find (s + i, len - i, q[j], fold)) == NULL) {
+      return FINDER_NO_MATCH;
+    }
+    i = p - s;
+  }
+  end = i;
+
+  for (i = end - 1, j = qlen - 1; j >= 0; i--) {
+    if (finder_eq (s[i], q[j], fold)) j--;
+  }
+
+  for (i++, j = 0; j < qlen; i++) {
+    if (finder_eq (s[i], q[j], fold)) {
+      score += 16 + (streak ? 8 : 0);
+      if (i == 0 || !isalnum ((unsigned char) s[i - 1])) score += 8;
+      streak = 1;
+      j++;
+    } else {
+      score--;
+      streak = 0;
+    }
+  }
+  return score;
+}
+
+void *finder_worker (void *arg)
+{
+  finder_run *run = arg;
+  finder_heap *heap = &run->heaps[atomic_fetch_add (&run->next_heap, 1)];
+  int total = run->in ? run->num_in : run->total;
+  int chunk, i, end;
+
+  while ((chunk = claim_chunk (&run->next_chunk, FINDER_CHUNK, total, &i,
+              &end)) != -1) {
+    int *out = &run->out[i], n = 0;
+
+    for (; i < end; i++) {
+      int item = run->in ? run->in[i] : i, len, score;
+      const char *s = run->text (item, &len);
+
+      score = finder_score (run, s, len);
+      if (score == FINDER_NO_MATCH) continue;
+      out[n++] = item;
+      finder_push (heap, score, item);
+    }
+    run->chunk_out[chunk] = n;
+  }
+  return NULL;
+}
+
+/* Scores the items in run->in against the query. Returns the items that
+ * match, their count in *num_out, and the best of them in top. */
+int *finder_scan (finder_run *run, finder_hit *top, int *num_top,
+    int *num_out)
+{
+  int total = run->in ? run->num_in : run->total;
+  int chunks = (total + FINDER_CHUNK - 1) / FINDER_CHUNK;
+  int num_threads = 1, i, n = 0;
+  unsigned long long start = now_ns ();
+
+  run->out = mem_alloc (ALLOC_SEARCH, sizeof (int) * (total + 1));
+  run->chunk_out = mem_alloc (ALLOC_SEARCH, sizeof (int) * (chunks + 1));
+  atomic_store (&run->next_chunk, 0);
+  atomic_store (&run->next_heap, 0);
+  for (i = 0; i < GROUP_MAX_THREADS; i++) run->heaps[i].count = 0;
+
+  /* threads only pay off past a chunk */
+  if (chunks > 1) {
+    num_threads = run_workers (finder_worker, run);
+  } else {
+    finder_worker (run);
+  }
+
+  for (i = 0; i < chunks; i++) {
+    memmove (&run->out[n], &run->out[i * FINDER_CHUNK],
+        sizeof (int) * run->chunk_out[i]);
+    n += run->chunk_out[i];
+  }
+  mem_free (ALLOC_SEARCH, run->chunk_out);
+  *num_out = n;
+
+  *num_top = 0;
+  for (i = 0; i < num_threads; i++) {
+    finder_heap *h = &run->heaps[i];
+    memcpy (&top[*num_top], h->hits, sizeof (finder_hit) * h->count);
+    *num_top += h->count;
+  }
+  qsort (top, *num_top, sizeof (finder_hit), finder_hit_cmp);
+  if (*num_top > FINDER_TOP) *num_top = FINDER_TOP;
+  trace_span ("finder", start);
+  return run->out;
+}
+
+void finder_draw (finder_run *run, const char *title, finder_hit *top,
+    int num_top, int matches, int selected, int offset, int numbered)
+{
+  append_buffer *ab = &config.out;
+  char buf[48];
+  int y, len, x;
+
+  if (config.rendering_suspended) return;
+
+  screen_fill (0, 0, config.screen_cols, ' ', STYLE_REVERSE);
+  x = screen_put (0, 0, title, strlen (title), STYLE_REVERSE);
+  x = screen_put (0, x, run->query, run->query_len, STYLE_REVERSE);
+  len = snprintf (buf, sizeof (buf), "%d/%d", matches, run->total);
+  if (x + len < config.terminal_cols) {
+    screen_put (0, config.terminal_cols - len, buf, len, STYLE_REVERSE);
+  }
+
+  for (y = 0; y < config.terminal_rows; y++) {
+    int i = offset + y;
+    int style = i == selected ? STYLE_REVERSE : STYLE_NORMAL;
+
+    screen_fill (y + 1, 0, config.screen_cols, ' ', style);
+    if (i < num_top) {
+      const char *s = run->text (top[i].item, &len);
+      int at = 0;
+
+      if (numbered) {
+        at = snprintf (buf, sizeof (buf), "%d: ", top[i].item + 1);
+        at = screen_put (y + 1, 0, buf, at, style);
+      }
+      screen_put (y + 1, at, s, len, style);
+    }
+  }
+
+  y = config.terminal_rows + 1;
+  screen_fill (y, 0, config.screen_cols, ' ', STYLE_NORMAL);
+  screen_put (y, 0, "Enter = open | Esc = cancel", 27, STYLE_NORMAL);
+
+  ab->len = 0;
+  screen_flush (ab, 0, x < config.terminal_cols ? x : config.terminal_cols - 1);
+}
+
+/* Lists the total items given by text that match a query typed on the
+ * fly, numbered if asked to. Returns the item picked, or -1 if the finder
+ * was cancelled. */
+int finder_select (const char *title, int total, finder_text text,
+    int numbered)
+{
+  int *levels[FINDER_MAX_QUERY + 1] = {NULL};     /* items matching a prefix */
+  int level_len[FINDER_MAX_QUERY + 1] = {0};
+  char have[FINDER_MAX_QUERY + 1] = {1};          /* levels computed */
+  char query[FINDER_MAX_QUERY + 1] = "";
+  int len = 0, scanned = -1, selected = 0, offset = 0, num_top = 0, i, c;
+  int accept = 0, picked = -1;
+  int height = config.terminal_rows, matches = total;
+  finder_run *run = mem_calloc (ALLOC_SEARCH, 1, sizeof (finder_run));
+  finder_hit *top = mem_alloc (ALLOC_SEARCH,
+      sizeof (finder_hit) * FINDER_TOP * GROUP_MAX_THREADS);
+
+  run->text = text;
+  run->total = total;
+  run->query = query;
+
+  while (1) {
+    if (scanned != len) {
+      run->query_len = len;
+      if (len == 0) {
+        /* everything matches the empty query, in order */
+        for (num_top = 0; num_top < FINDER_TOP && num_top < total; num_top++) {
+          top[num_top].score = 0;
+          top[num_top].item = num_top;
+        }
+        matches = total;
+      } else {
+        /* start from the items of the longest prefix done */
+        int k = len;
+        int *items;
+
+        while (!have[k]) k--;
+        run->fold = 1;
+        for (i = 0; i < len; i++) {
+          if (isupper ((unsigned char) query[i])) run->fold = 0;
+        }
+        run->in = levels[k];
+        run->num_in = level_len[k];
+        items = finder_scan (run, top, &num_top, &matches);
+        mem_free (ALLOC_SEARCH, levels[len]);
+        levels[len] = items;
+        level_len[len] = matches;
+        have[len] = 1;
+      }
+      scanned = len;
+      selected = 0;
+      offset = 0;
+    }
+    if (accept) {
+      if (num_top > 0) picked = top[selected].item;
+      break;
+    }
+
+    if (selected < offset) offset = selected;
+    if (selected >= offset + height) offset = selected - height + 1;
+    finder_draw (run, title, top, num_top, matches, selected, offset,
+        numbered);
+
+    /* take in everything typed before scanning again */
+    do {
+      c = read_key ();
+      if (c == '\r' || c == '\x1b' || c == CTRL_KEY('q')) break;
+      if (c == DEL_KEY || c == CTRL_KEY('h') || c == 127) {
+        if (len > 0) {
+          query[--len] = '\0';
+          for (i = len + 1; i <= FINDER_MAX_QUERY && have[i]; i++) {
+            mem_free (ALLOC_SEARCH, levels[i]);
+            levels[i] = NULL;
+            have[i] = 0;
+          }
+        }
+      } else if (c == ARROW_UP) {
+        if (selected > 0) selected--;
+      } else if (c == ARROW_DOWN) {
+        if (selected < num_top - 1) selected++;
+      } else if (c == PAGE_UP) {
+        selected = selected > height ? selected - height : 0;
+      } else if (c == PAGE_DOWN) {
+        selected += height;
+        if (selected > num_top - 1) selected = num_top ? num_top - 1 : 0;
+      } else if (c < 128 && !iscntrl (c) && len < FINDER_MAX_QUERY) {
+        query[len++] = c;
+        query[len] = '\0';
+      }
+    } while (input_pending ());
+
+    /* Enter picks from the list for the query as typed */
+    if (c == '\r') accept = 1;
+    if (c == '\x1b' || c == CTRL_KEY('q')) break;
+  }
+
+  for (i = 1; i <= FINDER_MAX_QUERY; i++) mem_free (ALLOC_SEARCH, levels[i]);
+  mem_free (ALLOC_SEARCH, top);
+  mem_free (ALLOC_SEARCH, run);
+  return picked;
+}
+
+const char *finder_row_text (int i, int *len)
+{
+  *len = config.row[i].size;
+  return config.row[i].chars;
+}
+
+/* Lets the user pick a line by fuzzy matching and jumps to it. */
+void line_finder ()
+{
+  int row = finder_select ("Lines: ", config.num_rows, finder_row_text, 1);
+  if (row >= 0) jump_to_line (row);
+}
+
+/*** quick open ***/
+
+/* Ctrl-O fuzzy matches the paths of the files under the working directory
+ * with the finder. The index behind it is kept per directory, along with
+ * the directory's mtime, and saved in the cache directory whenever it
+ * changes. Refreshing it walks the tree with a pool of workers the way
+ * grep does, but only reads the directories that changed: inotify tells
+ * which those are while the editor runs, and a directory with no watch
+ * yet (as after loading the cache) keeps its entries if its mtime is
+ * still the one they were read at. Only the first run in a tree reads
+ * every directory. */
+
+#define FILES_MAX_THREADS 64
+#define FILES_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+    IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+#define FILES_CACHE_MAGIC "pico-files 1"
+
+typedef struct files_dir {
+  char *path;                   /* relative to the working directory */
+  long long mtime;              /* ns, as of reading the directory */
+  char **files;                 /* names, sorted */
+  int num_files;
+  char **subdirs;               /* names */
+  int num_subdirs;
+  int wd;                       /* inotify watch, or -1 */
+  int stale;                    /* changed since it was read */
+  int taken;                    /* names moved to a newer index */
+} files_dir;
+
+typedef struct file_index {
+  files_dir *dirs;              /* sorted by path */
+  int num_dirs;
+  char **paths;                 /* every file, directory by directory */
+  int *path_lens;
+  int num_paths;
+  int *by_wd;                   /* dir of every watch, or -1 */
+  int num_wd;
+  int inotify_fd;               /* or -1 */
+  int overflow;                 /* events were lost */
+} file_index;
+
+/* State shared by the workers of a refresh, handed out like grep_walk */
+typedef struct files_walk {
+  file_index *old;              /* the index being refreshed, or NULL */
+  char **queue;                 /* directories waiting to be visited */
+  int num_queue;
+  int cap_queue;
+  int busy;                     /* workers visiting a directory */
+  files_dir *dirs;              /* visited */
+  int num_dirs;
+  int cap_dirs;
+  int num_read;                 /* directories read from disk */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} files_walk;
+
+int files_dir_cmp (const void *a, const void *b)
+{
+  return strcmp (((const files_dir *) a)->path, ((const files_dir *) b)->path);
+}
+
+int files_name_cmp (const void *a, const void *b)
+{
+  return strcmp (*(char * const *) a, *(char * const *) b);
+}
+
+files_dir *files_find (file_index *ix, const char *path)
+{
+  files_dir key;
+
+  if (!ix) return NULL;
+  key.path = (char *) path;
+  return bsearch (&key, ix->dirs, ix->num_dirs, sizeof (files_dir),
+      files_dir_cmp);
+}
+
+/* Returns dir/name, or just name at the top. */
+char *files_join (const char *dir, const char *name)
+{
+  char *path;
+
+  if (strcmp (dir, ".") == 0) return mem_strdup (ALLOC_SEARCH, name);
+  if (mem_asprintf (ALLOC_SEARCH, &path, "%s/%s", dir, name) == -1) {
+    return NULL;
+  }
+  return path;
+}
+
+void files_add_name (char ***names, int *count, const char *name)
+{
+  if (*count % 64 == 0) {
+    *names = mem_realloc (ALLOC_SEARCH, *names,
+        sizeof (char *) * (*count + 64));
+  }
+  (*names)[(*count)++] = mem_strdup (ALLOC_SEARCH, name);
+}
+
+void files_free_names (char **names, int count)
+{
+  int i;
+
+  for (i = 0; i < count; i++) mem_free (ALLOC_SEARCH, names[i]);
+  mem_free (ALLOC_SEARCH, names);
+}
+
+/* Reads the files and subdirectories of directory d->path into d. Hidden
+ * entries are skipped, as grep does. */
+void files_read (files_dir *d)
+{
+  DIR *dir = opendir (d->path);
+  struct dirent *entry;
+
+  if (!dir) return;
+  while ((entry = readdir (dir)) != NULL) {
+    int type = entry->d_type;
+
+    /* a name with a line break can't be cached */
+    if (entry->d_name[0] == '.' || strchr (entry->d_name, '\n')) continue;
+    if (type == DT_UNKNOWN) {
+      char *path = files_join (d->path, entry->d_name);
+      struct stat st;
+
+      if (path && lstat (path, &st) == 0) {
+        type = S_ISDIR (st.st_mode) ? DT_DIR :
+          S_ISREG (st.st_mode) ? DT_REG : 0;
+      }
+      mem_free (ALLOC_SEARCH, path);
+    }
+    if (type == DT_DIR) {
+      files_add_name (&d->subdirs, &d->num_subdirs, entry->d_name);
+    } else if (type == DT_REG) {
+      files_add_name (&d->files, &d->num_files, entry->d_name);
+    }
+  }
+  closedir (dir);
+  if (d->num_files) {
+    qsort (d->files, d->num_files, sizeof (char *), files_name_cmp);
+  }
+}
+
+/* Queues directory path to be visited. Takes ownership of path. */
+void files_push (files_walk *w, char *path)
+{
+  if (!path) return;
+  pthread_mutex_lock (&w->lock);
+  if (w->num_queue == w->cap_queue) {
+    w->cap_queue = w->cap_queue ? w->cap_queue * 2 : 64;
+    w->queue = mem_realloc (ALLOC_SEARCH, w->queue,
+        sizeof (char *) * w->cap_queue);
+  }
+  w->queue[w->num_queue++] = path;
+  pthread_cond_signal (&w->cond);
+  pthread_mutex_unlock (&w->lock);
+}
+
+/* Finds the entries of directory path, from the old index if they are
+ * still good and from the disk if not, and queues its subdirectories. */
+void files_visit (files_walk *w, char *path)
+{
+  files_dir *old = files_find (w->old, path), d;
+  struct stat st;
+  int i;
+
+  memset (&d, 0, sizeof (d));
+  d.wd = -1;
+  if (old && old->wd != -1 && !old->stale && !w->old->overflow) {
+    /* watched, and no event came in for it */
+    d = *old;
+    old->taken = 1;
+  } else if (stat (path, &st) == -1 || !S_ISDIR (st.st_mode)) {
+    mem_free (ALLOC_SEARCH, path);
+    return;
+  } else {
+    long long mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+
+    if (old && !old->stale && old->mtime == mtime) {
+      d = *old;
+      old->taken = 1;
+    } else {
+      if (old) d.wd = old->wd;
+      d.path = path;
+      files_read (&d);
+      /* a change in the same clock tick as the read wouldn't move the
+       * mtime, so a directory that changed just now is read again next
+       * time */
+      d.mtime = time (NULL) - st.st_mtim.tv_sec < 2 ? 0 : mtime;
+      pthread_mutex_lock (&w->lock);
+      w->num_read++;
+      pthread_mutex_unlock (&w->lock);
+    }
+  }
+  d.path = path;
+  d.stale = 0;
+  d.taken = 0;
+
+  for (i = 0; i < d.num_subdirs; i++) {
+    files_push (w, files_join (path, d.subdirs[i]));
+  }
+
+  pthread_mutex_lock (&w->lock);
+  if (w->num_dirs == w->cap_dirs) {
+    w->cap_dirs = w->cap_dirs ? w->cap_dirs * 2 : 256;
+    w->dirs = mem_realloc (ALLOC_SEARCH, w->dirs,
+        sizeof (files_dir) * w->cap_dirs);
+  }
+  w->dirs[w->num_dirs++] = d;
+  pthread_mutex_unlock (&w->lock);
+}
+
+void *files_worker (void *arg)
+{
+  files_walk *w = arg;
+
+  trace_thread ("files");
+  pthread_mutex_lock (&w->lock);
+  while (1) {
+    while (w->num_queue == 0 && w->busy > 0) {
+      pthread_cond_wait (&w->cond, &w->lock);
+    }
+    if (w->num_queue == 0) break;
+
+    char *path = w->queue[--w->num_queue];
+    w->busy++;
+    pthread_mutex_unlock (&w->lock);
+
+    files_visit (w, path);
+
+    pthread_mutex_lock (&w->lock);
+    w->busy--;
+  }
+  pthread_cond_broadcast (&w->cond);
+  pthread_mutex_unlock (&w->lock);
+  return NULL;
+}
+
+void files_free (file_index *ix)
+{
+  int i;
+
+  if (!ix) return;
+  for (i = 0; i < ix->num_dirs; i++) {
+    files_dir *d = &ix->dirs[i];
+    mem_free (ALLOC_SEARCH, d->path);
+    if (!d->taken) {
+      files_free_names (d->files, d->num_files);
+      files_free_names (d->subdirs, d->num_subdirs);
+    }
+  }
+  mem_free (ALLOC_SEARCH, ix->dirs);
+  files_free_names (ix->paths, ix->num_paths);
+  mem_free (ALLOC_SEARCH, ix->path_lens);
+  mem_free (ALLOC_SEARCH, ix->by_wd);
+  mem_free (ALLOC_SEARCH, ix);
+}
+
+/* Watches the directories that aren't yet, and lists every file. */
+void files_finish (file_index *ix)
+{
+  int i, j, n = 0;
+
+  for (i = 0; i < ix->num_dirs; i++) {
+    files_dir *d = &ix->dirs[i];
+
+    /* a watch that fails (too many of them) leaves the directory to its
+     * mtime */
+    if (d->wd == -1 && ix->inotify_fd != -1) {
+      d->wd = inotify_add_watch (ix->inotify_fd, d->path, FILES_EVENTS);
+    }
+    if (d->wd >= ix->num_wd) ix->num_wd = d->wd + 1;
+    n += d->num_files;
+  }
+  ix->by_wd = mem_alloc (ALLOC_SEARCH, sizeof (int) * (ix->num_wd + 1));
+  for (i = 0; i < ix->num_wd; i++) ix->by_wd[i] = -1;
+
+  ix->paths = mem_alloc (ALLOC_SEARCH, sizeof (char *) * (n + 1));
+  ix->path_lens = mem_alloc (ALLOC_SEARCH, sizeof (int) * (n + 1));
+  ix->num_paths = 0;
+  for (i = 0; i < ix->num_dirs; i++) {
+    files_dir *d = &ix->dirs[i];
+
+    if (d->wd != -1) ix->by_wd[d->wd] = i;
+    for (j = 0; j < d->num_files; j++) {
+      char *path = files_join (d->path, d->files[j]);
+      if (!path) continue;
+      ix->paths[ix->num_paths] = path;
+      ix->path_lens[ix->num_paths++] = strlen (path);
+    }
+  }
+}
+
+void files_save (file_index *ix)
+{
+  char path[PATH_MAX + 64], tmp[PATH_MAX + 72], cwd[PATH_MAX];
+  FILE *fp;
+  int i, j;
+
+  if (!getcwd (cwd, sizeof (cwd)) ||
+      cache_path (path, sizeof (path), "files-", cwd) == -1) {
+    return;
+  }
+  make_parent_dirs (path);
+  snprintf (tmp, sizeof (tmp), "%s.%d", path, (int) getpid ());
+  if ((fp = fopen (tmp, "w")) == NULL) return;
+
+  fprintf (fp, "%s\n", FILES_CACHE_MAGIC);
+  for (i = 0; i < ix->num_dirs; i++) {
+    files_dir *d = &ix->dirs[i];
+
+    fprintf (fp, "D %lld %s\n", d->mtime, d->path);
+    for (j = 0; j < d->num_files; j++) fprintf (fp, "F %s\n", d->files[j]);
+    for (j = 0; j < d->num_subdirs; j++) {
+      fprintf (fp, "S %s\n", d->subdirs[j]);
+    }
+  }
+  /* replaced in one go, so a reader never sees half of it */
+  if (fclose (fp) != 0 || rename (tmp, path) == -1) unlink (tmp);
+}
+
+/* Returns the index cached for the working directory, without watches, or
+ * NULL. */
+file_index *files_load ()
+{
+  char path[PATH_MAX + 64], cwd[PATH_MAX], *line = NULL;
+  file_index *ix;
+  files_dir *d = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  int cap_dirs = 0;
+  FILE *fp;
+
+  if (!getcwd (cwd, sizeof (cwd)) ||
+      cache_path (path, sizeof (path), "files-", cwd) == -1 ||
+      (fp = fopen (path, "r")) == NULL) {
+    return NULL;
+  }
+  if ((len = getline (&line, &cap, fp)) == -1 ||
+      strncmp (line, FILES_CACHE_MAGIC "\n", len) != 0) {
+    free (line);
+    fclose (fp);
+    return NULL;
+  }
+
+  ix = mem_calloc (ALLOC_SEARCH, 1, sizeof (file_index));
+  while ((len = getline (&line, &cap, fp)) > 2) {
+    line[len - 1] = '\0';
+    if (line[0] == 'D') {
+      long long mtime;
+      int at;
+
+      if (sscanf (line, "D %lld %n", &mtime, &at) != 1) break;
+      if (ix->num_dirs == cap_dirs) {
+        cap_dirs = cap_dirs ? cap_dirs * 2 : 256;
+        ix->dirs = mem_realloc (ALLOC_SEARCH, ix->dirs,
+            sizeof (files_dir) * cap_dirs);
+      }
+      d = &ix->dirs[ix->num_dirs++];
+      memset (d, 0, sizeof (*d));
+      d->path = mem_strdup (ALLOC_SEARCH, line + at);
+      d->mtime = mtime;
+      d->wd = -1;
+    } else if (d && line[0] == 'F') {
+      files_add_name (&d->files, &d->num_files, line + 2);
+    } else if (d && line[0] == 'S') {
+      files_add_name (&d->subdirs, &d->num_subdirs, line + 2);
+    }
+  }
+  free (line);
+  fclose (fp);
+  ix->inotify_fd = -1;
+  return ix;
+}
+
+/* Marks the directories inotify reported changes in as stale. Returns
+ * whether the index needs a refresh. */
+int files_events (file_index *ix)
+{
+  char buf[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+  ssize_t n;
+  int i, stale = 0;
+
+  while (ix->inotify_fd != -1 &&
+      (n = read (ix->inotify_fd, buf, sizeof (buf))) > 0) {
+    struct inotify_event *ev;
+    char *p;
+
+    for (p = buf; p < buf + n; p += sizeof (*ev) + ev->len) {
+      ev = (struct inotify_event *) p;
+
+      if (ev->mask & IN_Q_OVERFLOW) {
+        ix->overflow = 1;
+      } else if (ev->wd >= 0 && ev->wd < ix->num_wd &&
+          ix->by_wd[ev->wd] != -1) {
+        files_dir *d = &ix->dirs[ix->by_wd[ev->wd]];
+        d->stale = 1;
+        /* a moved directory keeps its watch, which then follows it rather
+         * than the path */
+        if (ev->mask & IN_MOVE_SELF) inotify_rm_watch (ix->inotify_fd, ev->wd);
+        if (ev->mask & (IN_IGNORED | IN_MOVE_SELF)) {
+          /* the watch is gone with the directory */
+          ix->by_wd[ev->wd] = -1;
+          d->wd = -1;
+        }
+      }
+    }
+  }
+
+  for (i = 0; i < ix->num_dirs && !stale; i++) {
+    stale = ix->dirs[i].stale || ix->dirs[i].wd == -1;
+  }
+  return stale || ix->overflow;
+}
+
+/* Brings config.files up to date with the directory tree. */
+void files_refresh ()
+{
+  pthread_t threads[FILES_MAX_THREADS];
+  file_index *old = config.files, *ix;
+  unsigned long long start = now_ns ();
+  files_walk w;
+  int i, num_threads;
+
+  memset (&w, 0, sizeof (w));
+  w.old = old;
+  pthread_mutex_init (&w.lock, NULL);
+  pthread_cond_init (&w.cond, NULL);
+  files_push (&w, mem_strdup (ALLOC_SEARCH, "."));
+
+  num_threads = sysconf (_SC_NPROCESSORS_ONLN);
+  if (num_threads < 1) num_threads = 1;
+  if (num_threads > FILES_MAX_THREADS) num_threads = FILES_MAX_THREADS;
+  for (i = 0; i < num_threads; i++) {
+    if (pthread_create (&threads[i], NULL, files_worker, &w) != 0) break;
+  }
+  if (i == 0) files_worker (&w);
+  num_threads = i;
+  for (i = 0; i < num_threads; i++) {
+    pthread_join (threads[i], NULL);
+  }
+  pthread_mutex_destroy (&w.lock);
+  pthread_cond_destroy (&w.cond);
+  mem_free (ALLOC_SEARCH, w.queue);
+
+  ix = mem_calloc (ALLOC_SEARCH, 1, sizeof (file_index));
+  ix->dirs = w.dirs;
+  ix->num_dirs = w.num_dirs;
+  qsort (ix->dirs, ix->num_dirs, sizeof (files_dir), files_dir_cmp);
+  ix->inotify_fd = old && old->inotify_fd != -1 ? old->inotify_fd :
+    inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  files_finish (ix);
+
+  /* a directory that went away drops out, and so does its watch: the
+   * kernel only removes it for a directory that was deleted, not for one
+   * that was moved along with a parent */
+  for (i = 0; old && i < old->num_dirs; i++) {
+    int wd = old->dirs[i].wd;
+
+    if (wd != -1 && (wd >= ix->num_wd || ix->by_wd[wd] == -1)) {
+      inotify_rm_watch (ix->inotify_fd, wd);
+    }
+  }
+  if (w.num_read > 0 || !old || old->num_dirs != ix->num_dirs) {
+    files_save (ix);
+  }
+  files_free (old);
+  config.files = ix;
+  trace_span ("files refresh", start);
+}
+
+const char *files_text (int i, int *len)
+{
+  *len = config.files->path_lens[i];
+  return config.files->paths[i];
+}
+
+/* Lets the user pick a file under the working directory by fuzzy matching
+ * its path, and opens it. */
+void quick_open ()
+{
+  char *path;
+  int choice;
+
+  if (!config.files) {
+    config.files = files_load ();
+    if (!config.files) {
+      set_status_message ("Indexing files...");
+      refresh_screen ();
+    }
+  }
+  if (!config.files || files_events (config.files)) files_refresh ();
+
+  choice = finder_select ("Open: ", config.files->num_paths, files_text, 0);
+  if (choice < 0) return;
+  path = config.files->paths[choice];
+  if (editor_open (path) == -1) {
+    set_status_message ("Can't open %s: %s", path, strerror (errno));
+  } else {
+    set_status_message ("%s", path);
+  }
+}
+
+/*** symbols ***/
+
+/* An outline of the functions, types, macros and (in Markdown) headings of
+ * the open file, built on a worker thread like the JSON index. The scanner
+ * only ever looks at one row at a time, so a row can be rescanned on its
+ * own. Symbols are kept in row order for the outline and sorted by name
+ * for jumping to a definition. Names the file doesn't define are looked up
+ * in a ctags file, mapped into memory and binary searched. */
+
+#define SYMBOL_CHECK_ROWS 4096  /* rows scanned between cancel checks */
+
+typedef struct symbol {
+  int row;
+  int name;                     /* offset in names */
+  int len;
+  char kind;                    /* f(unction), t(ype), d(efine), h(eading) */
+} symbol;
+
+typedef struct symbol_index {
+  symbol *syms;                 /* in row order */
+  int count;
+  int cap;
+  int *by_name;                 /* symbols sorted by name */
+  char *names;
+  int names_len;
+  int names_cap;
+  int markdown;                 /* headings instead of code */
+  int python;                   /* def and class instead of C's rules */
+  int in_fence;                 /* inside a fenced Markdown code block */
+} symbol_index;
+
+pthread_t symbols_thread;
+int symbols_running;            /* symbols_thread has to be joined */
+atomic_int symbols_cancelled;
+pthread_mutex_t symbols_lock = PTHREAD_MUTEX_INITIALIZER;
+symbol_index *symbols_done;     /* finished index not collected yet */
+
+const char *symbol_keywords[] = {
+  "if", "else", "while", "for", "do", "switch", "case", "default", "return",
+  "goto", "break", "continue", "sizeof", "typedef", "struct", "enum",
+  "union", NULL
+};
+
+void symbols_free (symbol_index *ix)
+{
+  if (!ix) return;
+  mem_free (ALLOC_INDEX, ix->syms);
+  mem_free (ALLOC_INDEX, ix->by_name);
+  mem_free (ALLOC_INDEX, ix->names);
+  mem_free (ALLOC_INDEX, ix);
+}
+
+int is_ident (char c)
+{
+  return isalnum ((unsigned char) c) || c == '_';
+}
+
+/* Returns the length of the identifier at s, up to len. */
+int ident_len (const char *s, int len)
+{
+  int i = 0;
+
+  if (len == 0 || isdigit ((unsigned char) s[0])) return 0;
+  while (i < len && is_ident (s[i])) i++;
+  return i;
+}
+
+int is_keyword (const char *s, int len)
+{
+  int i;
+
+  for (i = 0; symbol_keywords[i]; i++) {
+    if ((int) strlen (symbol_keywords[i]) == len &&
+        memcmp (symbol_keywords[i], s, len) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Returns whether s starts with the word w. */
+int starts_with_word (const char *s, int len, const char *w)
+{
+  int n = strlen (w);
+  return len > n && memcmp (s, w, n) == 0 && !is_ident (s[n]);
+}
+
+void symbol_add (symbol_index *ix, int row, const char *name, int len,
+    char kind)
+{
+  symbol *sym;
+
+  if (len <= 0) return;
+  if (ix->count == ix->cap) {
+    ix->cap = ix->cap ? ix->cap * 2 : 256;
+    ix->syms = mem_realloc (ALLOC_INDEX, ix->syms, sizeof (symbol) * ix->cap);
+  }
+  if (ix->names_len + len + 1 > ix->names_cap) {
+    while (ix->names_len + len + 1 > ix->names_cap) {
+      ix->names_cap = ix->names_cap ? ix->names_cap * 2 : 4096;
+    }
+    ix->names = mem_realloc (ALLOC_INDEX, ix->names, ix->names_cap);
+  }
+  sym = &ix->syms[ix->count++];
+  sym->row = row;
+  sym->name = ix->names_len;
+  sym->len = len;
+  sym->kind = kind;
+  memcpy (ix->names + ix->names_len, name, len);
+  ix->names[ix->names_len + len] = '\0';
+  ix->names_len += len + 1;
+}
+
+/* Adds the symbol row defines, if any. Python's def and class can be
+ * indented; definitions in C and code like it start in the first column,
+ * where a Python call like main () would look like one too. Rows are
+ * scanned in order, which only matters for Markdown code fences. */
+void symbol_scan_row (symbol_index *ix, int row, const char *s, int len)
+{
+  const char *paren, *p;
+  int i = 0, n;
+
+  if (ix->markdown) {
+    if (len >= 3 && (memcmp (s, "```", 3) == 0 || memcmp (s, "~~~", 3) == 0)) {
+      ix->in_fence = !ix->in_fence;
+    }
+    if (ix->in_fence || len == 0 || s[0] != '#') return;
+    while (i < len && s[i] == '#') i++;
+    while (i < len && s[i] == ' ') i++;
+    while (len > i && isspace ((unsigned char) s[len - 1])) len--;
+    symbol_add (ix, row, s + i, len - i, 'h');
+    return;
+  }
+
+  if (ix->python) {
+    while (i < len && (s[i] == ' ' || s[i] == '\t')) i++;
+    if (starts_with_word (s + i, len - i, "async")) {
+      i += 5;
+      while (i < len && s[i] == ' ') i++;
+    }
+    if (starts_with_word (s + i, len - i, "def")) {
+      i += 3;
+      while (i < len && s[i] == ' ') i++;
+      symbol_add (ix, row, s + i, ident_len (s + i, len - i), 'f');
+    } else if (starts_with_word (s + i, len - i, "class") &&
+        s[len - 1] == ':') {
+      for (i += 5; i < len && s[i] == ' '; i++);
+      symbol_add (ix, row, s + i, ident_len (s + i, len - i), 't');
+    }
+    return;
+  }
+  if (len == 0 || s[0] == ' ' || s[0] == '\t') return;
+
+  if (starts_with_word (s, len, "#define")) {
+    for (i = 7; i < len && s[i] == ' '; i++);
+    symbol_add (ix, row, s + i, ident_len (s + i, len - i), 'd');
+    return;
+  }
+  if (s[0] == '}') {
+    /* the name at the end of a typedef */
+    for (i = 1; i < len && s[i] == ' '; i++);
+    n = ident_len (s + i, len - i);
+    if (n > 0 && i + n < len && s[i + n] == ';') {
+      symbol_add (ix, row, s + i, n, 't');
+    }
+    return;
+  }
+  if (starts_with_word (s, len, "typedef")) {
+    for (i = 7; i < len && s[i] == ' '; i++);
+  }
+  if (starts_with_word (s + i, len - i, "struct") ||
+      starts_with_word (s + i, len - i, "union") ||
+      starts_with_word (s + i, len - i, "enum") ||
+      starts_with_word (s + i, len - i, "class")) {
+    while (i < len && is_ident (s[i])) i++;
+    while (i < len && s[i] == ' ') i++;
+    n = ident_len (s + i, len - i);
+    /* a definition, not a declaration or a variable */
+    if (n > 0 && memchr (s, '{', len) && !memchr (s, '(', len)) {
+      symbol_add (ix, row, s + i, n, 't');
+    }
+    return;
+  }
+
+  /* a function: an identifier before the first parenthesis, with no
+   * assignment in front and no semicolon after */
+  if (!is_ident (s[0]) || is_keyword (s, ident_len (s, len))) return;
+  if ((paren = memchr (s, '(', len)) == NULL) return;
+  if (memchr (s, '=', paren - s) || s[len - 1] == ';' || s[len - 1] == ',') {
+    return;
+  }
+  for (p = paren; p > s && p[-1] == ' '; p--);
+  for (n = 0; p - n > s && is_ident (p[-n - 1]); n++);
+  if (n > 0 && !is_keyword (p - n, n) && !isdigit ((unsigned char) p[-n])) {
+    symbol_add (ix, row, p - n, n, 'f');
+  }
+}
+
+int symbol_name_cmp (const void *a, const void *b, void *arg)
 {
-  free (ab->buf);
+  symbol_index *ix = arg;
+  symbol *x = &ix->syms[*(const int *) a], *y = &ix->syms[*(const int *) b];
+  int c = strcmp (ix->names + x->name, ix->names + y->name);
+  return c ? c : x->row - y->row;
 }
 
-/*** output ***/
+void *symbols_worker (void *arg)
+{
+  symbol_index *ix = arg;
+  unsigned long long start = now_ns ();
+  int r, i;
 
-void scroll ()
+  trace_thread ("symbols");
+  for (r = 0; r < config.num_rows; r++) {
+    if (r % SYMBOL_CHECK_ROWS == 0 && atomic_load (&symbols_cancelled)) break;
+    symbol_scan_row (ix, r, config.row[r].chars, config.row[r].size);
+  }
+  if (atomic_load (&symbols_cancelled)) {
+    symbols_free (ix);
+    return NULL;
+  }
+
+  ix->by_name = mem_alloc (ALLOC_INDEX, sizeof (int) * (ix->count + 1));
+  for (i = 0; i < ix->count; i++) ix->by_name[i] = i;
+  qsort_r (ix->by_name, ix->count, sizeof (int), symbol_name_cmp, ix);
+  trace_span ("symbols", start);
+
+  pthread_mutex_lock (&symbols_lock);
+  symbols_free (symbols_done);
+  symbols_done = ix;
+  pthread_mutex_unlock (&symbols_lock);
+  wake_main ();
+  return NULL;
+}
+
+/* Stops scanning and drops the outline; call before the rows go away. */
+void symbols_stop ()
 {
-  if (config.cur_y < config.row_offset) {
-    config.row_offset = config.cur_y;
+  if (symbols_running) {
+    atomic_store (&symbols_cancelled, 1);
+    pthread_join (symbols_thread, NULL);
+    symbols_running = 0;
   }
-  if (config.cur_y >= config.row_offset + config.terminal_rows) {
-    config.row_offset = config.cur_y - config.terminal_rows + 1;
+  pthread_mutex_lock (&symbols_lock);
+  symbols_free (symbols_done);
+  symbols_done = NULL;
+  pthread_mutex_unlock (&symbols_lock);
+  symbols_free (config.symbols);
+  config.symbols = NULL;
+}
+
+/* Starts scanning the rows for symbols. */
+void symbols_start ()
+{
+  symbol_index *ix = mem_calloc (ALLOC_INDEX, 1, sizeof (symbol_index));
+  const char *dot = config.filename ? strrchr (config.filename, '.') : NULL;
+
+  ix->markdown = dot && (strcmp (dot, ".md") == 0 ||
+      strcmp (dot, ".markdown") == 0);
+  ix->python = dot && (strcmp (dot, ".py") == 0 ||
+      strcmp (dot, ".pyi") == 0 || strcmp (dot, ".pyw") == 0);
+  atomic_store (&symbols_cancelled, 0);
+  if (pthread_create (&symbols_thread, NULL, symbols_worker, ix) != 0) {
+    symbols_free (ix);
+    return;
   }
-  if (config.cur_x < config.col_offset) {
-    config.col_offset = config.cur_x;
+  symbols_running = 1;
+}
+
+/* Takes the outline once the worker has built it. */
+void symbols_collect ()
+{
+  symbol_index *ix;
+
+  pthread_mutex_lock (&symbols_lock);
+  ix = symbols_done;
+  symbols_done = NULL;
+  pthread_mutex_unlock (&symbols_lock);
+  if (!ix) return;
+
+  pthread_join (symbols_thread, NULL);
+  symbols_running = 0;
+  symbols_free (config.symbols);
+  config.symbols = ix;
+}
+
+const char *symbol_text (int i, int *len)
+{
+  symbol *sym = &config.symbols->syms[i];
+  *len = sym->len;
+  return config.symbols->names + sym->name;
+}
+
+/* Lets the user pick a symbol of the outline and jumps to it. */
+void symbol_outline ()
+{
+  int choice;
+
+  if (!config.symbols) {
+    set_status_message (symbols_running ? "Still looking for symbols..." :
+        "No symbols");
+    return;
+  }
+  choice = finder_select ("Symbols: ", config.symbols->count, symbol_text, 0);
+  if (choice >= 0) jump_to_line (config.symbols->syms[choice].row);
+}
+
+/* Returns the first symbol called name in by_name order, or -1. */
+int symbol_lookup (symbol_index *ix, const char *name)
+{
+  int lo = 0, hi = ix->count;
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (strcmp (ix->names + ix->syms[ix->by_name[mid]].name, name) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
   }
-  if (config.cur_x >= config.col_offset + config.terminal_cols) {
-    config.col_offset = config.cur_x - config.terminal_cols + 1;
+  if (lo < ix->count &&
+      strcmp (ix->names + ix->syms[ix->by_name[lo]].name, name) == 0) {
+    return lo;
   }
+  return -1;
 }
 
-void draw_rows (append_buffer * ab)
+/* Compares the tag of the line at s (up to its tab) with name. */
+int tag_cmp (const char *s, const char *end, const char *name)
 {
-  int y;
-  for (y = 0; y < config.terminal_rows; y++) {
-    int file_row = y + config.row_offset;
-    if (file_row >= config.num_rows) {
-      if (config.num_rows == 0 && y == config.terminal_rows / 3) {
-        char welcome[80];
-        int welcome_len = snprintf (welcome, sizeof (welcome),
-            "Pico editor -- version %s", PICO_VERSION);
-        if (welcome_len > config.terminal_rows) {
-          welcome_len = config.terminal_rows;
-        }
-        int padding = (config.terminal_cols - welcome_len) / 2;
-        if (padding) {
-          ab_append (ab, "~", 1);
-          padding--;
+  for (; s < end && *s != '\t' && *s != '\n'; s++, name++) {
+    if (*name == '\0') return 1;
+    if (*s != *name) return (unsigned char) *s - (unsigned char) *name;
+  }
+  return *name ? -1 : 0;
+}
+
+/* Returns the start of the first line that starts at offset i or later. */
+long tags_line_at (const char *data, long size, long i)
+{
+  const char *nl;
+
+  if (i == 0) return 0;
+  nl = memchr (data + i - 1, '\n', size - i + 1);
+  return nl ? nl - data + 1 : size;
+}
+
+/* Returns the start of the first line of the sorted tags file data whose
+ * tag is not less than name. The line probed for an offset only moves
+ * forward as the offset does, so whether its tag is less than name is
+ * monotonic and a binary search over offsets finds the line. */
+long tags_lower_bound (const char *data, long size, const char *name)
+{
+  long lo = 0, hi = size;
+
+  while (lo < hi) {
+    long mid = lo + (hi - lo) / 2;
+    long line = tags_line_at (data, size, mid);
+
+    if (line < size && tag_cmp (data + line, data + size, name) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return tags_line_at (data, size, lo);
+}
+
+/* Returns whether the header of the tags file data says its lines are
+ * sorted byte by byte. Those sorted with case folded (2), unsorted (0) or
+ * without a header can't be binary searched. */
+int tags_sorted (const char *data, long size)
+{
+  static const char key[] = "!_TAG_FILE_SORTED\t";
+  long i = 0, n = sizeof (key) - 1;
+
+  while (i < size && data[i] == '!') {
+    if (size - i > n && memcmp (data + i, key, n) == 0) {
+      return data[i + n] == '1';
+    }
+    i = tags_line_at (data, size, i + 1);
+  }
+  return 0;
+}
+
+/* Moves to the row a tags address points at: a line number, or a search
+ * pattern like /^int main ()$/. Returns -1 if there is no such row. */
+int tag_jump (const char *addr, const char *end)
+{
+  char pattern[512];
+  int len = 0, whole = 0, r;
+  char delim = *addr;
+
+  if (isdigit ((unsigned char) *addr)) {
+    jump_to_line (atoi (addr) - 1);
+    return 0;
+  }
+  if (delim != '/' && delim != '?') return -1;
+  addr++;
+  if (addr < end && *addr == '^') addr++;
+  for (; addr < end && *addr != delim && len < (int) sizeof (pattern) - 1;
+      addr++) {
+    if (*addr == '\\' && addr + 1 < end) addr++;
+    pattern[len++] = *addr;
+  }
+  if (len > 0 && pattern[len - 1] == '$') {
+    len--;
+    whole = 1;
+  }
+
+  for (r = 0; r < config.num_rows; r++) {
+    erow *row = &config.row[r];
+    if ((whole ? row->size == len : row->size >= len) &&
+        memcmp (row->chars, pattern, len) == 0) {
+      jump_to_line (r);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/* Looks name up in the tags file at path and jumps to the definition,
+ * letting the user pick if there are several. Returns -1 if the file has
+ * no such tag. */
+int tags_jump (const char *path, const char *name)
+{
+  char **items = NULL;
+  const char *data, *p, *end, *line, *eol;
+  int fd, count = 0, choice, ret = -1, i, sorted, cmp;
+  struct stat st;
+
+  if ((fd = open (path, O_RDONLY | O_CLOEXEC)) == -1) return -1;
+  if (fstat (fd, &st) == -1 || st.st_size == 0) {
+    close (fd);
+    return -1;
+  }
+  data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (data == MAP_FAILED) return -1;
+  end = data + st.st_size;
+
+  /* every line for the name, "name<TAB>file<TAB>address...", which in a
+   * sorted file follow each other */
+  sorted = tags_sorted (data, st.st_size);
+  p = sorted ? data + tags_lower_bound (data, st.st_size, name) : data;
+  while (p < end) {
+    line = p;
+    eol = memchr (p, '\n', end - p);
+    p = eol ? eol + 1 : end;
+    if (!eol) eol = end;
+
+    /* a line without a file isn't a tag */
+    cmp = tag_cmp (line, end, name);
+    if (cmp != 0 || !memchr (line, '\t', eol - line)) {
+      if (sorted && cmp > 0) break;
+      continue;
+    }
+    if (count % 16 == 0) {
+      items = mem_realloc (ALLOC_SEARCH, items,
+          sizeof (char *) * (count + 16));
+    }
+    if (mem_asprintf (ALLOC_SEARCH, &items[count], "%.*s",
+          (int) (eol - line), line) == -1) {
+      items[count] = mem_strdup (ALLOC_SEARCH, "");
+    }
+    count++;
+  }
+
+  if (count > 0) {
+    choice = count == 1 ? 0 : picker_select (name, items, count);
+    ret = 0;
+    if (choice >= 0) {
+      const char *file = strchr (items[choice], '\t');
+      const char *addr = file ? strchr (++file, '\t') : NULL;
+      const char *slash = strrchr (path, '/');
+      char *target;
+
+      if (addr) {
+        /* file names are relative to the directory of the tags file */
+        if (file[0] != '/' && slash) {
+          mem_asprintf (ALLOC_SEARCH, &target, "%.*s/%.*s",
+              (int) (slash - path), path, (int) (addr - file), file);
+        } else {
+          mem_asprintf (ALLOC_SEARCH, &target, "%.*s", (int) (addr - file),
+              file);
         }
-        while (padding--) {
-          ab_append (ab, " ", 1);
+        if (!target || editor_open (target) == -1) {
+          set_status_message ("Can't open %s", target ? target : file);
+        } else if (tag_jump (addr + 1, addr + strlen (addr)) == -1) {
+          set_status_message ("%s moved in %s", name, target);
+        } else {
+          set_status_message ("%s", target);
         }
-        ab_append (ab, welcome, welcome_len);
-      } else {
-        ab_append (ab, "~", 1);
+        mem_free (ALLOC_SEARCH, target);
       }
-    } else {
-      int len = config.row[file_row].size - config.col_offset;
-      if (len < 0) len = 0;
-      if (len > config.terminal_cols) len = config.terminal_cols;
-      ab_append (ab, &config.row[file_row].chars[config.col_offset], len);
     }
+  }
+
+  for (i = 0; i < count; i++) mem_free (ALLOC_SEARCH, items[i]);
+  mem_free (ALLOC_SEARCH, items);
+  munmap ((void *) data, st.st_size);
+  return ret;
+}
+
+/* Jumps to the definition of the identifier under the cursor: in the
+ * outline of the file, or else through the tags file next to the file or
+ * in the working directory. */
+void goto_definition ()
+{
+  char name[256], path[PATH_MAX];
+  const char *slash;
+  int from, to, i;
+  erow *row;
+
+  if (config.cur_y >= config.num_rows) return;
+  row = &config.row[config.cur_y];
+  for (from = config.cur_x; from > 0 && is_ident (row->chars[from - 1]);
+      from--);
+  for (to = config.cur_x; to < row->size && is_ident (row->chars[to]); to++);
+  if (from == to || to - from >= (int) sizeof (name)) {
+    set_status_message ("No identifier under the cursor");
+    return;
+  }
+  memcpy (name, row->chars + from, to - from);
+  name[to - from] = '\0';
 
-    ab_append (ab, "\x1b[K", 3);
-    if (y < config.terminal_rows - 1) {
-      ab_append (ab, "\r\n", 2);
+  if (config.symbols && (i = symbol_lookup (config.symbols, name)) != -1) {
+    symbol_index *ix = config.symbols;
+    int first = i;
+
+    /* with several definitions (a struct and its typedef, say), go to
+     * the next one after the cursor, so that repeating cycles through
+     * them */
+    while (i < ix->count &&
+        strcmp (ix->names + ix->syms[ix->by_name[i]].name, name) == 0 &&
+        ix->syms[ix->by_name[i]].row <= config.cur_y) {
+      i++;
+    }
+    if (i == ix->count ||
+        strcmp (ix->names + ix->syms[ix->by_name[i]].name, name) != 0) {
+      i = first;
     }
+    jump_to_line (ix->syms[ix->by_name[i]].row);
+    return;
+  }
+
+  slash = config.filename ? strrchr (config.filename, '/') : NULL;
+  if (slash) {
+    snprintf (path, sizeof (path), "%.*s/tags",
+        (int) (slash - config.filename), config.filename);
+    if (tags_jump (path, name) == 0) return;
   }
+  if (tags_jump ("tags", name) == 0) return;
+  set_status_message ("No definition of %s", name);
 }
 
-void refresh_screen ()
+/*** vcs ***/
+
+/* The gutter marks lines that differ from the file's version in git HEAD.
+ * A worker thread reads that version with git show and diffs it against
+ * hashes of the lines taken when the file was opened, so the rows are never
+ * touched off the main thread. The finished job wakes read_key, which hands
+ * the marks over; a job started for rows that have since been replaced is
+ * thrown away. */
+
+typedef struct vcs_job {
+  char *path;
+  int generation;               /* config.vcs_generation when started */
+  unsigned long long *hashes;   /* line hashes of the rows */
+  int num_lines;
+  unsigned char *marks;         /* enum vcs_mark per line, NULL on failure */
+  density changes;              /* marked lines, for the scrollbar */
+} vcs_job;
+
+pthread_mutex_t vcs_lock = PTHREAD_MUTEX_INITIALIZER;
+vcs_job *vcs_done;              /* finished job not collected yet */
+
+unsigned long long line_hash (const char *s, int len)
 {
-  scroll ();
+  unsigned long long h = 14695981039346656037ULL;   /* FNV-1a */
+  int i;
 
-  append_buffer ab = ABUF_INIT;
+  for (i = 0; i < len; i++) {
+    h = (h ^ (unsigned char) s[i]) * 1099511628211ULL;
+  }
+  return h;
+}
 
-  ab_append (&ab, "\x1b[?25l", 6);
-  ab_append (&ab, "\x1b[H", 3);
+void vcs_job_free (vcs_job *job)
+{
+  mem_free (ALLOC_VCS, job->path);
+  mem_free (ALLOC_VCS, job->hashes);
+  mem_free (ALLOC_VCS, job->marks);
+  mem_free (ALLOC_VCS, job);
+}
 
-  draw_rows (&ab);
+/* Reads the HEAD version of path into *text. Returns -1 if git fails, which
+ * includes files outside a repository or not committed yet. */
+int vcs_read_head (const char *path, char **text, size_t *len)
+{
+  const char *slash = strrchr (path, '/');
+  char *dir, *spec, *argv[6];
+  size_t cap = 8192;
+  int fds[2], status = -1;
+  posix_spawn_file_actions_t actions;
+  pid_t pid;
+  ssize_t n;
 
-  char buf[32];
-  snprintf (buf, sizeof (buf), "\x1b[%d;%dH",
-      (config.cur_y - config.row_offset) + 1,
-      (config.cur_x - config.col_offset) + 1);
-  ab_append (&ab, buf, strlen (buf));
+  if (slash) {
+    dir = mem_alloc (ALLOC_VCS, slash - path + 2);
+    memcpy (dir, path, slash - path + 1);
+    dir[slash - path + 1] = '\0';
+  } else {
+    dir = mem_strdup (ALLOC_VCS, ".");
+  }
+  if (mem_asprintf (ALLOC_VCS, &spec, "HEAD:./%s", slash ? slash + 1 : path)
+      == -1) {
+    mem_free (ALLOC_VCS, dir);
+    return -1;
+  }
+  argv[0] = "git";
+  argv[1] = "-C";
+  argv[2] = dir;
+  argv[3] = "show";
+  argv[4] = spec;
+  argv[5] = NULL;
 
-  ab_append (&ab, "\x1b[?25h", 6);
+  *text = NULL;
+  *len = 0;
+  if (pipe2 (fds, O_CLOEXEC) == 0) {
+    posix_spawn_file_actions_init (&actions);
+    posix_spawn_file_actions_addopen (&actions, STDIN_FILENO, "/dev/null",
+        O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2 (&actions, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen (&actions, STDERR_FILENO, "/dev/null",
+        O_WRONLY, 0);
+    if (posix_spawnp (&pid, "git", &actions, NULL, argv, environ) == 0) {
+      close (fds[1]);
+      *text = mem_alloc (ALLOC_VCS, cap);
+      while ((n = read (fds[0], *text + *len, cap - *len)) > 0 ||
+          (n == -1 && errno == EINTR)) {
+        if (n > 0) *len += n;
+        if (*len == cap) {
+          cap *= 2;
+          *text = mem_realloc (ALLOC_VCS, *text, cap);
+        }
+      }
+      while (waitpid (pid, &status, 0) == -1 && errno == EINTR);
+    } else {
+      close (fds[1]);
+    }
+    close (fds[0]);
+    posix_spawn_file_actions_destroy (&actions);
+  }
 
-  write (STDOUT_FILENO, ab.buf, ab.len);
-  ab_free (&ab);
+  mem_free (ALLOC_VCS, dir);
+  mem_free (ALLOC_VCS, spec);
+  if (status == -1 || !WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+    mem_free (ALLOC_VCS, *text);
+    *text = NULL;
+    return -1;
+  }
+  return 0;
 }
 
-/*** input ***/
+/* Splits text into lines the way editor_open does and returns their
+ * hashes, storing the count in *count. */
+unsigned long long *vcs_hash_lines (const char *text, size_t len, int *count)
+{
+  unsigned long long *hashes = NULL;
+  int num = 0, cap = 0;
+  size_t at = 0;
 
-void move_cursor (int key)
+  while (at < len) {
+    const char *nl = memchr (text + at, '\n', len - at);
+    size_t end = nl ? (size_t) (nl - text) : len;
+    size_t next = nl ? end + 1 : len;
+
+    while (end > at && (text[end - 1] == '\r' || text[end - 1] == '\n')) {
+      end--;
+    }
+    if (num == cap) {
+      cap = cap ? cap * 2 : 1024;
+      hashes = mem_realloc (ALLOC_VCS, hashes, sizeof (*hashes) * cap);
+    }
+    hashes[num++] = line_hash (text + at, end - at);
+    at = next;
+  }
+  *count = num;
+  return hashes;
+}
+
+/* Marks a run of added lines starting at line at of num_lines that
+ * replaced deleted lines. */
+void vcs_mark_hunk (unsigned char *marks, int num_lines, int at, int added,
+    int deleted)
 {
-  erow *row;
+  int i;
 
-  row = (config.cur_y >= config.num_rows) ? NULL : &config.row[config.cur_y];
-  switch (key) {
-    case ARROW_LEFT:
-      if (config.cur_x > 0) {
-        config.cur_x--;
-      } else if (config.cur_y > 0) {
-        config.cur_y--;
-        config.cur_x = config.row[config.cur_y].size;
-      }
-      break;
-    case ARROW_RIGHT:
-      if (row && config.cur_x < row->size) {
-        config.cur_x++;
-      } else if (row && config.cur_x == row->size) {
-        config.cur_y++;
-        config.cur_x = 0;
+  for (i = 0; i < added; i++) {
+    marks[at + i] = i < deleted ? VCS_CHANGED : VCS_ADDED;
+  }
+  if (added == 0 && deleted > 0 && num_lines > 0) {
+    /* shown on the line that follows the deleted ones */
+    marks[at < num_lines ? at : num_lines - 1] = VCS_DELETED;
+  }
+}
+
+int vcs_hash_cmp (const void *a, const void *b)
+{
+  unsigned long long x = *(const unsigned long long *) a;
+  unsigned long long y = *(const unsigned long long *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Marks the lines of new that are not in old. Leading and trailing lines
+ * that agree are skipped; the rest is aligned by a longest common
+ * subsequence when the table fits in VCS_DIFF_MAX_CELLS, and otherwise
+ * every line whose hash is not among the old lines counts as changed. */
+void vcs_diff (const unsigned long long *old, int num_old,
+    const unsigned long long *new, int num_new, unsigned char *marks)
+{
+  int total = num_new;
+  int pre = 0, suf = 0;
+  int n, m, i, j;
+
+  while (pre < num_old && pre < num_new && old[pre] == new[pre]) pre++;
+  while (suf < num_old - pre && suf < num_new - pre &&
+      old[num_old - 1 - suf] == new[num_new - 1 - suf]) {
+    suf++;
+  }
+  old += pre;
+  new += pre;
+  n = num_old - pre - suf;
+  m = num_new - pre - suf;
+  if (n == 0 || m == 0) {
+    vcs_mark_hunk (marks, total, pre, m, n);
+    return;
+  }
+
+  if ((long long) (n + 1) * (m + 1) <= VCS_DIFF_MAX_CELLS) {
+    /* lcs[i * (m + 1) + j] is the LCS length of old[i..] and new[j..] */
+    int *lcs = mem_alloc (ALLOC_VCS, sizeof (int) * (n + 1) * (m + 1));
+    int added = 0, deleted = 0;
+
+    for (i = n; i >= 0; i--) {
+      for (j = m; j >= 0; j--) {
+        int *cell = &lcs[i * (m + 1) + j];
+        if (i == n || j == m) {
+          *cell = 0;
+        } else if (old[i] == new[j]) {
+          *cell = cell[m + 2] + 1;
+        } else {
+          int down = cell[m + 1], right = cell[1];
+          *cell = down > right ? down : right;
+        }
       }
-      break;
-    case ARROW_UP:
-      if (config.cur_y > 0) {
-        config.cur_y--;
+    }
+    for (i = 0, j = 0; i < n || j < m; ) {
+      if (i < n && j < m && old[i] == new[j]) {
+        vcs_mark_hunk (marks, total, pre + j - added, added, deleted);
+        added = deleted = 0;
+        i++;
+        j++;
+      } else if (j == m ||
+          (i < n && lcs[(i + 1) * (m + 1) + j] >= lcs[i * (m + 1) + j + 1])) {
+        deleted++;
+        i++;
+      } else {
+        added++;
+        j++;
       }
-      break;
-    case ARROW_DOWN:
-      if (config.cur_y < config.num_rows) {
-        config.cur_y++;
+    }
+    vcs_mark_hunk (marks, total, pre + m - added, added, deleted);
+    mem_free (ALLOC_VCS, lcs);
+  } else {
+    unsigned long long *sorted = mem_alloc (ALLOC_VCS, sizeof (*old) * n);
+
+    memcpy (sorted, old, sizeof (*old) * n);
+    qsort (sorted, n, sizeof (*old), vcs_hash_cmp);
+    for (j = 0; j < m; j++) {
+      if (!bsearch (&new[j], sorted, n, sizeof (*old), vcs_hash_cmp)) {
+        marks[pre + j] = VCS_CHANGED;
       }
-      break;
+    }
+    mem_free (ALLOC_VCS, sorted);
   }
+}
 
-  row = (config.cur_y >= config.num_rows) ? NULL : &config.row[config.cur_y];
-  int row_len = row ? row->size : 0;
-  if (config.cur_x > row_len) {
-    config.cur_x = row_len;
+void *vcs_worker (void *arg)
+{
+  vcs_job *job = arg;
+  unsigned long long start = now_ns ();
+  char *text;
+  size_t len;
+  int i;
+
+  trace_thread ("vcs");
+  if (vcs_read_head (job->path, &text, &len) == 0) {
+    int num_old;
+    unsigned long long *old = vcs_hash_lines (text, len, &num_old);
+
+    mem_free (ALLOC_VCS, text);
+    job->marks = mem_calloc (ALLOC_VCS, job->num_lines, 1);
+    vcs_diff (old, num_old, job->hashes, job->num_lines, job->marks);
+    mem_free (ALLOC_VCS, old);
+    density_reset (&job->changes);
+    for (i = 0; i < job->num_lines; i++) {
+      if (job->marks[i]) density_add (&job->changes, i, 1);
+    }
+  }
+  trace_span ("vcs diff", start);
+
+  /* a slower job for older rows must not replace a newer result */
+  pthread_mutex_lock (&vcs_lock);
+  if (vcs_done && vcs_done->generation > job->generation) {
+    vcs_job_free (job);
+  } else {
+    if (vcs_done) vcs_job_free (vcs_done);
+    vcs_done = job;
   }
+  pthread_mutex_unlock (&vcs_lock);
+  wake_main ();
+  return NULL;
 }
 
-void process_key_press()
+/* Drops the marks of the current rows and starts computing new ones. Call
+ * whenever the rows or the file on disk change. */
+void vcs_refresh ()
 {
-  int c = read_key ();
+  vcs_job *job;
+  pthread_t thread;
+  int i;
 
-  switch (c) {
-    case CTRL_KEY('q'):
-      write (STDOUT_FILENO, "\x1b[2J", 4);
-      write (STDOUT_FILENO, "\x1b[H", 3);
-      exit (0);
-      break;
-    case HOME_KEY:
-      config.cur_x = 0;
-      break;
-    case END_KEY:
-      config.cur_x = config.terminal_cols - 1;
-      break;
-    case PAGE_UP:
-    case PAGE_DOWN:
-      {
-        int times = config.terminal_rows;
-        while (times--) move_cursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-      }
-      break;
-    case ARROW_UP:
-    case ARROW_DOWN:
-    case ARROW_LEFT:
-    case ARROW_RIGHT:
-      move_cursor (c);
-      break;
+  config.vcs_generation++;
+  mem_free (ALLOC_VCS, config.vcs_marks);
+  config.vcs_marks = NULL;
+  density_reset (&config.density[DENSITY_CHANGES]);
+  if (!config.filename || config.num_rows == 0) return;
+
+  job = mem_calloc (ALLOC_VCS, 1, sizeof (vcs_job));
+  job->path = mem_strdup (ALLOC_VCS, config.filename);
+  job->generation = config.vcs_generation;
+  job->num_lines = config.num_rows;
+  job->hashes = mem_alloc (ALLOC_VCS,
+      sizeof (unsigned long long) * config.num_rows);
+  for (i = 0; i < config.num_rows; i++) {
+    job->hashes[i] = line_hash (config.row[i].chars, config.row[i].size);
+  }
+  if (pthread_create (&thread, NULL, vcs_worker, job) != 0) {
+    vcs_job_free (job);
+    return;
   }
+  pthread_detach (thread);
+}
+
+/* Takes the marks of a finished job, if they are for the current rows. */
+void vcs_collect ()
+{
+  vcs_job *job;
 
+  pthread_mutex_lock (&vcs_lock);
+  job = vcs_done;
+  vcs_done = NULL;
+  pthread_mutex_unlock (&vcs_lock);
+
+  if (!job) return;
+  if (job->generation == config.vcs_generation && job->marks) {
+    mem_free (ALLOC_VCS, config.vcs_marks);
+    config.vcs_marks = job->marks;
+    config.density[DENSITY_CHANGES] = job->changes;
+    job->marks = NULL;
+  }
+  vcs_job_free (job);
 }
 
 /*** init ***/
@@ -417,24 +8427,171 @@ void init_editor ()
   config.row_offset = 0;
   config.col_offset = 0;
   config.num_rows = 0;
+  config.row_cap = 0;
   config.row = NULL;
+  config.filename = NULL;
+  config.compression = COMPRESS_NONE;
+  config.gutter_width = 0;
+  config.vcs_marks = NULL;
+  config.vcs_generation = 0;
+  config.json = NULL;
+  config.highlight = NULL;
+  config.files = NULL;
+  config.symbols = NULL;
+  config.json_folds = NULL;
+  config.num_json_folds = 0;
+  config.json_path_at = -1;
+  if (pipe2 (config.wake_fds, O_CLOEXEC | O_NONBLOCK) == -1) {
+    die ("pipe");
+  }
+  config.macro_len = 0;
+  config.macro_recording = 0;
+  config.macro_pos = -1;
+  config.rendering_suspended = 0;
+  config.sel_active = 0;
+  config.dragging = 0;
+  config.scroll_pending = 0;
+  config.drawn_row_offset = 0;
+  config.drawn_col_offset = 0;
+  config.front_valid = 0;
+  config.term_x = -1;
+  config.term_y = -1;
+  config.term_style = -1;
+  config.term_cursor_hidden = 0;
+  config.term_caps = 0;
+  config.num_pending_input = 0;
+  config.show_overlay = 0;
+  config.probing = 0;
+  config.cpr_len = 0;
+  config.paste_len = 0;
+  /* the input path shouldn't allocate, so its buffers start out big
+   * enough for most pastes and macros */
+  config.paste_cap = PASTE_RESERVE;
+  config.paste = mem_alloc (ALLOC_INPUT, config.paste_cap);
+  config.macro_cap = MACRO_RESERVE;
+  config.macro_keys = mem_alloc (ALLOC_INPUT, sizeof (int) * config.macro_cap);
+  config.status_msg[0] = '\0';
+  config.status_msg_time = 0;
+
+  /* without an answer from the terminal yet, assume 80x24 until the probe
+   * reports the real size */
+  unsigned long long start = now_ns ();
+  int size_known = get_window_size (&config.terminal_rows,
+      &config.terminal_cols) == 0;
+  profile_phase (PHASE_WINDOW_SIZE, start);
+  if (!size_known) {
+    config.terminal_rows = 24;
+    config.terminal_cols = 80;
+  }
+  config.terminal_rows -= 2;
+  screen_resize ();
+
+  probe_terminal (!size_known);
+  highlight_load ();
+}
 
-  if (get_window_size (&config.terminal_rows, &config.terminal_cols) == -1) {
-    die ("get_window_size");
+/* Runs after the terminal has been restored. */
+void exit_report ()
+{
+  if (config.output_stats && config.bytes_full) {
+    fprintf (stderr, "pico: sent %lld bytes of output, full redraws would "
+        "have sent %lld (%.1f%% saved)\n", config.bytes_sent,
+        config.bytes_full,
+        100.0 * (config.bytes_full - config.bytes_sent) / config.bytes_full);
+  }
+  if (config.latency_report && config.latency.total) {
+    char buf[128];
+    latency_summary (buf, sizeof (buf));
+    fprintf (stderr, "pico: %s\n", buf);
+  }
+  if (config.startup_profile) {
+    print_startup_profile ();
+  }
+  if (config.alloc_failed) {
+    int i;
+    fprintf (stderr, "pico: --alloc-check: a key press or frame allocated:");
+    for (i = 0; i < ALLOC_COUNT; i++) {
+      if (config.alloc_last[i]) {
+        fprintf (stderr, " %s %llu", alloc_names[i], config.alloc_last[i]);
+      }
+    }
+    fprintf (stderr, "\n");
+  }
+  if (config.alloc_stats || config.alloc_failed) {
+    print_alloc_stats ();
   }
 }
 
+void usage ()
+{
+  fprintf (stderr, "Usage: pico [--output-stats] [--latency-report] "
+      "[--startup-profile] [--alloc-stats] [--alloc-check] [file]\n");
+  exit (1);
+}
+
 int main (int argc, char *argv[])
 {
+  char *filename = NULL;
+  unsigned long long start;
+  int i;
+
+  config.startup_ns = now_ns ();
+  trace_thread ("main");
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp (argv[i], "--output-stats") == 0) {
+      config.output_stats = 1;
+    } else if (strcmp (argv[i], "--latency-report") == 0) {
+      config.latency_report = 1;
+    } else if (strcmp (argv[i], "--startup-profile") == 0) {
+      config.startup_profile = 1;
+    } else if (strcmp (argv[i], "--alloc-stats") == 0) {
+      config.alloc_stats = 1;
+    } else if (strcmp (argv[i], "--alloc-check") == 0) {
+      config.alloc_check = 1;
+    } else if (argv[i][0] == '-' || filename) {
+      usage ();
+    } else {
+      filename = argv[i];
+    }
+  }
+
+  /* registered first so that it runs after disable_raw_mode */
+  atexit (exit_report);
+  start = now_ns ();
   enable_raw_mode ();
+  profile_phase (PHASE_RAW_MODE, start);
+  start = now_ns ();
   init_editor ();
-  if (argc >= 2) {
-    editor_open(argv[1]);
+  profile_phase (PHASE_INIT, start);
+  if (filename) {
+    start = now_ns ();
+    if (editor_open (filename) == -1) {
+      die ("open");
+    }
+    profile_phase (PHASE_OPEN, start);
   }
 
+  /* a problem with the file comes before the help */
+  if (config.status_msg[0] == '\0') {
+    set_status_message ("HELP: Ctrl-Q = quit | Ctrl-G = grep | Ctrl-R/Ctrl-E = record/apply macro");
+  }
+
+  start = now_ns ();
+  refresh_screen ();
+  profile_phase (PHASE_FIRST_FRAME, start);
+  config.first_frame_ns = now_ns () - config.startup_ns;
+
   while (1) {
+    unsigned long long allocs[ALLOC_COUNT];
+
+    alloc_snapshot (allocs);
+    /* handle everything already typed before drawing the next frame */
+    do {
+      process_key_press ();
+    } while (input_pending ());
     refresh_screen ();
-    process_key_press ();
+    alloc_frame_done (allocs);
   }
 
   return 0;